@@ -0,0 +1,36 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace kfk
+{
+    /* common header of every ACPI system description table */
+    struct AcpiHeader
+    {
+        char signature[4];
+        uint32_t length; /* including this header */
+        uint8_t revision;
+        uint8_t checksum;
+        char oem_id[6];
+        char oem_table_id[8];
+        uint32_t oem_revision;
+        uint32_t creator_id;
+        uint32_t creator_revision;
+    } __attribute__((packed));
+
+    /* just enough ACPI to find static tables; no AML */
+    class Acpi
+    {
+    public:
+        /* locate the RSDT/XSDT from the physical address of the RSDP; false if it is missing or corrupt */
+        static bool init(uintptr_t rsdp_phys) noexcept;
+
+        /* map the first table with `signature` and a valid checksum; nullptr if there is none. stays mapped */
+        static const AcpiHeader *find(const char *signature) noexcept;
+    };
+
+    using acpi = Acpi;
+}
@@ -2,17 +2,66 @@
 
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+#include <kafka/gdt.hpp>
+#include <kafka/tss.hpp>
 #include <kafka/types.hpp>
 #include <kafka/hal/cpu.hpp>
 
 namespace kfk
 {
+    /* per-CPU CPU state; one PER_CPU instance. entry code reads the first fields by offset */
+    struct CpuLocal
+    {
+        uint64_t kstack; /* kernel stack top for syscall entry */
+        uint64_t ustack; /* user rsp saved by syscall entry */
+        uint32_t id;
+
+        GDTEntry gdt[7];
+        GDTDescriptor gdtr;
+        alignas(16) TSS tss;
+    };
+
+    static_assert(offsetof(CpuLocal, kstack) == 0 && offsetof(CpuLocal, ustack) == 8,
+                  "entry code depends on this layout");
+
+    /*
+     * what syscall entry leaves at the top of the kernel stack, lowest address
+     * first. the callee-saved registers are only there for SYSCALL_FULL calls;
+     * the rest is always pushed, ending in an iretq frame
+     */
+    struct SyscallFrame
+    {
+        uint64_t r15, r14, r13, r12, rbp, rbx;
+        uint64_t r9, r8, r10, rdx, rsi, rdi;
+        uint64_t nr; /* rax on entry */
+        uint64_t rip, cs, rflags, rsp, ss;
+    };
+
     template<>
     class cpu_traits<x86_64>
     {
 	public:
         static void init(uint64_t offset) noexcept;
 
+        static void smp_init(volatile limine_smp_request *request, void (*entry)() = nullptr) noexcept;
+
+        static uint32_t id() noexcept;
+
+        static uint32_t count() noexcept;
+
+        /* the calling CPU's block */
+        static CpuLocal *local() noexcept;
+
+        /* the GS base the calling CPU runs the kernel with; found without GS, so it holds whatever GS is loaded */
+        static uintptr_t kernel_gs_base() noexcept;
+
+        static void set_kernel_stack(uintptr_t top) noexcept;
+
+        [[noreturn]] static void enter_user(uintptr_t entry, uintptr_t stack_top, uintptr_t arg,
+                                            bool interrupts = true) noexcept;
+
 		/* CPU utils */
 		[[noreturn]] static void halt() noexcept;
 
@@ -24,6 +73,10 @@ namespace kfk
 
 		static void ltr(uint16_t selector) noexcept;
 
+		static uint8_t inb(uint16_t port) noexcept;
+
+		static void outb(uint16_t port, uint8_t value) noexcept;
+
 		static void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax, uint32_t *ebx,
 								  uint32_t *ecx,
 								  uint32_t *edx) noexcept;
@@ -47,5 +100,23 @@ namespace kfk
 		static void xsetbv(uint32_t xcr, uint64_t value) noexcept;
 
 		static void pause() noexcept;
+
+		static void idle() noexcept;
+
+		static uintptr_t init_context(uintptr_t stack_top, void (*entry)(void *), void *arg) noexcept;
+
+		static void switch_context(uintptr_t *save_sp, uintptr_t load_sp) noexcept;
+
+		static uint64_t rdtsc() noexcept;
+
+		/* TSC ticks per second as CPUID reports it; 0 if it does not, or if the TSC is not invariant */
+		static uint64_t tsc_frequency() noexcept;
+
+		static bool rdrand(uint64_t *value) noexcept;
+
+		static bool rdseed(uint64_t *value) noexcept;
+
+		/* best available boot-time randomness: RDSEED, then RDRAND, then a whitened TSC */
+		static uint64_t entropy() noexcept;
     };
 }
\ No newline at end of file
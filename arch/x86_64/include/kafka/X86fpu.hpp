@@ -0,0 +1,34 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#pragma once
+
+#include <stdint.h>
+#include <kafka/types.hpp>
+#include <kafka/hal/fpu.hpp>
+
+namespace kfk
+{
+    template<>
+    class fpu_traits<x86_64>
+    {
+    public:
+        /* enable SSE/XSAVE on the calling CPU and arm the #NM trap; the BSP also picks the save format */
+        static void init() noexcept;
+
+        static void switch_out(FpuContext *context) noexcept;
+
+        static void switch_in(FpuContext *context) noexcept;
+
+        static void release(FpuContext *context) noexcept;
+
+        static void begin() noexcept;
+
+        static void end() noexcept;
+
+        /* whether `begin` may be used yet; false until the boot CPU ran `init` */
+        static bool ready() noexcept;
+
+        /* #NM: the running thread touched the FPU while CR0.TS was set */
+        static void trap() noexcept;
+    };
+}
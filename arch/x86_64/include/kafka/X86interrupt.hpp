@@ -13,6 +13,11 @@ namespace kfk
 	public:
 		static void init() noexcept;
 
+		static void init_controllers(volatile limine_rsdp_request *request) noexcept;
+
+		/* load the IDT built by `init` on the calling CPU; for the APs */
+		static void load() noexcept;
+
 		static void enable(uint16_t n) noexcept;
 
 		static void disable(uint16_t n) noexcept;
@@ -21,6 +26,13 @@ namespace kfk
 
 		static void disable() noexcept;
 
+		static uint64_t save() noexcept;
+
+		static void restore(uint64_t state) noexcept;
+
+		static bool set_affinity(uint16_t n, uint32_t cpu) noexcept;
+		static bool send_ipi(uint32_t cpu, Vint id) noexcept;
+
 		static void register_handler(Vint id, int_handler handler, void *context = nullptr,
 									 uint8_t priority = 128, IntFlags flags = IntFlags::NONE) noexcept;
 
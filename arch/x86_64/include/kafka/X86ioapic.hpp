@@ -0,0 +1,41 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#pragma once
+
+#include <stdint.h>
+#include <kafka/X86acpi.hpp>
+
+namespace kfk
+{
+    /*
+     * I/O APICs as the MADT describes them. lines are ISA IRQs (0-15); the
+     * MADT's source overrides say which global system interrupt and which
+     * polarity and trigger each one really has. every pin starts masked
+     */
+    class Ioapic
+    {
+    public:
+        static constexpr uint8_t ISA_IRQS = 16;
+
+        /* map every I/O APIC in `madt`, mask all pins and retire the 8259s; false if there is none */
+        static bool init(const AcpiHeader *madt) noexcept;
+
+        /* whether `init` found an I/O APIC */
+        static bool present() noexcept;
+
+        /* deliver `irq` as `vector` to the APIC with `apic_id`; the mask bit is kept. false if it cannot be addressed */
+        static bool route(uint8_t irq, uint8_t vector, uint32_t apic_id) noexcept;
+
+        static void mask(uint8_t irq) noexcept;
+
+        static void unmask(uint8_t irq) noexcept;
+
+        /* override the MADT's trigger; level lines are taken to be active low, as shared PCI lines are */
+        static void set_trigger(uint8_t irq, bool level) noexcept;
+
+        /* whether `irq` is level triggered, as the MADT or `set_trigger` last said */
+        static bool level_triggered(uint8_t irq) noexcept;
+    };
+
+    using ioapic = Ioapic;
+}
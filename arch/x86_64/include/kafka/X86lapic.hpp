@@ -0,0 +1,55 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#pragma once
+
+#include <stdint.h>
+
+namespace kfk
+{
+    /* local APIC; x2APIC (MSRs) when the CPU has it, xAPIC (MMIO) otherwise */
+    class Lapic
+    {
+    public:
+        /* register offsets in xAPIC terms; x2APIC uses MSR 0x800 + offset / 16 */
+        static constexpr uint32_t ID = 0x20;
+        static constexpr uint32_t TPR = 0x80;
+        static constexpr uint32_t EOI = 0xB0;
+        static constexpr uint32_t SVR = 0xF0;
+        static constexpr uint32_t ICR_LOW = 0x300;
+        static constexpr uint32_t ICR_HIGH = 0x310; /* xAPIC only; x2APIC takes the destination in ICR bits 32-63 */
+        static constexpr uint32_t LVT_TIMER = 0x320;
+        static constexpr uint32_t TIMER_INITIAL = 0x380;
+        static constexpr uint32_t TIMER_CURRENT = 0x390;
+        static constexpr uint32_t TIMER_DIVIDE = 0x3E0;
+
+        static constexpr uint32_t LVT_MASKED = 1U << 16;
+        static constexpr uint32_t LVT_TSC_DEADLINE = 2U << 17;
+
+        static constexpr uint32_t ICR_PENDING = 1U << 12; /* xAPIC: the last IPI has not been taken yet */
+        static constexpr uint32_t ICR_ASSERT = 1U << 14;
+
+        static constexpr uint8_t SPURIOUS_VECTOR = 0xFF;
+
+        /* enable the calling CPU's APIC and note its id for `cpu`; the first call picks the mode and maps the registers */
+        static void init(uint32_t cpu) noexcept;
+
+        static bool x2apic() noexcept;
+
+        static uint32_t read(uint32_t reg) noexcept;
+
+        static void write(uint32_t reg, uint32_t value) noexcept;
+
+        /* no-op until `init` ran, so early faults need not care */
+        static void eoi() noexcept;
+
+        static uint32_t id() noexcept;
+
+        /* APIC id of CPU `cpu`, which interrupts are addressed to; UINT32_MAX if it has not come up */
+        static uint32_t apic_id(uint32_t cpu) noexcept;
+
+        /* fixed-mode interrupt `vector` to the APIC `apic_id`; earlier stores are visible to its handler */
+        static void send_ipi(uint32_t apic_id, uint8_t vector) noexcept;
+    };
+
+    using lapic = Lapic;
+}
@@ -0,0 +1,39 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <kafka/types.hpp>
+#include <kafka/hal/simd.hpp>
+
+namespace kfk
+{
+    namespace x86_64_internal
+    {
+        /*
+         * vector kernels, built from `*_avx2.cpp` / `*_avx512.cpp` with SIMD
+         * enabled; only call them inside a `SimdGuard`. those files must not
+         * include kernel headers: an inline function emitted there could be
+         * picked by the linker for every other caller, SIMD code and all
+         */
+        void clear_pages_avx2(void *dst, size_t pages) noexcept;
+
+        void copy_pages_avx2(void *dst, const void *src, size_t pages) noexcept;
+
+        void clear_pages_avx512(void *dst, size_t pages) noexcept;
+
+        void copy_pages_avx512(void *dst, const void *src, size_t pages) noexcept;
+    }
+
+    template<>
+    class simd_traits<x86_64>
+    {
+    public:
+        static void init() noexcept;
+
+        static void clear_pages(void *dst, size_t pages) noexcept;
+
+        static void copy_pages(void *dst, const void *src, size_t pages) noexcept;
+    };
+}
@@ -0,0 +1,26 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#pragma once
+
+#include <stdint.h>
+#include <kafka/types.hpp>
+#include <kafka/hal/timer.hpp>
+
+namespace kfk
+{
+    template<>
+    class timer_traits<x86_64>
+    {
+    public:
+        static void init() noexcept;
+
+        /* program the calling AP's timer the way `init` did the boot CPU's */
+        static void init_cpu() noexcept;
+
+        static uint64_t now() noexcept;
+
+        static void arm(uint64_t deadline) noexcept;
+
+        static void disarm() noexcept;
+    };
+}
@@ -21,9 +21,39 @@ namespace kfk
         static constexpr uint64_t VMM_DIRTY = 1ULL << 6;
         static constexpr uint64_t VMM_HUGE = 1ULL << 7;
         static constexpr uint64_t VMM_GLOBAL = 1ULL << 8;
+        static constexpr uint64_t VMM_PAT = 1ULL << 7; /* PAT index bit 2 in a 4KB leaf; shares the HUGE bit */
+        static constexpr uint64_t VMM_PAT_HUGE = 1ULL << 12; /* PAT index bit 2 in a 2MB/1GB leaf */
         static constexpr uint64_t VMM_NX = 1ULL << 63;
+
+        /* software-defined bits; ignored by the MMU */
+        static constexpr uint64_t VMM_COW = 1ULL << 9; /* read-only because the frame is shared copy-on-write */
+        static constexpr uint64_t VMM_SHARED = 1ULL << 10; /* MAP_SHARED leaf; stays shared, not COW, across clones */
+
+        /* physical address bits of a paging entry */
+        static constexpr uint64_t VMM_ADDR_MASK = 0x000FFFFFFFFFF000ULL;
+
+        /* CR4.LA57; only settable when CPUID.(7,0):ECX[16] reports it, so it doubles as the capability check */
+        static constexpr uint64_t CR4_LA57 = 1ULL << 12;
+
+        /* CR4.PGE; clearing it flushes global translations too */
+        static constexpr uint64_t CR4_PGE = 1ULL << 7;
+
+        /* deepest paging structure the MMU supports (PML5) */
+        static constexpr size_t MAX_PAGING_LEVELS = 5;
+
+        /* #PF error code bits */
+        static constexpr uint64_t PF_PRESENT = 1ULL << 0;
+        static constexpr uint64_t PF_WRITE = 1ULL << 1;
+        static constexpr uint64_t PF_USER = 1ULL << 2;
     }
 
+    /* path of the last walk; lets neighbouring lookups skip the upper levels */
+    struct WalkCursor
+    {
+        uintptr_t base = ~0ULL; /* VA covered by path[0], aligned to one page table's span */
+        uint64_t *path[x86_64_internal::MAX_PAGING_LEVELS] = {}; /* path[level - 1] is the table at `level`; PT first */
+    };
+
     template<>
     class vmm_traits<x86_64>
     {
@@ -34,18 +64,48 @@ namespace kfk
 
         static uintptr_t map_page(size_t n = 1) noexcept;
         
-        static void map_page(uintptr_t virt_addr, uintptr_t phys_addr, VmmFlags flags) noexcept;
+        static bool map_page(uintptr_t virt_addr, uintptr_t phys_addr, VmmFlags flags) noexcept;
         
-        static void map_page_internal(uintptr_t virt_addr, uintptr_t phys_addr, uint64_t native_flags) noexcept;
+        static uintptr_t map_device(uintptr_t phys_addr, size_t size, VmmFlags flags) noexcept;
+
+        static bool map_page_internal(uintptr_t virt_addr, uintptr_t phys_addr, uint64_t native_flags) noexcept;
 
         static void unmap_page(uintptr_t virt_addr) noexcept;
 
+        static void unmap_kernel(uintptr_t virt_addr, size_t size) noexcept;
+
         static uintptr_t get_pmaddr(uintptr_t virt_addr) noexcept;
 
+        static uintptr_t get_pmaddr(uintptr_t virt_addr, WalkCursor &cursor) noexcept;
+
+        static size_t translate_range(uintptr_t virt_addr, size_t size, PhysSegment *segments,
+                                      size_t max_segments) noexcept;
+
+        static size_t query_range(uintptr_t virt_addr, size_t size, VmRun *runs, size_t max_runs) noexcept;
+
+        static bool mprotect_range(uintptr_t virt_addr, size_t size, VmmFlags prot) noexcept;
+
         static void dynamic_mode() noexcept;
 
+        static MemoryRegion area(KernelArea which) noexcept;
+
+        static uintptr_t user_limit() noexcept;
+
+        static bool map_user(uintptr_t ptb_phys, uintptr_t virt_addr, uintptr_t phys_addr, VmmFlags flags) noexcept;
+
+        static size_t unmap_user(uintptr_t ptb_phys, uintptr_t virt_addr, size_t size) noexcept;
+
         static uintptr_t create_ptb() noexcept;
 
+        static uintptr_t clone_ptb(uintptr_t ptb_phys) noexcept;
+
+        static void destroy_ptb(uintptr_t ptb_phys) noexcept;
+
         static void switch_ptb(uintptr_t ptb_phys) noexcept;
+
+        static void flush_pending() noexcept;
+
+        /* resolve a #PF; returns false if the fault is not ours to fix. call with the loaded space locked */
+        static bool handle_fault(uintptr_t fault_addr, uint64_t error) noexcept;
     };
 }
\ No newline at end of file
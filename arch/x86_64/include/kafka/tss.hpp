@@ -6,6 +6,11 @@
 
 namespace kfk
 {
+	/* IST slots (1-based, as the IDT wants them) for exceptions that cannot trust the current stack */
+	static constexpr uint8_t IST_DOUBLE_FAULT = 1;
+	static constexpr uint8_t IST_NMI = 2;
+	static constexpr uint8_t IST_MACHINE_CHECK = 3;
+
 	/* TSS */
 	struct TSS
 	{
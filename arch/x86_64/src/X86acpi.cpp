@@ -0,0 +1,116 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.hpp>
+#include <kafka/X86acpi.hpp>
+#include <kafka/X86vmem.hpp>
+
+namespace kfk
+{
+    struct Rsdp
+    {
+        char signature[8];
+        uint8_t checksum;
+        char oem_id[6];
+        uint8_t revision; /* 0 for ACPI 1.0, which has no XSDT */
+        uint32_t rsdt;
+        uint32_t length;
+        uint64_t xsdt;
+        uint8_t extended_checksum;
+        uint8_t reserved[3];
+    } __attribute__((packed));
+
+    static constexpr size_t RSDP_V1_SIZE = 20;
+    static const VmmFlags ACPI_FLAGS = VmmFlags::PROT_READ | VmmFlags::KERNEL;
+
+    static const AcpiHeader *root = nullptr;
+    static size_t entry_size = 0; /* 8 for the XSDT, 4 for the RSDT */
+
+    static bool checksum(const void *data, size_t size)
+    {
+        const auto *bytes = static_cast<const uint8_t *>(data);
+        uint8_t sum = 0;
+        for (size_t i = 0; i < size; i++)
+            sum += bytes[i];
+        return sum == 0;
+    }
+
+    /* header first to learn the length, then the whole table; firmware tables are not covered by the HHDM */
+    static const AcpiHeader *map_table(uintptr_t phys, const char *signature)
+    {
+        const uintptr_t header = vmm_traits<x86_64>::map_device(phys, sizeof(AcpiHeader), ACPI_FLAGS);
+        if (!header)
+            return nullptr;
+
+        const auto *peek = reinterpret_cast<const AcpiHeader *>(header);
+        const uint32_t length = peek->length;
+        const bool wanted = !signature || !memcmp(peek->signature, signature, sizeof(peek->signature));
+        vmm_traits<x86_64>::unmap_page(header);
+
+        if (!wanted || length < sizeof(AcpiHeader))
+            return nullptr;
+
+        const uintptr_t table = vmm_traits<x86_64>::map_device(phys, length, ACPI_FLAGS);
+        if (!table)
+            return nullptr;
+
+        if (!checksum(reinterpret_cast<const void *>(table), length))
+        {
+            vmm_traits<x86_64>::unmap_page(table);
+            return nullptr;
+        }
+
+        return reinterpret_cast<const AcpiHeader *>(table);
+    }
+
+    bool Acpi::init(uintptr_t rsdp_phys) noexcept
+    {
+        const uintptr_t mapped = vmm_traits<x86_64>::map_device(rsdp_phys, sizeof(Rsdp), ACPI_FLAGS);
+        if (!mapped)
+            return false;
+
+        const auto *rsdp = reinterpret_cast<const Rsdp *>(mapped);
+        uintptr_t table = 0;
+        if (!memcmp(rsdp->signature, "RSD PTR ", sizeof(rsdp->signature)) && checksum(rsdp, RSDP_V1_SIZE))
+        {
+            /* the XSDT where there is one; its entries reach above 4GB */
+            if (rsdp->revision >= 2 && rsdp->xsdt && checksum(rsdp, sizeof(Rsdp)))
+            {
+                table = rsdp->xsdt;
+                entry_size = sizeof(uint64_t);
+            }
+            else
+            {
+                table = rsdp->rsdt;
+                entry_size = sizeof(uint32_t);
+            }
+        }
+        vmm_traits<x86_64>::unmap_page(mapped);
+
+        if (table)
+            root = map_table(table, entry_size == sizeof(uint64_t) ? "XSDT" : "RSDT");
+
+        return root != nullptr;
+    }
+
+    const AcpiHeader *Acpi::find(const char *signature) noexcept
+    {
+        if (!root)
+            return nullptr;
+
+        const auto *entries = reinterpret_cast<const uint8_t *>(root) + sizeof(AcpiHeader);
+        const size_t count = (root->length - sizeof(AcpiHeader)) / entry_size;
+        for (size_t i = 0; i < count; i++)
+        {
+            /* XSDT entries are only 4-byte aligned */
+            uint64_t phys = 0;
+            memcpy(&phys, entries + i * entry_size, entry_size);
+
+            if (const AcpiHeader *table = map_table(phys, signature))
+                return table;
+        }
+
+        return nullptr;
+    }
+}
@@ -1,28 +1,49 @@
 /* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
 
 #include <stdint.h>
+#include <stddef.h>
+#include <atomic.hpp>
 #include <kafka/X86cpu.hpp>
+#include <kafka/X86fpu.hpp>
+#include <kafka/X86interrupt.hpp>
+#include <kafka/X86lapic.hpp>
+#include <kafka/X86simd.hpp>
+#include <kafka/X86timer.hpp>
 #include <kafka/gdt.hpp>
+#include <kafka/kstack.hpp>
+#include <kafka/percpu.hpp>
+#include <kafka/rcu.hpp>
+#include <kafka/syscall.hpp>
 #include <kafka/tss.hpp>
+#include <kafka/vdso_page.hpp>
 #include <kafka/types.hpp>
 
 namespace kfk
 {
     /* static & const variables */
-    static GDTEntry gdt[] = {
+    /* SYSRET derives both user selectors from one STAR field, so user data has to come right before user code */
+    static constexpr GDTEntry gdt_template[] = {
         { 0, 0, 0, 0, 0, 0 },                /* null descriptor */
 		{ 0xFFFF, 0, 0, 0x9A, 0xF, 0xA, 0 }, /* kernel code */
 		{ 0xFFFF, 0, 0, 0x92, 0xF, 0xA, 0 }, /* kernel data */
+		{ 0xFFFF, 0, 0, 0xF2, 0xF, 0xA, 0 }, /* user data */
+		{ 0xFFFF, 0, 0, 0xFA, 0xF, 0xA, 0 }, /* user code */
 		{ 0, 0, 0, 0, 0, 0 },                /* tss low */
 		{ 0, 0, 0, 0, 0, 0 }                 /* tss high */
     };
 
-    static GDTDescriptor gdtr = {
-		sizeof(gdt) - 1,
-		reinterpret_cast<uint64_t>(gdt)
-	};
+	static constexpr uint16_t KERNEL_CS = 0x08;
+	static constexpr uint16_t KERNEL_DS = 0x10;
+	static constexpr uint16_t USER_DS = 0x18 | 3;
+	static constexpr uint16_t USER_CS = 0x20 | 3;
+	static constexpr uint16_t TSS_SELECTOR = 0x28;
 
-    alignas(16) static TSS tss = {};
+    static_assert(sizeof(gdt_template) == sizeof(CpuLocal::gdt));
+
+    /* each CPU has its own GDT since the TSS descriptor's busy bit is per CPU; named for the entry asm */
+    PER_CPU __attribute__((used)) static CpuLocal cpu_local asm("cpu_local") = {};
+
+    static Atomic<uint32_t> online_cpus(0);
 
     /* MSR stuff */
     static constexpr uint64_t TSS_LIMIT = sizeof(TSS);
@@ -30,93 +51,439 @@ namespace kfk
 	static constexpr auto MSR_STAR = 0xC0000081;
 	static constexpr auto MSR_LSTAR = 0xC0000082;
 	static constexpr auto MSR_SYSCALL_MASK = 0xC0000084;
+	static constexpr auto MSR_PAT = 0x277;
 	static constexpr auto MSR_GS_BASE = 0xC0000101;
 	static constexpr auto MSR_KERNEL_GS_BASE = 0xC0000102;
+	static constexpr auto MSR_TSC_AUX = 0xC0000103;
+
+    /*
+     * PAT layout: entries 0-3 keep their power-on types so plain PWT/PCD keep
+     * their usual meaning, and 4-7 add WP and WC. this matches the layout the
+     * Limine protocol documents, so reprogramming is a no-op there
+     */
+    static constexpr uint64_t PAT_UC = 0x00;
+    static constexpr uint64_t PAT_WC = 0x01;
+    static constexpr uint64_t PAT_WT = 0x04;
+    static constexpr uint64_t PAT_WP = 0x05;
+    static constexpr uint64_t PAT_WB = 0x06;
+    static constexpr uint64_t PAT_UCM = 0x07; /* UC- */
+    static constexpr uint64_t PAT_LAYOUT = PAT_WB | (PAT_WT << 8) | (PAT_UCM << 16) | (PAT_UC << 24) |
+                                           (PAT_WP << 32) | (PAT_WC << 40) | (PAT_UCM << 48) | (PAT_UC << 56);
 
     /* variables */
     static uint64_t hhdm_offset = 0;
+	static uint32_t vdso_flags = 0; /* VDSO_RDTSCP and VDSO_RDPID as this CPU model has them */
+
+	static void init_pat()
+	{
+		uint32_t eax, ebx, ecx, edx;
+		cpu_traits<x86_64>::cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+		if (!(edx & (1U << 16)))
+			return; /* architecturally always present on x86_64, but be safe */
+
+		if (cpu_traits<x86_64>::rdmsr(MSR_PAT) == PAT_LAYOUT)
+			return;
+
+		/* caches and TLBs may hold lines of the old types */
+		asm volatile("wbinvd" : : : "memory");
+		cpu_traits<x86_64>::wrmsr(MSR_PAT, PAT_LAYOUT);
+		asm volatile("wbinvd" : : : "memory");
+		cpu_traits<x86_64>::write_cr3(cpu_traits<x86_64>::read_cr3());
+	}
+
+	static void detect_vdso_flags()
+	{
+		uint32_t eax, ebx, ecx, edx;
+		cpu_traits<x86_64>::cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+		if (eax >= 0x80000001)
+		{
+			cpu_traits<x86_64>::cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+			if (edx & (1U << 27))
+				vdso_flags |= VDSO_RDTSCP;
+		}
+
+		cpu_traits<x86_64>::cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+		if (eax >= 7)
+		{
+			cpu_traits<x86_64>::cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+			if (ecx & (1U << 22))
+				vdso_flags |= VDSO_RDPID;
+		}
+	}
 
+	/* RFLAGS bits cleared on syscall entry: TF, IF, DF and AC */
+	static constexpr uint64_t SYSCALL_RFLAGS_MASK = (1ULL << 8) | (1ULL << 9) | (1ULL << 10) | (1ULL << 18);
+
+	/*
+	 * syscall entry. interrupts are off (SFMASK) until the stack is ours. the
+	 * frame is built on the running thread's kernel stack, so a handler may
+	 * block; fast calls skip the callee-saved registers, which the handler
+	 * preserves anyway, and run with interrupts off. returns through sysretq
+	 * unless the saved rip is non-canonical: sysretq would then fault in ring 0
+	 * with the user's rsp, so that case takes the iretq path
+	 */
 	static void syscall_entry() __attribute__((naked));
 
 	static void syscall_entry()
 	{
 		asm volatile(
 			"swapgs\n"
-			"movq %rsp, %gs:16\n"
-			"movq %gs:8, %rsp\n"
-			"ret"
+			"movq %%rsp, %%gs:cpu_local+8\n"
+			"movq %%gs:cpu_local, %%rsp\n"
+
+			/* iretq frame, number, then the argument registers the caller expects back */
+			"pushq %[user_ds]\n"
+			"pushq %%gs:cpu_local+8\n"
+			"pushq %%r11\n"
+			"pushq %[user_cs]\n"
+			"pushq %%rcx\n"
+			"pushq %%rax\n"
+			"pushq %%rdi\n"
+			"pushq %%rsi\n"
+			"pushq %%rdx\n"
+			"pushq %%r10\n"
+			"pushq %%r8\n"
+			"pushq %%r9\n"
+
+			"cmpq %[count], %%rax\n"
+			"jae 3f\n"
+			"movq %%rax, %%r11\n"
+			"shlq $4, %%r11\n"
+			"movq %%r10, %%rcx\n" /* fourth argument; the C convention wants it in rcx */
+			"testq %[full], syscall_table+8(%%r11)\n"
+			"jnz 2f\n"
+
+			"callq *syscall_table(%%r11)\n"
+			"jmp 4f\n"
+
+			"2:\n"
+			"pushq %%rbx\n"
+			"pushq %%rbp\n"
+			"pushq %%r12\n"
+			"pushq %%r13\n"
+			"pushq %%r14\n"
+			"pushq %%r15\n"
+			"sti\n"
+			"callq *syscall_table(%%r11)\n"
+			"cli\n"
+			"popq %%r15\n"
+			"popq %%r14\n"
+			"popq %%r13\n"
+			"popq %%r12\n"
+			"popq %%rbp\n"
+			"popq %%rbx\n"
+			"jmp 4f\n"
+
+			"3:\n"
+			"movq %[enosys], %%rax\n"
+
+			"4:\n"
+			"movq %c[rip](%%rsp), %%r11\n"
+			"shrq $47, %%r11\n"
+			"jnz 5f\n"
+			"popq %%r9\n"
+			"popq %%r8\n"
+			"popq %%r10\n"
+			"popq %%rdx\n"
+			"popq %%rsi\n"
+			"popq %%rdi\n"
+			"addq $8, %%rsp\n"
+			"popq %%rcx\n"
+			"addq $8, %%rsp\n"
+			"popq %%r11\n"
+			"movq (%%rsp), %%rsp\n"
+			"swapgs\n"
+			"sysretq\n"
+
+			"5:\n"
+			"popq %%r9\n"
+			"popq %%r8\n"
+			"popq %%r10\n"
+			"popq %%rdx\n"
+			"popq %%rsi\n"
+			"popq %%rdi\n"
+			"addq $8, %%rsp\n"
+			"swapgs\n"
+			"iretq"
+			: : [user_ds] "i"(USER_DS), [user_cs] "i"(USER_CS), [count] "i"(SYSCALL_COUNT),
+				[full] "i"(SYSCALL_FULL), [enosys] "i"(-ENOSYS),
+				[rip] "i"(offsetof(SyscallFrame, rip) - offsetof(SyscallFrame, r9))
 		);
 	}
 
-    void cpu_traits<x86_64>::init(uint64_t offset) noexcept
-    {
-        /* save hhdm offset */
-        hhdm_offset = offset;
+	/* give a CPU its stacks; done on the BSP for every CPU so the APs never allocate */
+	static bool prepare(CpuLocal &local, uint32_t id)
+	{
+		local.id = id;
+
+		for (size_t i = 0; i < sizeof(gdt_template) / sizeof(gdt_template[0]); i++)
+			local.gdt[i] = gdt_template[i];
+		local.gdtr = { sizeof(local.gdt) - 1, reinterpret_cast<uint64_t>(local.gdt) };
+
+		/* ring 0 entry stack plus dedicated ones for exceptions that may hit a broken stack */
+		local.tss.rsp[0] = kstack::allocate();
+		local.tss.ist[IST_DOUBLE_FAULT - 1] = kstack::allocate();
+		local.tss.ist[IST_NMI - 1] = kstack::allocate();
+		local.tss.ist[IST_MACHINE_CHECK - 1] = kstack::allocate();
+		local.tss.iopb = sizeof(TSS);
+		local.kstack = local.tss.rsp[0];
+
+		return local.tss.rsp[0] && local.tss.ist[IST_DOUBLE_FAULT - 1] && local.tss.ist[IST_NMI - 1] &&
+			   local.tss.ist[IST_MACHINE_CHECK - 1];
+	}
 
+	/* load a prepared block into the calling CPU */
+	static void load(CpuLocal &local)
+	{
         /* load GDT */
-        asm volatile("lgdt %0" : : "m"(gdtr)); /* flush */
+        asm volatile("lgdt %0" : : "m"(local.gdtr)); /* flush */
 		asm volatile(
-			"pushq $0x08\n"	/* code segment selector */
+			"pushq %0\n"	/* code segment selector */
 			"pushq $1f\n"  	/* return address */
 			"lretq\n"
 			"1:\n"
+			: : "i"(KERNEL_CS)
 		);
 		asm volatile(
-			"mov $0x10, %%ax\n"
+			"mov %0, %%ax\n"
 			"mov %%ax, %%ds\n"
 			"mov %%ax, %%es\n"
 			"mov %%ax, %%fs\n"
 			"mov %%ax, %%gs\n"
 			"mov %%ax, %%ss\n"
-			: : : "ax"
+			: : "i"(KERNEL_DS) : "ax"
 		);
 
+		/*
+		 * GS is the per-CPU area while in the kernel; swapgs trades it for the user
+		 * one on entry. reloading %gs above zeroed the base, and everything below
+		 * may touch per-CPU data, so set it straight away
+		 */
+		cpu_traits<x86_64>::wrmsr(MSR_GS_BASE, percpu::offset(local.id));
+		cpu_traits<x86_64>::wrmsr(MSR_KERNEL_GS_BASE, 0);
+
         /* TSS */
-        const auto tss_base = reinterpret_cast<uint64_t>(&tss); /* get the address */
+        const auto tss_base = reinterpret_cast<uint64_t>(&local.tss); /* get the address */
 
         /* generally TSS descriptor is 16 bytes which is split across 2 GDT entries */
 		/* first entry [LOW] */
-		gdt[3].limit_low = TSS_LIMIT & 0xFFFF;
-		gdt[3].base_low = tss_base & 0xFFFF;
-		gdt[3].base_middle = (tss_base >> 16) & 0xFF;
-		gdt[3].access = 0x89; /* PRESENT | RING0 | TSS */
-		gdt[3].limit_high = (TSS_LIMIT >> 16) & 0xF;
-		gdt[3].flags = 0;
-		gdt[3].base_high = (tss_base >> 24) & 0xFF;
+		local.gdt[5].limit_low = TSS_LIMIT & 0xFFFF;
+		local.gdt[5].base_low = tss_base & 0xFFFF;
+		local.gdt[5].base_middle = (tss_base >> 16) & 0xFF;
+		local.gdt[5].access = 0x89; /* PRESENT | RING0 | TSS */
+		local.gdt[5].limit_high = (TSS_LIMIT >> 16) & 0xF;
+		local.gdt[5].flags = 0;
+		local.gdt[5].base_high = (tss_base >> 24) & 0xFF;
 
 		/* second entry [HIGH]; see GDT definitions for more info */
-		gdt[4].limit_low = (tss_base >> 32) & 0xFFFF;
-		gdt[4].base_low = (tss_base >> 48) & 0xFFFF;
-		gdt[4].base_middle = 0;
-		gdt[4].access = 0;
-		gdt[4].limit_high = 0;
-		gdt[4].flags = 0;
-		gdt[4].base_high = 0;
+		local.gdt[6].limit_low = (tss_base >> 32) & 0xFFFF;
+		local.gdt[6].base_low = (tss_base >> 48) & 0xFFFF;
+		local.gdt[6].base_middle = 0;
+		local.gdt[6].access = 0;
+		local.gdt[6].limit_high = 0;
+		local.gdt[6].flags = 0;
+		local.gdt[6].base_high = 0;
 
 		/* load TSS */
-		tss.iopb = sizeof(TSS);
 		asm volatile(
 			"ltr %%ax"
-			: : "a"(0x18) /* according to OSDev wiki; it is at 0x18 (3 * 8) */
+			: : "a"(TSS_SELECTOR) /* 5 * 8; after the user segments */
 		);
 
 		/* enable syscall and sysret */
-		uint64_t efer = rdmsr(MSR_EFER);
+		uint64_t efer = cpu_traits<x86_64>::rdmsr(MSR_EFER);
 		efer |= 1ULL << 0;
-		wrmsr(MSR_EFER, efer);
+		cpu_traits<x86_64>::wrmsr(MSR_EFER, efer);
 
-		/* STAR & LSTAR setup */
-		uint64_t star = (0x13ULL << 48) | (0x08ULL << 32);
-		wrmsr(MSR_STAR, star);
+		/* STAR & LSTAR setup; SYSRET loads SS from STAR[63:48] + 8 and CS from STAR[63:48] + 16 */
+		uint64_t star = (static_cast<uint64_t>(USER_DS - 8) << 48) | (static_cast<uint64_t>(KERNEL_CS) << 32);
+		cpu_traits<x86_64>::wrmsr(MSR_STAR, star);
 		
-		wrmsr(MSR_LSTAR, reinterpret_cast<uint64_t>(+syscall_entry));
-		wrmsr(MSR_SYSCALL_MASK, 0x200);
+		cpu_traits<x86_64>::wrmsr(MSR_LSTAR, reinterpret_cast<uint64_t>(+syscall_entry));
+		cpu_traits<x86_64>::wrmsr(MSR_SYSCALL_MASK, SYSCALL_RFLAGS_MASK);
+
+		/* memory types; needed before any WRITE_COMBINE mapping is touched */
+		init_pat();
+
+		/* SSE/AVX enabled, but owned lazily; see X86fpu.cpp */
+		fpu_traits<x86_64>::init();
+
+		lapic::init(local.id);
+
+		/* RDTSCP and RDPID hand this to user mode, which is how the vDSO answers getcpu */
+		if (vdso_flags & (VDSO_RDTSCP | VDSO_RDPID))
+			cpu_traits<x86_64>::wrmsr(MSR_TSC_AUX, local.id);
+	}
+
+	/* what the APs run once they are up; set by `smp_init` */
+	static void (*ap_continue)() = nullptr;
+
+	/* where the APs run once their tables are loaded; interrupts stay off until there is work for them */
+	[[noreturn]] static void ap_main(CpuLocal *local)
+	{
+		load(*local);
+		interrupt_traits<x86_64>::load();
+		timer_traits<x86_64>::init_cpu();
+
+		rcu::quiescent();
+		online_cpus.fetch_add(1, MemoryOrder::RELEASE);
+
+		if (ap_continue)
+			ap_continue();
 
-		/* GC base because this is IMPORTANT to separate kernel & userspace */
-		wrmsr(MSR_GS_BASE, 0);
-		wrmsr(MSR_KERNEL_GS_BASE, 0);
+		while (true)
+		{
+			rcu::idle_enter();
+			cpu_traits<x86_64>::idle();
+			rcu::idle_exit();
+			rcu::quiescent();
+		}
+	}
+
+	static uint64_t kernel_cr3 = 0;
+
+	/* entered by Limine on the AP's bootloader stack; switch to our tables and stack before anything else */
+	static void ap_entry(limine_smp_info *info)
+	{
+		auto *local = reinterpret_cast<CpuLocal *>(info->extra_argument);
+		asm volatile(
+			"mov %0, %%cr3\n"
+			"mov %1, %%rsp\n"
+			"xor %%ebp, %%ebp\n"
+			"call *%2\n"
+			: : "r"(kernel_cr3), "r"(local->kstack), "r"(ap_main), "D"(local) : "memory"
+		);
+		__builtin_unreachable();
+	}
+
+    void cpu_traits<x86_64>::init(uint64_t offset) noexcept
+    {
+        /* save hhdm offset */
+        hhdm_offset = offset;
+
+		/* switch to our own copy of the per-CPU area before anything else uses it */
+		const uintptr_t area = percpu::setup(0);
+		if (!area)
+			halt();
+		wrmsr(MSR_GS_BASE, area);
+
+		CpuLocal &bsp = *this_cpu_ptr(cpu_local);
+		if (!prepare(bsp, 0))
+			halt();
+
+		detect_vdso_flags();
+		load(bsp);
+		simd_traits<x86_64>::init();
+		vdso::add_flags(vdso_flags); /* the clock follows once the timer is calibrated */
+		online_cpus.store(1, MemoryOrder::RELEASE);
     }
 
+	void cpu_traits<x86_64>::smp_init(volatile limine_smp_request *request, void (*entry)()) noexcept
+	{
+		limine_smp_response *response = request->response;
+		if (!response)
+			return; /* uniprocessor, or a bootloader that could not start the APs */
+
+		kernel_cr3 = read_cr3();
+		ap_continue = entry;
+
+		uint32_t next_id = 1;
+		for (uint64_t i = 0; i < response->cpu_count && next_id < MAX_CPUS; i++)
+		{
+			limine_smp_info *info = response->cpus[i];
+			if (info->lapic_id == response->bsp_lapic_id)
+				continue;
+
+			if (!percpu::setup(next_id))
+				break;
+
+			CpuLocal &local = *per_cpu_ptr(cpu_local, next_id);
+			if (!prepare(local, next_id))
+				break;
+
+			/* the write to goto_address is what releases the AP */
+			info->extra_argument = reinterpret_cast<uint64_t>(&local);
+			__atomic_store_n(&info->goto_address, &ap_entry, __ATOMIC_RELEASE);
+
+			/* one at a time keeps the online ids dense, which `count` relies on */
+			while (online_cpus.load(MemoryOrder::ACQUIRE) <= next_id)
+				pause();
+			next_id++;
+		}
+	}
+
+	uint32_t cpu_traits<x86_64>::id() noexcept
+	{
+		return this_cpu_read(cpu_local.id);
+	}
+
+	uint32_t cpu_traits<x86_64>::count() noexcept
+	{
+		return online_cpus.load(MemoryOrder::ACQUIRE);
+	}
+
+	CpuLocal *cpu_traits<x86_64>::local() noexcept
+	{
+		return this_cpu_ptr(cpu_local);
+	}
+
+	uintptr_t cpu_traits<x86_64>::kernel_gs_base() noexcept
+	{
+		/* every CPU runs on the GDT inside its own block, so SGDT finds the block */
+		GDTDescriptor gdtr;
+		asm volatile("sgdt %0" : "=m"(gdtr));
+
+		/* and its offset from the template is what `%gs:cpu_local` needs */
+		const uintptr_t local = gdtr.offset - offsetof(CpuLocal, gdt);
+		return local - reinterpret_cast<uintptr_t>(&cpu_local);
+	}
+
+	void cpu_traits<x86_64>::set_kernel_stack(uintptr_t top) noexcept
+	{
+		CpuLocal *local = this_cpu_ptr(cpu_local);
+		local->kstack = top;
+		local->tss.rsp[0] = top; /* interrupts and exceptions from user mode */
+	}
+
+	void cpu_traits<x86_64>::enter_user(uintptr_t entry, uintptr_t stack_top, uintptr_t arg, bool interrupts) noexcept
+	{
+		/* IF plus the always-one bit 1 */
+		const uint64_t rflags = interrupts ? 0x202 : 0x2;
+
+		/* interrupts off from swapgs to iretq; one taken in between would run on the user GS */
+		asm volatile(
+			"cli\n"
+			"pushq %[user_ds]\n"
+			"pushq %[stack]\n"
+			"pushq %[rflags]\n"
+			"pushq %[user_cs]\n"
+			"pushq %[entry]\n"
+			"movq %[arg], %%rdi\n"
+
+			/* leave nothing of the kernel's in the registers */
+			"xorl %%eax, %%eax\n"
+			"xorl %%ebx, %%ebx\n"
+			"xorl %%ecx, %%ecx\n"
+			"xorl %%edx, %%edx\n"
+			"xorl %%esi, %%esi\n"
+			"xorl %%ebp, %%ebp\n"
+			"xorl %%r8d, %%r8d\n"
+			"xorl %%r9d, %%r9d\n"
+			"xorl %%r10d, %%r10d\n"
+			"xorl %%r11d, %%r11d\n"
+			"xorl %%r12d, %%r12d\n"
+			"xorl %%r13d, %%r13d\n"
+			"xorl %%r14d, %%r14d\n"
+			"xorl %%r15d, %%r15d\n"
+			"swapgs\n"
+			"iretq"
+			: : [user_ds] "i"(USER_DS), [user_cs] "i"(USER_CS), [stack] "r"(stack_top), [rflags] "r"(rflags),
+				[entry] "r"(entry), [arg] "r"(arg)
+			: "memory"
+		);
+		__builtin_unreachable();
+	}
+
 	[[noreturn]] void cpu_traits<x86_64>::halt() noexcept
 	{
 		while (true)
@@ -147,6 +514,18 @@ namespace kfk
 		asm volatile("ltr %0" : : "r"(selector));
 	}
 
+	uint8_t cpu_traits<x86_64>::inb(uint16_t port) noexcept
+	{
+		uint8_t value;
+		asm volatile("inb %1, %0" : "=a"(value) : "Nd"(port));
+		return value;
+	}
+
+	void cpu_traits<x86_64>::outb(uint16_t port, uint8_t value) noexcept
+	{
+		asm volatile("outb %0, %1" : : "a"(value), "Nd"(port));
+	}
+
 	void cpu_traits<x86_64>::cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax, uint32_t *ebx,
 										uint32_t *ecx,
 										uint32_t *edx) noexcept
@@ -218,4 +597,160 @@ namespace kfk
 	{
 		asm volatile("pause");
 	}
+
+	void cpu_traits<x86_64>::idle() noexcept
+	{
+		/* sti holds off interrupts for one instruction, so a wakeup cannot slip in before the hlt */
+		asm volatile("sti\n hlt\n cli" : : : "memory");
+	}
+
+	/* first code a new thread runs; `init_context` left the entry point in r12 and its argument in r13 */
+	__attribute__((naked)) static void thread_trampoline()
+	{
+		asm volatile(
+			"movq %r13, %rdi\n"
+			"callq *%r12\n"
+			"ud2" /* entry points never return */
+		);
+	}
+
+	uintptr_t cpu_traits<x86_64>::init_context(uintptr_t stack_top, void (*entry)(void *), void *arg) noexcept
+	{
+		/* the frame `switch_context` pops: r15, r14, r13, r12, rbx, rbp, then the return address */
+		auto *frame = reinterpret_cast<uint64_t *>((stack_top & ~0xFULL) - 7 * sizeof(uint64_t));
+		frame[0] = 0;
+		frame[1] = 0;
+		frame[2] = reinterpret_cast<uint64_t>(arg);
+		frame[3] = reinterpret_cast<uint64_t>(entry);
+		frame[4] = 0;
+		frame[5] = 0; /* rbp; terminates frame-pointer backtraces */
+		frame[6] = reinterpret_cast<uint64_t>(&thread_trampoline);
+		return reinterpret_cast<uintptr_t>(frame); /* 16-byte aligned again after the ret, as the call wants */
+	}
+
+	/* only the callee-saved registers need saving; the caller already assumes the rest are clobbered */
+	__attribute__((naked)) void cpu_traits<x86_64>::switch_context(uintptr_t *, uintptr_t) noexcept
+	{
+		asm volatile(
+			"pushq %rbp\n"
+			"pushq %rbx\n"
+			"pushq %r12\n"
+			"pushq %r13\n"
+			"pushq %r14\n"
+			"pushq %r15\n"
+			"movq %rsp, (%rdi)\n"
+			"movq %rsi, %rsp\n"
+			"popq %r15\n"
+			"popq %r14\n"
+			"popq %r13\n"
+			"popq %r12\n"
+			"popq %rbx\n"
+			"popq %rbp\n"
+			"retq"
+		);
+	}
+
+	uint64_t cpu_traits<x86_64>::rdtsc() noexcept
+	{
+		uint32_t low, high;
+		asm volatile("rdtsc" : "=a"(low), "=d"(high));
+		return (static_cast<uint64_t>(high) << 32) | low;
+	}
+
+	uint64_t cpu_traits<x86_64>::tsc_frequency() noexcept
+	{
+		uint32_t eax, ebx, ecx, edx;
+		cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+		if (eax < 0x80000007)
+			return 0;
+
+		/* a TSC that changes rate with power states is no clock */
+		cpuid(0x80000007, 0, &eax, &ebx, &ecx, &edx);
+		if (!(edx & (1U << 8)))
+			return 0;
+
+		cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+		const uint32_t max_leaf = eax;
+
+		/* crystal clock times the TSC/crystal ratio */
+		if (max_leaf >= 0x15)
+		{
+			cpuid(0x15, 0, &eax, &ebx, &ecx, &edx);
+			if (eax && ebx && ecx)
+				return static_cast<uint64_t>(ecx) * ebx / eax;
+		}
+
+		/* the base frequency in MHz, which the TSC runs at on the parts that lack the crystal value */
+		if (max_leaf >= 0x16)
+		{
+			cpuid(0x16, 0, &eax, &ebx, &ecx, &edx);
+			if (eax & 0xFFFF)
+				return static_cast<uint64_t>(eax & 0xFFFF) * 1000000;
+		}
+
+		return 0;
+	}
+
+	bool cpu_traits<x86_64>::rdrand(uint64_t *value) noexcept
+	{
+		/* the DRNG can transiently run dry; intel suggests 10 retries */
+		for (int i = 0; i < 10; i++)
+		{
+			uint8_t ok;
+			asm volatile("rdrand %0; setc %1" : "=r"(*value), "=qm"(ok) : : "cc");
+			if (ok)
+				return true;
+		}
+		return false;
+	}
+
+	bool cpu_traits<x86_64>::rdseed(uint64_t *value) noexcept
+	{
+		/* RDSEED drains much faster than RDRAND; give it some room to recover */
+		for (int i = 0; i < 100; i++)
+		{
+			uint8_t ok;
+			asm volatile("rdseed %0; setc %1" : "=r"(*value), "=qm"(ok) : : "cc");
+			if (ok)
+				return true;
+			pause();
+		}
+		return false;
+	}
+
+	uint64_t cpu_traits<x86_64>::entropy() noexcept
+	{
+		static int has_rdrand = -1;
+		static int has_rdseed = -1;
+		static uint64_t state = 0;
+
+		if (has_rdrand < 0)
+		{
+			uint32_t eax, ebx, ecx, edx;
+			cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+			has_rdrand = (ecx >> 30) & 1;
+
+			cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+			const uint32_t max_leaf = eax;
+			has_rdseed = 0;
+			if (max_leaf >= 7)
+			{
+				cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+				has_rdseed = (ebx >> 18) & 1;
+			}
+		}
+
+		uint64_t value;
+		if (has_rdseed && rdseed(&value))
+			return value;
+		if (has_rdrand && rdrand(&value))
+			return value;
+
+		/* no DRNG; splitmix64 over the TSC. weak, but it differs from boot to boot */
+		state += rdtsc() + 0x9E3779B97F4A7C15ULL;
+		uint64_t z = state;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		return z ^ (z >> 31);
+	}
 }
\ No newline at end of file
@@ -0,0 +1,301 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <kafka/X86cpu.hpp>
+#include <kafka/X86fpu.hpp>
+#include <kafka/percpu.hpp>
+#include <kafka/pmem.hpp>
+
+namespace kfk
+{
+    static constexpr size_t PAGE_SIZE = 4096;
+
+    static constexpr uint64_t CR0_MP = 1ULL << 1;
+    static constexpr uint64_t CR0_EM = 1ULL << 2;
+    static constexpr uint64_t CR0_TS = 1ULL << 3;
+    static constexpr uint64_t CR4_OSFXSR = 1ULL << 9;
+    static constexpr uint64_t CR4_OSXMMEXCPT = 1ULL << 10;
+    static constexpr uint64_t CR4_OSXSAVE = 1ULL << 18;
+
+    static constexpr auto MSR_XSS = 0xDA0;
+
+    static constexpr uint64_t XSTATE_LEGACY = 0x3; /* x87 and SSE; always enabled */
+    static constexpr uint64_t XSTATE_AVX = 0x4;
+    static constexpr uint64_t XSTATE_AVX512 = 0xE0; /* opmask, ZMM_Hi256 and Hi16_ZMM; all or nothing */
+    static constexpr uint64_t XCOMP_BV_COMPACTED = 1ULL << 63;
+
+    /* fixed offsets in the legacy region and the XSAVE header */
+    static constexpr size_t FCW_OFFSET = 0;
+    static constexpr size_t MXCSR_OFFSET = 24;
+    static constexpr size_t XCOMP_BV_OFFSET = 520;
+    static constexpr uint16_t FCW_DEFAULT = 0x37F;
+    static constexpr uint32_t MXCSR_DEFAULT = 0x1F80;
+
+    /* best save instruction the CPU has; XSAVES and XSAVEOPT skip components that are unmodified or in init state */
+    enum class SaveMode : uint8_t
+    {
+        FXSAVE,
+        XSAVE,
+        XSAVEOPT,
+        XSAVES /* compacted format, restored with XRSTORS */
+    };
+
+    static SaveMode mode = SaveMode::FXSAVE;
+    static uint64_t xfeatures = XSTATE_LEGACY; /* XCR0; the same on every CPU */
+    static size_t state_size = 512;
+    static bool configured = false;
+
+    /*
+     * `current` is the thread running here, `owner` the one whose state the
+     * registers hold. `live` means the registers are in use by `current` and
+     * must be saved when it switches out; `armed` mirrors CR0.TS to save the
+     * slow control register writes when nothing changes
+     */
+    PER_CPU static FpuContext *fpu_current = nullptr;
+    PER_CPU static FpuContext *fpu_owner = nullptr;
+    PER_CPU static bool fpu_live = false;
+    PER_CPU static bool fpu_armed = false;
+    PER_CPU static uint32_t fpu_kernel_depth = 0; /* nesting of kernel SIMD sections */
+
+    static void set_ts()
+    {
+        if (this_cpu_read(fpu_armed))
+            return;
+
+        cpu_traits<x86_64>::write_cr0(cpu_traits<x86_64>::read_cr0() | CR0_TS);
+        this_cpu_write(fpu_armed, true);
+    }
+
+    static void clear_ts()
+    {
+        if (!this_cpu_read(fpu_armed))
+            return;
+
+        asm volatile("clts" : : : "memory");
+        this_cpu_write(fpu_armed, false);
+    }
+
+    static void save(void *area)
+    {
+        const uint32_t low = xfeatures & 0xFFFFFFFF;
+        const uint32_t high = xfeatures >> 32;
+
+        switch (mode)
+        {
+            case SaveMode::XSAVES:
+                asm volatile("xsaves64 (%0)" : : "r"(area), "a"(low), "d"(high) : "memory");
+                break;
+            case SaveMode::XSAVEOPT:
+                asm volatile("xsaveopt64 (%0)" : : "r"(area), "a"(low), "d"(high) : "memory");
+                break;
+            case SaveMode::XSAVE:
+                asm volatile("xsave64 (%0)" : : "r"(area), "a"(low), "d"(high) : "memory");
+                break;
+            case SaveMode::FXSAVE:
+                asm volatile("fxsave64 (%0)" : : "r"(area) : "memory");
+                break;
+        }
+    }
+
+    static void restore(const void *area)
+    {
+        const uint32_t low = xfeatures & 0xFFFFFFFF;
+        const uint32_t high = xfeatures >> 32;
+
+        switch (mode)
+        {
+            case SaveMode::XSAVES:
+                asm volatile("xrstors64 (%0)" : : "r"(area), "a"(low), "d"(high) : "memory");
+                break;
+            case SaveMode::XSAVEOPT:
+            case SaveMode::XSAVE:
+                asm volatile("xrstor64 (%0)" : : "r"(area), "a"(low), "d"(high) : "memory");
+                break;
+            case SaveMode::FXSAVE:
+                asm volatile("fxrstor64 (%0)" : : "r"(area) : "memory");
+                break;
+        }
+    }
+
+    /* pick the save format and the feature set once; every CPU then uses the same */
+    static void configure()
+    {
+        uint32_t eax, ebx, ecx, edx;
+        cpu_traits<x86_64>::cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+        if (!(ecx & (1U << 26)))
+            return; /* no XSAVE; FXSAVE with its fixed 512 byte area */
+
+        cpu_traits<x86_64>::cpuid(0xD, 0, &eax, &ebx, &ecx, &edx);
+        const uint64_t supported = (static_cast<uint64_t>(edx) << 32) | eax;
+
+        xfeatures = XSTATE_LEGACY;
+        if (supported & XSTATE_AVX)
+        {
+            xfeatures |= XSTATE_AVX;
+            if ((supported & XSTATE_AVX512) == XSTATE_AVX512)
+                xfeatures |= XSTATE_AVX512;
+        }
+
+        cpu_traits<x86_64>::cpuid(0xD, 1, &eax, &ebx, &ecx, &edx);
+        if (eax & (1U << 3))
+            mode = SaveMode::XSAVES;
+        else if (eax & (1U << 0))
+            mode = SaveMode::XSAVEOPT;
+        else
+            mode = SaveMode::XSAVE;
+    }
+
+    /* the area's size for the enabled features; only valid once XCR0 (and XSS) are set on this CPU */
+    static size_t area_size()
+    {
+        uint32_t eax, ebx, ecx, edx;
+        if (mode == SaveMode::FXSAVE)
+            return 512;
+
+        cpu_traits<x86_64>::cpuid(0xD, mode == SaveMode::XSAVES ? 1 : 0, &eax, &ebx, &ecx, &edx);
+        return ebx;
+    }
+
+    /* a zeroed area (pmalloc clears it) with the default control words restores to the power-on state */
+    static bool allocate(FpuContext *context)
+    {
+        const size_t pages = (state_size + PAGE_SIZE - 1) / PAGE_SIZE;
+        const uintptr_t phys = pmm::pmalloc(pages);
+        if (!phys)
+            return false;
+
+        auto *area = static_cast<uint8_t *>(pmm::phys_to_virt(phys));
+        *reinterpret_cast<uint16_t *>(area + FCW_OFFSET) = FCW_DEFAULT;
+        *reinterpret_cast<uint32_t *>(area + MXCSR_OFFSET) = MXCSR_DEFAULT;
+        if (mode == SaveMode::XSAVES)
+            *reinterpret_cast<uint64_t *>(area + XCOMP_BV_OFFSET) = XCOMP_BV_COMPACTED | xfeatures;
+
+        context->area = area;
+        context->area_phys = phys;
+        return true;
+    }
+
+    void fpu_traits<x86_64>::init() noexcept
+    {
+        if (!configured)
+        {
+            configure();
+            configured = true;
+        }
+
+        uint64_t cr4 = cpu_traits<x86_64>::read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+        if (mode != SaveMode::FXSAVE)
+            cr4 |= CR4_OSXSAVE;
+        cpu_traits<x86_64>::write_cr4(cr4);
+
+        if (mode != SaveMode::FXSAVE)
+            cpu_traits<x86_64>::xsetbv(0, xfeatures);
+        if (mode == SaveMode::XSAVES)
+            cpu_traits<x86_64>::wrmsr(MSR_XSS, 0); /* no supervisor components */
+
+        if (mode != SaveMode::FXSAVE && state_size == 512)
+            state_size = area_size();
+
+        /* nothing owns the registers yet; the first use traps */
+        const uint64_t cr0 = (cpu_traits<x86_64>::read_cr0() | CR0_MP | CR0_TS) & ~CR0_EM;
+        cpu_traits<x86_64>::write_cr0(cr0);
+        this_cpu_write(fpu_armed, true);
+        this_cpu_write(fpu_current, static_cast<FpuContext *>(nullptr));
+        this_cpu_write(fpu_owner, static_cast<FpuContext *>(nullptr));
+        this_cpu_write(fpu_live, false);
+    }
+
+    void fpu_traits<x86_64>::switch_out(FpuContext *context) noexcept
+    {
+        if (!this_cpu_read(fpu_live))
+            return; /* never touched the FPU since it was switched in; its saved copy is current */
+
+        save(context->area);
+        this_cpu_write(fpu_live, false);
+    }
+
+    void fpu_traits<x86_64>::switch_in(FpuContext *context) noexcept
+    {
+        this_cpu_write(fpu_current, context);
+
+        /* the registers still hold its state if nobody else used them here since it last ran here */
+        if (context->area && this_cpu_read(fpu_owner) == context &&
+            context->last_cpu == cpu_traits<x86_64>::id())
+        {
+            clear_ts();
+            this_cpu_write(fpu_live, true);
+            return;
+        }
+
+        set_ts();
+    }
+
+    void fpu_traits<x86_64>::release(FpuContext *context) noexcept
+    {
+        if (this_cpu_read(fpu_owner) == context)
+            this_cpu_write(fpu_owner, static_cast<FpuContext *>(nullptr));
+        if (this_cpu_read(fpu_current) == context)
+        {
+            this_cpu_write(fpu_current, static_cast<FpuContext *>(nullptr));
+            this_cpu_write(fpu_live, false);
+        }
+
+        /* another CPU may still name it owner; `last_cpu` of whoever reuses the address keeps that harmless */
+        if (context->area)
+            pmm::pfree(context->area_phys, (state_size + PAGE_SIZE - 1) / PAGE_SIZE);
+
+        context->area = nullptr;
+        context->area_phys = 0;
+        context->last_cpu = ~0U;
+    }
+
+    void fpu_traits<x86_64>::trap() noexcept
+    {
+        clear_ts();
+
+        FpuContext *context = this_cpu_read(fpu_current);
+        if (!context || (!context->area && !allocate(context)))
+        {
+            /* early boot or out of memory: let it run, but the registers belong to nobody now */
+            this_cpu_write(fpu_owner, static_cast<FpuContext *>(nullptr));
+            return;
+        }
+
+        restore(context->area);
+        context->last_cpu = cpu_traits<x86_64>::id();
+        this_cpu_write(fpu_owner, context);
+        this_cpu_write(fpu_live, true);
+    }
+
+    void fpu_traits<x86_64>::begin() noexcept
+    {
+        this_cpu_add(fpu_kernel_depth, 1U);
+        if (this_cpu_read(fpu_kernel_depth) > 1)
+            return;
+
+        if (this_cpu_read(fpu_live))
+        {
+            save(this_cpu_read(fpu_current)->area);
+            this_cpu_write(fpu_live, false);
+        }
+
+        /* the kernel is about to clobber the registers; the thread reloads on its next use */
+        this_cpu_write(fpu_owner, static_cast<FpuContext *>(nullptr));
+        clear_ts();
+    }
+
+    void fpu_traits<x86_64>::end() noexcept
+    {
+        this_cpu_sub(fpu_kernel_depth, 1U);
+        if (this_cpu_read(fpu_kernel_depth))
+            return;
+
+        set_ts();
+    }
+
+    bool fpu_traits<x86_64>::ready() noexcept
+    {
+        return configured;
+    }
+}
@@ -1,7 +1,16 @@
 /* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
 
 #include <kafka/X86interrupt.hpp>
+#include <kafka/X86acpi.hpp>
 #include <kafka/X86cpu.hpp>
+#include <kafka/X86fpu.hpp>
+#include <kafka/X86ioapic.hpp>
+#include <kafka/X86lapic.hpp>
+#include <kafka/X86vmem.hpp>
+#include <kafka/tss.hpp>
+#include <kafka/aspace.hpp>
+#include <kafka/heap.hpp>
+#include <kafka/rcu.hpp>
 #include <kafka/hal/cpu.hpp>
 #include <kafka/types.hpp>
 #include <stdint.h>
@@ -10,6 +19,7 @@
 namespace kfk
 {
 	constexpr uint16_t IDT_ENTRIES = 256;
+	static constexpr auto MSR_GS_BASE = 0xC0000101;
 
 	struct InterruptFrame
 	{
@@ -141,11 +151,67 @@ namespace kfk
 			/* 129-255: NULL[] */
 		};
 
-		/* handlers for interrupts */
-		static int_handler handlers[IDT_ENTRIES] = {};
-		static void *handler_contexts[IDT_ENTRIES] = {};
-		static IntFlags handler_flags[IDT_ENTRIES] = {};
-		static uint8_t handler_priorities[IDT_ENTRIES] = {};
+		/* a registered handler; replaced as a whole and freed after a grace period */
+		struct HandlerEntry
+		{
+			RcuHead rcu; /* first, so the callback can cast back */
+			InterruptEntry entry;
+		};
+
+		/* handlers for interrupts, published through RCU; nullptr means the default handler */
+		static Atomic<HandlerEntry *> handlers[IDT_ENTRIES] = {};
+
+		static constexpr uint8_t IRQ_VECTOR_BASE = 32;
+		static constexpr uint8_t IPI_VECTOR_BASE = 240;
+		static constexpr uint32_t UNROUTED = UINT32_MAX;
+
+		/* CPU each ISA line is delivered to; UNROUTED until it is first enabled or pinned */
+		static uint32_t line_cpu[Ioapic::ISA_IRQS] = {};
+
+		/* lines a driver has enabled; a level line is only unmasked after its handler if it still is */
+		static Atomic<bool> line_enabled[Ioapic::ISA_IRQS] = {};
+
+		/* next CPU to hand a line to, so IRQs spread over the cores rather than piling onto the BSP */
+		static Atomic<uint32_t> next_target(0);
+
+		/* ISA line behind an IRQ vector; -1 if it does not go through the I/O APIC */
+		static int isa_line(uint8_t vector)
+		{
+			if (vector < IRQ_VECTOR_BASE || vector >= IRQ_VECTOR_BASE + Ioapic::ISA_IRQS)
+				return -1;
+
+			/* 0 is the local APIC timer's vector and 2 the 8259 cascade; neither is an I/O APIC line here */
+			const int line = vector - IRQ_VECTOR_BASE;
+			return line == 0 || line == 2 ? -1 : line;
+		}
+
+		/* where a vector comes from, which decides how `dispatch` acknowledges it */
+		enum class VectorKind : uint8_t
+		{
+			EXCEPTION, /* raised by the CPU itself */
+			SOFTWARE, /* `int n`, or nothing raises it; the APIC never saw it */
+			EDGE, /* LAPIC timer, IPIs and edge ISA lines */
+			LEVEL /* level ISA lines; the I/O APIC resends them while they stay asserted */
+		};
+
+		static VectorKind vector_kind(uint8_t vector)
+		{
+			if (vector < IRQ_VECTOR_BASE)
+				return VectorKind::EXCEPTION;
+
+			if (vector == IRQ_VECTOR_BASE || (vector >= IPI_VECTOR_BASE && vector != Lapic::SPURIOUS_VECTOR))
+				return VectorKind::EDGE; /* LAPIC timer and IPIs */
+
+			if (const int line = isa_line(vector); line >= 0)
+				return ioapic::level_triggered(line) ? VectorKind::LEVEL : VectorKind::EDGE;
+
+			return VectorKind::SOFTWARE;
+		}
+
+		static void free_entry(RcuHead *head)
+		{
+			heap::free(reinterpret_cast<HandlerEntry *>(head));
+		}
 
 		/* default handlers */
 		static void default_handler(void *context)
@@ -156,29 +222,89 @@ namespace kfk
 			kfk::printf("unhandled interrupt at rip: %p\n", frame->ip);
 		}
 
-		/* trampoline functions to get interrupt number */
-		__attribute__((interrupt)) static void int_trampoline(InterruptFrame *frame)
+		/*
+		 * GS is the per-CPU area only while in the kernel; from user mode it is
+		 * the user's, with ours parked in KERNEL_GS_BASE. every vector entered
+		 * from CPL3 swaps it in before touching per-CPU data and back on the way out
+		 */
+		static inline bool enter_gs(const InterruptFrame *frame)
 		{
-			/* get interrupt number pushed by our handler */
-			uint64_t int_no;
-			asm volatile("mov 8(%%rbp), %0" : "=r"(int_no) : : "memory");
+			const bool user = frame->cs & 3;
+			if (user)
+				asm volatile("swapgs" : : : "memory");
+			return user;
+		}
 
-			if (int_no < IDT_ENTRIES && handlers[int_no])
-			{
-				handlers[int_no](frame);
-			}
+		static inline void exit_gs(bool user)
+		{
+			if (user)
+				asm volatile("swapgs" : : : "memory");
+		}
+
+		/*
+		 * NMI, #MC and #DF run on IST stacks and can land inside the entry code:
+		 * before the swapgs that follows a ring-3 entry, or after the one that
+		 * precedes sysretq. the saved CS does not say which base is loaded then,
+		 * so ask the MSR; true if it swapped, for `exit_gs`
+		 */
+		static inline bool paranoid_enter_gs()
+		{
+			const bool user = cpu_traits<x86_64>::rdmsr(MSR_GS_BASE) != cpu_traits<x86_64>::kernel_gs_base();
+			if (user)
+				asm volatile("swapgs" : : : "memory");
+			return user;
+		}
+
+		static constexpr bool is_paranoid(uint8_t vector)
+		{
+			return vector == 2 || vector == 8 || vector == 18;
+		}
+
+		/* handlers run in interrupt context, which is a read-side section on its own */
+		static void dispatch(uint64_t int_no, void *context, InterruptFrame *frame)
+		{
+			if (int_no == Lapic::SPURIOUS_VECTOR)
+				return; /* never in service, so no EOI either */
+
+			/*
+			 * acknowledge APIC interrupts up front: a handler may switch threads
+			 * (the scheduler tick does), and the vector would stay blocked until
+			 * this thread ran again. interrupts stay off until the handler is done.
+			 * a level line is still asserted until its handler quiets the device,
+			 * so an early EOI would have it delivered again at once; it is masked
+			 * first and unmasked once the handler is done
+			 */
+			const VectorKind kind = vector_kind(int_no);
+			const int line = kind == VectorKind::LEVEL ? isa_line(int_no) : -1;
+			if (line >= 0)
+				ioapic::mask(line);
+			if (kind == VectorKind::EDGE || kind == VectorKind::LEVEL)
+				lapic::eoi();
+
+			rcu::irq_enter();
+			const HandlerEntry *entry = int_no < IDT_ENTRIES ? rcu_dereference(handlers[int_no]) : nullptr;
+			if (entry)
+				entry->entry.handler(context);
 			else
-			{
 				default_handler(frame);
-			}
+			rcu::irq_exit();
+
+			if (line >= 0 && line_enabled[line].load(MemoryOrder::RELAXED))
+				ioapic::unmask(line);
 		}
 
-		__attribute__((interrupt)) static void error_trampoline(InterruptFrame *frame, uint64_t error)
+		/* one entry point per vector, so the vector number is a constant rather than something to dig up */
+		template<uint8_t Vector>
+		__attribute__((interrupt)) static void vector_stub(InterruptFrame *frame)
 		{
-			/* get interrupt number pushed by our handler */
-			uint64_t int_no;
-			asm volatile("mov 16(%%rbp), %0" : "=r"(int_no) : : "memory");
+			const bool user = is_paranoid(Vector) ? paranoid_enter_gs() : enter_gs(frame);
+			dispatch(Vector, frame, frame);
+			exit_gs(user);
+		}
 
+		template<uint8_t Vector>
+		__attribute__((interrupt)) static void error_stub(InterruptFrame *frame, uint64_t error)
+		{
 			/* create context with frame and error */
 			struct ErrorContext
 			{
@@ -186,20 +312,49 @@ namespace kfk
 				uint64_t error;
 			} ctx = { frame, error };
 
-			if (int_no < IDT_ENTRIES && handlers[int_no])
-			{
-				handlers[int_no](&ctx);
-			}
-			else
-			{
-				default_handler(frame);
-			}
+			const bool user = is_paranoid(Vector) ? paranoid_enter_gs() : enter_gs(frame);
+			dispatch(Vector, &ctx, frame);
+			exit_gs(user);
 		}
 
 		/* exception handlers */
 		__attribute__((interrupt)) static void page_fault_handler(InterruptFrame *frame, uint64_t error)
 		{
-			uint64_t fault_addr = cpu_traits<x86_64>::read_cr3();
+			const bool user = enter_gs(frame);
+			uint64_t fault_addr = cpu_traits<x86_64>::read_cr2();
+			AddressSpace *space = AddressSpace::current();
+
+			/*
+			 * copy-on-write, under the space lock like `fault`: two CPUs faulting on
+			 * the same page resolve it one after the other, and an unmap cannot free
+			 * the tables under the walk
+			 */
+			if ((error & (x86_64_internal::PF_PRESENT | x86_64_internal::PF_WRITE)) ==
+				(x86_64_internal::PF_PRESENT | x86_64_internal::PF_WRITE))
+			{
+				if (space)
+					space->lock();
+				const bool resolved = vmm_traits<x86_64>::handle_fault(fault_addr, error);
+				if (space)
+					space->unlock();
+
+				if (resolved)
+				{
+					exit_gs(user);
+					return;
+				}
+			}
+
+			/* demand paging; the VMAs of the loaded space say what belongs there */
+			if (!(error & x86_64_internal::PF_PRESENT))
+			{
+				if (space && space->fault(fault_addr, error & x86_64_internal::PF_WRITE))
+				{
+					exit_gs(user);
+					return;
+				}
+			}
+
 			kfk::printf("page fault at %p (%s%s%s)\n", 
 				fault_addr,
 				(error & 1) ? "protection violation" : "non-present page",
@@ -211,13 +366,40 @@ namespace kfk
 
 		__attribute__((interrupt)) static void general_protection_handler(InterruptFrame *frame, uint64_t error)
 		{
+			enter_gs(frame); /* does not return */
 			kfk::printf("general protection fault! error code: %x at rip: %p\n",
 				   error, frame->ip);
 			cpu_traits<x86_64>::halt();
 		}
 
+		/* first FPU use since a context switch; load the thread's state and retry */
+		__attribute__((interrupt)) static void device_na_handler(InterruptFrame *frame)
+		{
+			const bool user = enter_gs(frame);
+			fpu_traits<x86_64>::trap();
+			exit_gs(user);
+		}
+
+		/* dedicated rather than through `dispatch`, so a shootdown never depends on the handler table */
+		__attribute__((interrupt)) static void tlb_shootdown_handler(InterruptFrame *frame)
+		{
+			const bool user = enter_gs(frame);
+			vmm_traits<x86_64>::flush_pending();
+			lapic::eoi();
+			exit_gs(user);
+		}
+
+		/* nothing to do: taking it is what wakes an idle CPU to look at its run queue */
+		__attribute__((interrupt)) static void reschedule_handler(InterruptFrame *frame)
+		{
+			const bool user = enter_gs(frame);
+			lapic::eoi();
+			exit_gs(user);
+		}
+
 		__attribute__((interrupt)) static void double_fault_handler(InterruptFrame *frame, uint64_t)
 		{
+			paranoid_enter_gs(); /* does not return */
 			kfk::printf("double fault at rip: %p\n", frame->ip);
 			cpu_traits<x86_64>::halt(); /* you are cooked. */
 		}
@@ -236,63 +418,100 @@ namespace kfk
 			entry.offset_high = (handler_addr >> 32) & 0xFFFFFFFF;
 			entry.reserved = 0;
 		}
+
+		/* exceptions that push an error code */
+		static constexpr bool has_error_code(uint8_t vector)
+		{
+			return vector == 8 || (vector >= 10 && vector <= 14) || vector == 17 || vector == 21 ||
+				   vector == 29 || vector == 30;
+		}
+
+		/* point vectors First..Last at their stubs; ones with a dedicated handler are left alone */
+		template<uint8_t First, uint8_t Last>
+		static void set_stubs()
+		{
+			if (!(idt_entries[First].flags & 0x80))
+			{
+				if constexpr (has_error_code(First))
+					set_idt_entry(First, reinterpret_cast<void *>(error_stub<First>));
+				else
+					set_idt_entry(First, reinterpret_cast<void *>(vector_stub<First>));
+			}
+
+			if constexpr (First < Last)
+				set_stubs<First + 1, Last>();
+		}
 	}
 
 	void interrupt_traits<x86_64>::init() noexcept
 	{
-		/* initialize all handlers to default */
-		for (auto &handler: handlers)
-			handler = default_handler;
-
 		/* set up exception handlers */
 		set_idt_entry(vint_to_vector[EXCEPTION_PAGE_FAULT], reinterpret_cast<void *>(page_fault_handler));
 		set_idt_entry(vint_to_vector[EXCEPTION_GENERAL_PROTECTION],
 					  reinterpret_cast<void *>(general_protection_handler));
-		set_idt_entry(vint_to_vector[EXCEPTION_DOUBLE_FAULT], reinterpret_cast<void *>(double_fault_handler));
+		set_idt_entry(vint_to_vector[EXCEPTION_DOUBLE_FAULT], reinterpret_cast<void *>(double_fault_handler),
+					  IST_DOUBLE_FAULT);
+		set_idt_entry(vint_to_vector[EXCEPTION_DEVICE_NA], reinterpret_cast<void *>(device_na_handler));
+		set_idt_entry(to_vector(IPI_TLB_SHOOTDOWN), reinterpret_cast<void *>(tlb_shootdown_handler));
+		set_idt_entry(to_vector(IPI_RESCHEDULE), reinterpret_cast<void *>(reschedule_handler));
 
-		/* set up all other exception gates */
-		for (uint8_t i = 0; i <= 20; i++)
-		{
-			if (i != EXCEPTION_PAGE_FAULT && i != EXCEPTION_GENERAL_PROTECTION && i != EXCEPTION_DOUBLE_FAULT &&
-				i != 15)
-			{ 
-				/* 15 is reserved */
-				uint8_t vector = vint_to_vector[i];
-				if (i == EXCEPTION_DOUBLE_FAULT || i == EXCEPTION_INVALID_TSS || i == EXCEPTION_SEG_NOT_PRESENT ||
-					i == EXCEPTION_STACK_FAULT || i == EXCEPTION_GENERAL_PROTECTION || i == EXCEPTION_PAGE_FAULT ||
-					i == EXCEPTION_ALIGNMENT_CHECK)
-				{
-					/* these exceptions push an error code */
-					set_idt_entry(vector, reinterpret_cast<void *>(error_trampoline));
-				}
-				else
-				{
-					/* these don't push an error code */
-					set_idt_entry(vector, reinterpret_cast<void *>(int_trampoline));
-				}
-			}
-		}
+		/* every other exception, IRQ and software vector goes through `dispatch` */
+		set_stubs<0, 127>();
+		set_stubs<128, 255>();
+
+		/* NMI and #MC can land anywhere, even mid stack switch; run them on their own stacks */
+		idt_entries[2].ist = IST_NMI;
+		idt_entries[18].ist = IST_MACHINE_CHECK;
 
-		/* load the idt */
+		load();
+	}
+
+	void interrupt_traits<x86_64>::init_controllers(volatile limine_rsdp_request *request) noexcept
+	{
+		for (uint32_t &cpu : line_cpu)
+			cpu = UNROUTED;
+
+		/* base revision 3 hands over the RSDP's physical address */
+		limine_rsdp_response *response = request->response;
+		if (!response || !acpi::init(reinterpret_cast<uintptr_t>(response->address)))
+			return;
+
+		if (const AcpiHeader *madt = acpi::find("APIC"))
+			ioapic::init(madt);
+	}
+
+	void interrupt_traits<x86_64>::load() noexcept
+	{
 		asm volatile("lidt %0" : : "m"(idt_descriptor));
 	}
 
 	void interrupt_traits<x86_64>::enable(uint16_t n) noexcept
 	{
-		uint8_t x86vector = to_vector(static_cast<Vint>(n));
-		if (x86vector >= 32 && x86vector < 48)
+		const uint8_t x86vector = to_vector(static_cast<Vint>(n));
+		const int line = isa_line(x86vector);
+		if (line < 0 || !ioapic::present())
+			return;
+
+		/* first use picks a CPU round-robin; the BSP takes it if that one cannot be addressed */
+		if (line_cpu[line] == UNROUTED)
 		{
-			/* TODO: enable the IRQ */
+			const uint32_t cpu = next_target.fetch_add(1, MemoryOrder::RELAXED) % cpu_traits<x86_64>::count();
+			if (!set_affinity(n, cpu) && !set_affinity(n, 0))
+				return;
 		}
+
+		line_enabled[line].store(true, MemoryOrder::RELAXED);
+		ioapic::unmask(line);
 	}
 
 	void interrupt_traits<x86_64>::disable(uint16_t n) noexcept
 	{
-		uint8_t x86vector = to_vector(static_cast<Vint>(n));
-		if (x86vector >= 32 && x86vector < 48)
-		{
-			/* TODO: mask the IRQ in the pic */
-		}
+		const int line = isa_line(to_vector(static_cast<Vint>(n)));
+		if (line < 0)
+			return;
+
+		line_enabled[line].store(false, MemoryOrder::RELAXED);
+		ioapic::mask(line);
 	}
 
 	void interrupt_traits<x86_64>::enable() noexcept
@@ -305,32 +524,81 @@ namespace kfk
 		asm volatile("cli"); /* globally disable interrupts */
 	}
 
+	uint64_t interrupt_traits<x86_64>::save() noexcept
+	{
+		uint64_t flags;
+		asm volatile("pushfq\n popq %0\n cli" : "=r"(flags) : : "memory");
+		return flags;
+	}
+
+	void interrupt_traits<x86_64>::restore(uint64_t state) noexcept
+	{
+		if (state & (1ULL << 9)) /* RFLAGS.IF */
+			asm volatile("sti" : : : "memory");
+	}
+
 	void interrupt_traits<x86_64>::register_handler(Vint id, int_handler handler, void *context, uint8_t priority,
 													IntFlags flags) noexcept
 	{
 		uint8_t vector = to_vector(id);
 
-		handlers[vector] = handler;
-		handler_contexts[vector] = context;
-		handler_flags[vector] = flags;
-		handler_priorities[vector] = priority;
+		/* build the new entry off to the side so a concurrent dispatch sees either version whole */
+		auto *replacement = static_cast<HandlerEntry *>(heap::allocate(sizeof(HandlerEntry)));
+		if (!replacement)
+			return;
+
+		replacement->entry = { handler, context, flags, priority, id };
+		if (HandlerEntry *old = rcu_assign_pointer(handlers[vector], replacement))
+			rcu::call(&old->rcu, free_entry);
 
 		/* if the interrupt is an irq, configure it */
-		if (vector >= 32 && vector < 48)
+		if (const int line = isa_line(vector); line >= 0)
 		{
+			if ((static_cast<uint32_t>(flags) & static_cast<uint32_t>(IntFlags::LEVEL_TRIGGER)) ==
+				static_cast<uint32_t>(IntFlags::LEVEL_TRIGGER))
+				ioapic::set_trigger(line, true);
+			else if ((static_cast<uint32_t>(flags) & static_cast<uint32_t>(IntFlags::EDGE_TRIGGER)) ==
+					 static_cast<uint32_t>(IntFlags::EDGE_TRIGGER))
+				ioapic::set_trigger(line, false);
+
 			if ((static_cast<uint32_t>(flags) & static_cast<uint32_t>(IntFlags::MASKED)) ==
 				static_cast<uint32_t>(IntFlags::MASKED))
 			{
-				/* TODO: mask the interrupt */
+				disable(id);
 			}
 			else if ((static_cast<uint32_t>(flags) & static_cast<uint32_t>(IntFlags::UNMASKED)) ==
 					 static_cast<uint32_t>(IntFlags::UNMASKED))
 			{
-				/* TODO: unmask the interrupt */
+				enable(id);
 			}
 		}
 	}
 
+	bool interrupt_traits<x86_64>::set_affinity(uint16_t n, uint32_t cpu) noexcept
+	{
+		const uint8_t x86vector = to_vector(static_cast<Vint>(n));
+		const int line = isa_line(x86vector);
+		if (line < 0 || cpu >= cpu_traits<x86_64>::count())
+			return false;
+
+		const uint32_t apic_id = lapic::apic_id(cpu);
+		if (apic_id == UINT32_MAX || !ioapic::route(line, x86vector, apic_id))
+			return false;
+
+		line_cpu[line] = cpu;
+		return true;
+	}
+
+	bool interrupt_traits<x86_64>::send_ipi(uint32_t cpu, Vint id) noexcept
+	{
+		const uint32_t apic_id = lapic::apic_id(cpu);
+		if (cpu >= cpu_traits<x86_64>::count() || apic_id == UINT32_MAX)
+			return false;
+
+		lapic::send_ipi(apic_id, to_vector(id));
+		return true;
+	}
+
 	uint8_t interrupt_traits<x86_64>::to_vector(Vint id) noexcept
 	{
 		switch (uint16_t index = static_cast<uint16_t>(id))
@@ -344,11 +612,14 @@ namespace kfk
 			case 0x0200: /* syscall - vector 128 (0x80) */
 				return 128;
 
+			case 0x0300 ... 0x030E: /* IPIs - vectors 240-254, the highest class below spurious */
+				return IPI_VECTOR_BASE + (index - 0x0300);
+
 			case 0x1000 ... 0x1FFF:			  /* arch-specific */
 				return 48 + (index - 0x1000); /* use vector 48+ for platform-specific */
 
 			case 0x8000 ... 0xFFFF:					  /* user-defined - map to high vectors */
-				return 192 + ((index - 0x8000) % 64); /* use vectors 192-255, and maybe some wrap */
+				return 192 + ((index - 0x8000) % 48); /* use vectors 192-239, and maybe some wrap */
 
 			default: /* fallback; sortta */
 				return 0;
@@ -0,0 +1,277 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic.hpp>
+#include <kafka/X86acpi.hpp>
+#include <kafka/X86cpu.hpp>
+#include <kafka/X86interrupt.hpp>
+#include <kafka/X86ioapic.hpp>
+#include <kafka/X86vmem.hpp>
+
+namespace kfk
+{
+    static constexpr size_t MAX_IOAPICS = 8;
+
+    /* MADT entry types */
+    static constexpr uint8_t MADT_IOAPIC = 1;
+    static constexpr uint8_t MADT_SOURCE_OVERRIDE = 2;
+    static constexpr uint32_t MADT_PCAT_COMPAT = 1U << 0; /* dual 8259s are present too */
+
+    /* MPS INTI flags in source overrides */
+    static constexpr uint16_t INTI_POLARITY_MASK = 0x3;
+    static constexpr uint16_t INTI_ACTIVE_LOW = 0x3;
+    static constexpr uint16_t INTI_TRIGGER_MASK = 0xC;
+    static constexpr uint16_t INTI_LEVEL = 0xC;
+
+    /* registers are reached through an index/data window */
+    static constexpr uint32_t IOREGSEL = 0x00;
+    static constexpr uint32_t IOWIN = 0x10;
+    static constexpr uint32_t IOAPIC_VERSION = 0x01;
+    static constexpr uint32_t IOAPIC_REDIRECTION = 0x10; /* two registers per pin */
+
+    static constexpr uint32_t RTE_ACTIVE_LOW = 1U << 13;
+    static constexpr uint32_t RTE_LEVEL = 1U << 15;
+    static constexpr uint32_t RTE_MASKED = 1U << 16;
+    static constexpr uint32_t RTE_VECTOR = 0xFF;
+    static constexpr uint32_t MAX_PHYSICAL_DEST = 0xFF; /* 8-bit destination; wider ids need interrupt remapping */
+
+    /* 8259 ports */
+    static constexpr uint16_t PIC1_COMMAND = 0x20;
+    static constexpr uint16_t PIC1_DATA = 0x21;
+    static constexpr uint16_t PIC2_COMMAND = 0xA0;
+    static constexpr uint16_t PIC2_DATA = 0xA1;
+
+    struct MadtHeader
+    {
+        AcpiHeader header;
+        uint32_t lapic_address;
+        uint32_t flags;
+    } __attribute__((packed));
+
+    struct MadtEntry
+    {
+        uint8_t type;
+        uint8_t length;
+    } __attribute__((packed));
+
+    struct MadtIoapic
+    {
+        MadtEntry entry;
+        uint8_t id;
+        uint8_t reserved;
+        uint32_t address;
+        uint32_t gsi_base;
+    } __attribute__((packed));
+
+    struct MadtSourceOverride
+    {
+        MadtEntry entry;
+        uint8_t bus;
+        uint8_t source; /* ISA IRQ */
+        uint32_t gsi;
+        uint16_t flags;
+    } __attribute__((packed));
+
+    struct IoapicUnit
+    {
+        volatile uint32_t *registers;
+        uint32_t gsi_base;
+        uint32_t pins;
+    };
+
+    struct IsaLine
+    {
+        uint32_t gsi;
+        bool active_low;
+        bool level;
+    };
+
+    static IoapicUnit units[MAX_IOAPICS] = {};
+    static size_t unit_count = 0;
+    static IsaLine lines[Ioapic::ISA_IRQS] = {};
+    static Spinlock lock; /* IOREGSEL and IOWIN go in pairs; taken with interrupts off */
+
+    static uint32_t read(const IoapicUnit &unit, uint32_t reg)
+    {
+        unit.registers[IOREGSEL / sizeof(uint32_t)] = reg;
+        return unit.registers[IOWIN / sizeof(uint32_t)];
+    }
+
+    static void write(const IoapicUnit &unit, uint32_t reg, uint32_t value)
+    {
+        unit.registers[IOREGSEL / sizeof(uint32_t)] = reg;
+        unit.registers[IOWIN / sizeof(uint32_t)] = value;
+    }
+
+    /* unit and pin serving `irq`; nullptr if no I/O APIC covers its GSI */
+    static const IoapicUnit *find_pin(uint8_t irq, uint32_t *pin)
+    {
+        if (irq >= Ioapic::ISA_IRQS)
+            return nullptr;
+
+        const uint32_t gsi = lines[irq].gsi;
+        for (size_t i = 0; i < unit_count; i++)
+        {
+            if (gsi >= units[i].gsi_base && gsi < units[i].gsi_base + units[i].pins)
+            {
+                *pin = gsi - units[i].gsi_base;
+                return &units[i];
+            }
+        }
+        return nullptr;
+    }
+
+    /* `low = (low & ~clear) | set` on the pin's low word */
+    static void update(uint8_t irq, uint32_t clear, uint32_t set)
+    {
+        uint32_t pin;
+        const IoapicUnit *unit = find_pin(irq, &pin);
+        if (!unit)
+            return;
+
+        const uint64_t state = interrupt_traits<x86_64>::save();
+        lock.lock();
+        const uint32_t reg = IOAPIC_REDIRECTION + pin * 2;
+        write(*unit, reg, (read(*unit, reg) & ~clear) | set);
+        lock.unlock();
+        interrupt_traits<x86_64>::restore(state);
+    }
+
+    /* remap the 8259s clear of the exception vectors, then mask them for good; a spurious IRQ 7 would otherwise look like #DF */
+    static void disable_pic()
+    {
+        const uint8_t vector = interrupt_traits<x86_64>::to_vector(IRQ_TIMER);
+
+        cpu_traits<x86_64>::outb(PIC1_COMMAND, 0x11); /* ICW1: init, ICW4 follows */
+        cpu_traits<x86_64>::outb(PIC2_COMMAND, 0x11);
+        cpu_traits<x86_64>::outb(PIC1_DATA, vector); /* ICW2: vector base */
+        cpu_traits<x86_64>::outb(PIC2_DATA, vector + 8);
+        cpu_traits<x86_64>::outb(PIC1_DATA, 0x04); /* ICW3: slave on IRQ 2 */
+        cpu_traits<x86_64>::outb(PIC2_DATA, 0x02);
+        cpu_traits<x86_64>::outb(PIC1_DATA, 0x01); /* ICW4: 8086 mode */
+        cpu_traits<x86_64>::outb(PIC2_DATA, 0x01);
+
+        cpu_traits<x86_64>::outb(PIC1_DATA, 0xFF);
+        cpu_traits<x86_64>::outb(PIC2_DATA, 0xFF);
+    }
+
+    bool Ioapic::init(const AcpiHeader *madt) noexcept
+    {
+        /* ISA defaults: identity mapped, edge triggered, active high */
+        for (uint8_t irq = 0; irq < ISA_IRQS; irq++)
+            lines[irq] = { irq, false, false };
+
+        const auto *header = reinterpret_cast<const MadtHeader *>(madt);
+        const auto *cursor = reinterpret_cast<const uint8_t *>(header + 1);
+        const auto *end = reinterpret_cast<const uint8_t *>(madt) + madt->length;
+        while (cursor + sizeof(MadtEntry) <= end)
+        {
+            const auto *entry = reinterpret_cast<const MadtEntry *>(cursor);
+            if (entry->length < sizeof(MadtEntry) || cursor + entry->length > end)
+                break; /* malformed; keep what we have */
+
+            if (entry->type == MADT_IOAPIC && entry->length >= sizeof(MadtIoapic) && unit_count < MAX_IOAPICS)
+            {
+                const auto *info = reinterpret_cast<const MadtIoapic *>(entry);
+                const uintptr_t mmio = vmm_traits<x86_64>::map_device(info->address, 0x20,
+                                                                     KERNEL_RW | VmmFlags::CACHE_DISABLE);
+                if (mmio)
+                {
+                    IoapicUnit &unit = units[unit_count++];
+                    unit.registers = reinterpret_cast<volatile uint32_t *>(mmio);
+                    unit.gsi_base = info->gsi_base;
+                    unit.pins = ((read(unit, IOAPIC_VERSION) >> 16) & 0xFF) + 1;
+                }
+            }
+            else if (entry->type == MADT_SOURCE_OVERRIDE && entry->length >= sizeof(MadtSourceOverride))
+            {
+                const auto *info = reinterpret_cast<const MadtSourceOverride *>(entry);
+                if (info->bus == 0 && info->source < ISA_IRQS)
+                {
+                    /* "conforms to the bus" means ISA's edge and active high */
+                    lines[info->source] = {
+                        info->gsi,
+                        (info->flags & INTI_POLARITY_MASK) == INTI_ACTIVE_LOW,
+                        (info->flags & INTI_TRIGGER_MASK) == INTI_LEVEL
+                    };
+                }
+            }
+
+            cursor += entry->length;
+        }
+
+        if (!unit_count)
+            return false;
+
+        /* everything masked until a driver asks for it; firmware may have left pins live */
+        for (size_t i = 0; i < unit_count; i++)
+        {
+            for (uint32_t pin = 0; pin < units[i].pins; pin++)
+                write(units[i], IOAPIC_REDIRECTION + pin * 2, RTE_MASKED);
+        }
+
+        if (header->flags & MADT_PCAT_COMPAT)
+            disable_pic();
+
+        for (uint8_t irq = 0; irq < ISA_IRQS; irq++)
+        {
+            const uint32_t polarity = lines[irq].active_low ? RTE_ACTIVE_LOW : 0;
+            update(irq, 0, polarity | (lines[irq].level ? RTE_LEVEL : 0));
+        }
+
+        return true;
+    }
+
+    bool Ioapic::present() noexcept
+    {
+        return unit_count != 0;
+    }
+
+    bool Ioapic::route(uint8_t irq, uint8_t vector, uint32_t apic_id) noexcept
+    {
+        uint32_t pin;
+        const IoapicUnit *unit = find_pin(irq, &pin);
+        if (!unit || apic_id > MAX_PHYSICAL_DEST)
+            return false;
+
+        const uint64_t state = interrupt_traits<x86_64>::save();
+        lock.lock();
+
+        /* mask while the two halves disagree, so the pin never fires at a half-written destination */
+        const uint32_t reg = IOAPIC_REDIRECTION + pin * 2;
+        const uint32_t low = read(*unit, reg);
+        write(*unit, reg, low | RTE_MASKED);
+        write(*unit, reg + 1, apic_id << 24);
+        write(*unit, reg, (low & ~RTE_VECTOR) | vector); /* fixed delivery, physical destination */
+
+        lock.unlock();
+        interrupt_traits<x86_64>::restore(state);
+        return true;
+    }
+
+    void Ioapic::mask(uint8_t irq) noexcept
+    {
+        update(irq, 0, RTE_MASKED);
+    }
+
+    void Ioapic::unmask(uint8_t irq) noexcept
+    {
+        update(irq, RTE_MASKED, 0);
+    }
+
+    void Ioapic::set_trigger(uint8_t irq, bool level) noexcept
+    {
+        if (irq >= ISA_IRQS)
+            return;
+
+        lines[irq].level = level;
+        lines[irq].active_low = level;
+        update(irq, RTE_LEVEL | RTE_ACTIVE_LOW, level ? RTE_LEVEL | RTE_ACTIVE_LOW : 0);
+    }
+
+    bool Ioapic::level_triggered(uint8_t irq) noexcept
+    {
+        return irq < ISA_IRQS && lines[irq].level;
+    }
+}
@@ -0,0 +1,133 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <kafka/X86cpu.hpp>
+#include <kafka/X86interrupt.hpp>
+#include <kafka/X86lapic.hpp>
+#include <kafka/X86vmem.hpp>
+
+namespace kfk
+{
+    static constexpr auto MSR_APIC_BASE = 0x1B;
+    static constexpr uint64_t APIC_BASE_ENABLE = 1ULL << 11;
+    static constexpr uint64_t APIC_BASE_X2APIC = 1ULL << 10;
+    static constexpr uint64_t APIC_BASE_ADDRESS = 0x000FFFFFFFFFF000ULL;
+    static constexpr uint32_t X2APIC_MSR_BASE = 0x800;
+    static constexpr uint32_t MSR_X2APIC_EOI = X2APIC_MSR_BASE + (Lapic::EOI >> 4);
+    static constexpr uint32_t MSR_X2APIC_ICR = X2APIC_MSR_BASE + (Lapic::ICR_LOW >> 4);
+    static constexpr uint32_t SVR_ENABLE = 1U << 8;
+
+    enum class LapicMode : uint8_t
+    {
+        NONE,
+        XAPIC,
+        X2APIC
+    };
+
+    static LapicMode mode = LapicMode::NONE;
+    static volatile uint32_t *registers = nullptr; /* xAPIC only; every CPU sees its own APIC at the same address */
+    static uint32_t apic_ids[MAX_CPUS] = {};
+
+    void Lapic::init(uint32_t cpu) noexcept
+    {
+        uint64_t base = cpu_traits<x86_64>::rdmsr(MSR_APIC_BASE);
+
+        if (mode == LapicMode::NONE)
+        {
+            uint32_t eax, ebx, ecx, edx;
+            cpu_traits<x86_64>::cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+            if (ecx & (1U << 21))
+            {
+                mode = LapicMode::X2APIC;
+            }
+            else
+            {
+                const uintptr_t mmio = vmm_traits<x86_64>::map_device(base & APIC_BASE_ADDRESS, 0x1000,
+                                                                     KERNEL_RW | VmmFlags::CACHE_DISABLE);
+                if (!mmio)
+                    return;
+
+                registers = reinterpret_cast<volatile uint32_t *>(mmio);
+                mode = LapicMode::XAPIC;
+            }
+        }
+
+        /* x2APIC can only be entered from the enabled xAPIC state, so set both bits together */
+        base |= APIC_BASE_ENABLE;
+        if (mode == LapicMode::X2APIC)
+            base |= APIC_BASE_X2APIC;
+        cpu_traits<x86_64>::wrmsr(MSR_APIC_BASE, base);
+
+        write(TPR, 0); /* accept every priority */
+        write(SVR, SVR_ENABLE | SPURIOUS_VECTOR);
+
+        if (cpu < MAX_CPUS)
+            apic_ids[cpu] = id() + 1; /* 0 marks a CPU that has not come up */
+    }
+
+    bool Lapic::x2apic() noexcept
+    {
+        return mode == LapicMode::X2APIC;
+    }
+
+    uint32_t Lapic::read(uint32_t reg) noexcept
+    {
+        if (mode == LapicMode::X2APIC)
+            return static_cast<uint32_t>(cpu_traits<x86_64>::rdmsr(X2APIC_MSR_BASE + (reg >> 4)));
+
+        return registers[reg / sizeof(uint32_t)];
+    }
+
+    void Lapic::write(uint32_t reg, uint32_t value) noexcept
+    {
+        if (mode == LapicMode::X2APIC)
+            cpu_traits<x86_64>::wrmsr(X2APIC_MSR_BASE + (reg >> 4), value);
+        else
+            registers[reg / sizeof(uint32_t)] = value;
+    }
+
+    /* on every interrupt, so straight to the register: one non-serializing WRMSR with x2APIC, one store without */
+    void Lapic::eoi() noexcept
+    {
+        if (mode == LapicMode::X2APIC)
+            cpu_traits<x86_64>::wrmsr(MSR_X2APIC_EOI, 0);
+        else if (mode == LapicMode::XAPIC)
+            registers[EOI / sizeof(uint32_t)] = 0;
+    }
+
+    uint32_t Lapic::id() noexcept
+    {
+        /* xAPIC keeps the id in the top byte */
+        const uint32_t value = read(ID);
+        return mode == LapicMode::X2APIC ? value : value >> 24;
+    }
+
+    uint32_t Lapic::apic_id(uint32_t cpu) noexcept
+    {
+        return cpu < MAX_CPUS && apic_ids[cpu] ? apic_ids[cpu] - 1 : UINT32_MAX;
+    }
+
+    void Lapic::send_ipi(uint32_t apic_id, uint8_t vector) noexcept
+    {
+        if (mode == LapicMode::X2APIC)
+        {
+            /* a write to the x2APIC ICR is not serializing; fence so the target sees what we wrote before */
+            asm volatile("mfence" : : : "memory");
+            cpu_traits<x86_64>::wrmsr(MSR_X2APIC_ICR, (static_cast<uint64_t>(apic_id) << 32) | ICR_ASSERT | vector);
+            return;
+        }
+
+        if (mode != LapicMode::XAPIC)
+            return;
+
+        /* the two halves go in separately; an interrupt in between could send with the wrong destination */
+        const uint64_t state = interrupt_traits<x86_64>::save();
+        while (registers[ICR_LOW / sizeof(uint32_t)] & ICR_PENDING)
+            cpu_traits<x86_64>::pause();
+
+        registers[ICR_HIGH / sizeof(uint32_t)] = apic_id << 24;
+        registers[ICR_LOW / sizeof(uint32_t)] = ICR_ASSERT | vector; /* sends it */
+        interrupt_traits<x86_64>::restore(state);
+    }
+}
@@ -0,0 +1,81 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <kafka/X86cpu.hpp>
+#include <kafka/X86fpu.hpp>
+#include <kafka/X86interrupt.hpp>
+#include <kafka/X86simd.hpp>
+
+namespace kfk
+{
+    static constexpr size_t PAGE_SIZE = 4096;
+
+    static constexpr uint64_t XCR0_AVX = 0x6; /* SSE and YMM upper halves */
+    static constexpr uint64_t XCR0_AVX512 = 0xE6; /* plus opmask and the ZMM state */
+
+    /* general register fallbacks; fast strings make these decent on anything recent */
+    static void clear_pages_rep(void *dst, size_t pages)
+    {
+        size_t count = pages * PAGE_SIZE / 8;
+        asm volatile("rep stosq" : "+D"(dst), "+c"(count) : "a"(0) : "memory");
+    }
+
+    static void copy_pages_rep(void *dst, const void *src, size_t pages)
+    {
+        size_t count = pages * PAGE_SIZE / 8;
+        asm volatile("rep movsq" : "+D"(dst), "+S"(src), "+c"(count) : : "memory");
+    }
+
+    static void (*clear_impl)(void *, size_t) noexcept = nullptr;
+    static void (*copy_impl)(void *, const void *, size_t) noexcept = nullptr;
+
+    void simd_traits<x86_64>::init() noexcept
+    {
+        if (!fpu_traits<x86_64>::ready())
+            return;
+
+        uint32_t eax, ebx, ecx, edx;
+        cpu_traits<x86_64>::cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+        const uint32_t max_leaf = eax;
+
+        cpu_traits<x86_64>::cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+        const bool osxsave = ecx & (1U << 27);
+        const bool avx = ecx & (1U << 28);
+        if (!osxsave || !avx || max_leaf < 7)
+            return;
+
+        /* the CPU having it is not enough; the state must be enabled in XCR0 too */
+        const uint64_t xcr0 = cpu_traits<x86_64>::xgetbv(0);
+        cpu_traits<x86_64>::cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+
+        if ((ebx & (1U << 16)) && (xcr0 & XCR0_AVX512) == XCR0_AVX512)
+        {
+            clear_impl = x86_64_internal::clear_pages_avx512;
+            copy_impl = x86_64_internal::copy_pages_avx512;
+        }
+        else if ((ebx & (1U << 5)) && (xcr0 & XCR0_AVX) == XCR0_AVX)
+        {
+            clear_impl = x86_64_internal::clear_pages_avx2;
+            copy_impl = x86_64_internal::copy_pages_avx2;
+        }
+    }
+
+    void simd_traits<x86_64>::clear_pages(void *dst, size_t pages) noexcept
+    {
+        if (!clear_impl)
+            return clear_pages_rep(dst, pages);
+
+        SimdGuardT<fpu_traits<x86_64>, interrupt_traits<x86_64>> guard;
+        clear_impl(dst, pages);
+    }
+
+    void simd_traits<x86_64>::copy_pages(void *dst, const void *src, size_t pages) noexcept
+    {
+        if (!copy_impl)
+            return copy_pages_rep(dst, src, pages);
+
+        SimdGuardT<fpu_traits<x86_64>, interrupt_traits<x86_64>> guard;
+        copy_impl(dst, src, pages);
+    }
+}
@@ -0,0 +1,46 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+/* built with -mavx512f; see X86simd.hpp before including anything here */
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace kfk
+{
+    namespace x86_64_internal
+    {
+        static constexpr size_t PAGE_SIZE = 4096;
+
+        typedef long long Vec512 __attribute__((vector_size(64)));
+
+        /* one cache line per register; four lines per round */
+        void clear_pages_avx512(void *dst, size_t pages) noexcept
+        {
+            auto *out = static_cast<Vec512 *>(dst);
+            const Vec512 zero = {};
+
+            for (size_t i = 0; i < pages * PAGE_SIZE / sizeof(Vec512); i += 4)
+            {
+                out[i] = zero;
+                out[i + 1] = zero;
+                out[i + 2] = zero;
+                out[i + 3] = zero;
+            }
+        }
+
+        void copy_pages_avx512(void *dst, const void *src, size_t pages) noexcept
+        {
+            auto *out = static_cast<Vec512 *>(dst);
+            const auto *in = static_cast<const Vec512 *>(src);
+
+            for (size_t i = 0; i < pages * PAGE_SIZE / sizeof(Vec512); i += 4)
+            {
+                const Vec512 a = in[i], b = in[i + 1], c = in[i + 2], d = in[i + 3];
+                out[i] = a;
+                out[i + 1] = b;
+                out[i + 2] = c;
+                out[i + 3] = d;
+            }
+        }
+    }
+}
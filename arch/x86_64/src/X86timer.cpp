@@ -0,0 +1,172 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <kafka/X86cpu.hpp>
+#include <kafka/X86interrupt.hpp>
+#include <kafka/X86lapic.hpp>
+#include <kafka/X86timer.hpp>
+#include <kafka/vdso_page.hpp>
+
+namespace kfk
+{
+    static constexpr auto MSR_TSC_DEADLINE = 0x6E0;
+
+    /* PIT channel 2, gated through port 0x61; the only reference every PC has without ACPI */
+    static constexpr uint32_t PIT_HZ = 1193182;
+    static constexpr uint16_t PIT_CHANNEL2 = 0x42;
+    static constexpr uint16_t PIT_COMMAND = 0x43;
+    static constexpr uint16_t PIT_GATE = 0x61;
+    static constexpr uint8_t PIT_GATE_HIGH = 0x01;
+    static constexpr uint8_t PIT_SPEAKER = 0x02;
+    static constexpr uint8_t PIT_OUT2 = 0x20;
+    static constexpr uint32_t CALIBRATION_MS = 10;
+    static constexpr int CALIBRATION_ROUNDS = 3;
+
+    static constexpr uint32_t LAPIC_DIVIDE_16 = 0x3;
+
+    /* fixed-point factors: `x * mult >> shift` */
+    static constexpr uint32_t TO_NS_SHIFT = 32;
+    static constexpr uint32_t FROM_NS_SHIFT = 24;
+
+    static uint64_t boot_tsc = 0;
+    static uint64_t tsc_hz = 0;
+    static uint64_t tsc_to_ns = 0;
+    static uint64_t ns_to_tsc = 0;
+    static uint64_t ns_to_lapic = 0; /* one-shot fallback only */
+    static bool deadline_mode = false;
+
+    static uint64_t scale(uint64_t value, uint64_t mult, uint32_t shift)
+    {
+        return static_cast<uint64_t>((static_cast<unsigned __int128>(value) * mult) >> shift);
+    }
+
+    static bool invariant_tsc()
+    {
+        uint32_t eax, ebx, ecx, edx;
+        cpu_traits<x86_64>::cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+        if (eax < 0x80000007)
+            return false;
+
+        cpu_traits<x86_64>::cpuid(0x80000007, 0, &eax, &ebx, &ecx, &edx);
+        return edx & (1U << 8);
+    }
+
+    /* time one PIT countdown with the TSC and the APIC timer; the shortest of a few rounds has the least noise */
+    static void calibrate(uint64_t *tsc_ticks, uint64_t *lapic_ticks)
+    {
+        constexpr uint16_t count = PIT_HZ * CALIBRATION_MS / 1000;
+
+        *tsc_ticks = UINT64_MAX;
+        *lapic_ticks = 0;
+        for (int round = 0; round < CALIBRATION_ROUNDS; round++)
+        {
+            /* gate low holds the count; mode 0 raises OUT2 when it runs out */
+            cpu_traits<x86_64>::outb(PIT_GATE, cpu_traits<x86_64>::inb(PIT_GATE) & ~(PIT_GATE_HIGH | PIT_SPEAKER));
+            cpu_traits<x86_64>::outb(PIT_COMMAND, 0xB0); /* channel 2, low then high byte, mode 0 */
+            cpu_traits<x86_64>::outb(PIT_CHANNEL2, count & 0xFF);
+            cpu_traits<x86_64>::outb(PIT_CHANNEL2, count >> 8);
+
+            lapic::write(Lapic::TIMER_DIVIDE, LAPIC_DIVIDE_16);
+            lapic::write(Lapic::LVT_TIMER, Lapic::LVT_MASKED);
+            lapic::write(Lapic::TIMER_INITIAL, UINT32_MAX);
+
+            const uint64_t start = cpu_traits<x86_64>::rdtsc();
+            cpu_traits<x86_64>::outb(PIT_GATE, (cpu_traits<x86_64>::inb(PIT_GATE) & ~PIT_SPEAKER) | PIT_GATE_HIGH);
+            while (!(cpu_traits<x86_64>::inb(PIT_GATE) & PIT_OUT2))
+                cpu_traits<x86_64>::pause();
+            const uint64_t tsc = cpu_traits<x86_64>::rdtsc() - start;
+            const uint64_t apic = UINT32_MAX - lapic::read(Lapic::TIMER_CURRENT);
+
+            if (tsc < *tsc_ticks)
+            {
+                *tsc_ticks = tsc;
+                *lapic_ticks = apic;
+            }
+        }
+
+        lapic::write(Lapic::TIMER_INITIAL, 0);
+    }
+
+    void timer_traits<x86_64>::init() noexcept
+    {
+        uint32_t eax, ebx, ecx, edx;
+        cpu_traits<x86_64>::cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+        deadline_mode = ecx & (1U << 24);
+
+        uint64_t tsc_ticks, lapic_ticks;
+        calibrate(&tsc_ticks, &lapic_ticks);
+
+        /* CPUID's figure is exact where it exists; the PIT is the fallback */
+        tsc_hz = cpu_traits<x86_64>::tsc_frequency();
+        if (!tsc_hz)
+            tsc_hz = tsc_ticks * 1000 / CALIBRATION_MS;
+
+        const uint64_t lapic_hz = lapic_ticks * 1000 / CALIBRATION_MS;
+
+        tsc_to_ns = (1000000000ULL << TO_NS_SHIFT) / tsc_hz;
+        ns_to_tsc = (tsc_hz << FROM_NS_SHIFT) / 1000000000ULL;
+        ns_to_lapic = (lapic_hz << FROM_NS_SHIFT) / 1000000000ULL;
+        boot_tsc = cpu_traits<x86_64>::rdtsc();
+
+        /* user mode can only extrapolate a TSC that ticks at a constant rate */
+        if (invariant_tsc())
+        {
+            vdso::update_clock(boot_tsc, 0, tsc_to_ns, TO_NS_SHIFT);
+            vdso::add_flags(VDSO_CLOCK_TSC);
+        }
+
+        init_cpu();
+    }
+
+    void timer_traits<x86_64>::init_cpu() noexcept
+    {
+        const uint8_t vector = interrupt_traits<x86_64>::to_vector(IRQ_TIMER);
+        if (deadline_mode)
+        {
+            lapic::write(Lapic::LVT_TIMER, vector | Lapic::LVT_TSC_DEADLINE);
+            asm volatile("mfence" : : : "memory"); /* the LVT write must land before the first deadline does */
+        }
+        else
+        {
+            lapic::write(Lapic::TIMER_DIVIDE, LAPIC_DIVIDE_16);
+            lapic::write(Lapic::LVT_TIMER, vector); /* one-shot */
+        }
+
+        disarm();
+    }
+
+    uint64_t timer_traits<x86_64>::now() noexcept
+    {
+        return scale(cpu_traits<x86_64>::rdtsc() - boot_tsc, tsc_to_ns, TO_NS_SHIFT);
+    }
+
+    void timer_traits<x86_64>::arm(uint64_t deadline) noexcept
+    {
+        if (deadline_mode)
+        {
+            /* a deadline already behind the TSC fires at once, which is what we want */
+            const uint64_t tsc = boot_tsc + scale(deadline, ns_to_tsc, FROM_NS_SHIFT);
+            cpu_traits<x86_64>::wrmsr(MSR_TSC_DEADLINE, tsc ? tsc : 1);
+            return;
+        }
+
+        const uint64_t current = now();
+        const uint64_t delta = deadline > current ? deadline - current : 0;
+        uint64_t ticks = scale(delta, ns_to_lapic, FROM_NS_SHIFT);
+        if (ticks == 0)
+            ticks = 1;
+        if (ticks > UINT32_MAX)
+            ticks = UINT32_MAX; /* fires early; the handler finds nothing due and arms again */
+
+        lapic::write(Lapic::TIMER_INITIAL, static_cast<uint32_t>(ticks));
+    }
+
+    void timer_traits<x86_64>::disarm() noexcept
+    {
+        if (deadline_mode)
+            cpu_traits<x86_64>::wrmsr(MSR_TSC_DEADLINE, 0);
+        else
+            lapic::write(Lapic::TIMER_INITIAL, 0);
+    }
+}
@@ -1,13 +1,17 @@
 /* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
 
 #include <stdint.h>
+#include <type_traits.hpp>
 #include <allocator.hpp>
+#include <atomic.hpp>
 #include <iostream.hpp>
 #include <string.hpp>
 #include <kafka/slub.hpp>
 #include <kafka/types.hpp>
 #include <kafka/pmem.hpp>
 #include <kafka/X86cpu.hpp>
+#include <kafka/X86interrupt.hpp>
+#include <kafka/X86simd.hpp>
 #include <kafka/X86vmem.hpp>
 #include <kafka/hal/cpu.hpp>
 #include <kafka/hal/vmem.hpp>
@@ -15,27 +19,596 @@
 namespace kfk
 {
     static uint64_t hhdm_offset = 0;
-    static uint64_t *kernel_pml4 = nullptr;
+    static uint64_t *kernel_root = nullptr; /* top-level table; PML4, or PML5 under LA57 */
+    static size_t paging_levels = 4;
     static const VmmFlags KERNEL_FLAGS_NEW = KERNEL_RW;
     static constexpr uint64_t KERNEL_FLAGS = x86_64_internal::VMM_PRESENT | x86_64_internal::VMM_WRITABLE;
 
-    /* memory regions */
-    static constexpr auto KERNEL_HEAP_START = 0xFFFF8F0000000000;
-    static constexpr auto KERNEL_HEAP_END = 0xFFFF900000000000;
-
     /* paging structure */
     static constexpr size_t PAGE_SIZE = 4096;
     static constexpr size_t PAGE_TABLE_ENTRIES = 512;
-    
+    static constexpr size_t USER_ENTRIES = PAGE_TABLE_ENTRIES / 2; /* lower half of the top level */
+    static constexpr uintptr_t PT_SPAN = PAGE_SIZE * PAGE_TABLE_ENTRIES; /* VA covered by one page table */
+
     static constexpr size_t MAX_REGIONS = 64;
     using VmmAllocator = kfk::Allocator<AllocPolicy::SWITCHABLE, MAX_REGIONS * sizeof(MemoryRegion)>;
 
     static VmmAllocator region_alloc;
     static MemoryRegion* regions = nullptr;
     static size_t region_count = 0;
+    static IrqSpinlock region_lock; /* guards `regions`; the array itself never grows */
+
+    /* index into the paging structure at `level` (1 = PT, 4 = PML4, 5 = PML5) */
+    static constexpr size_t table_index(uintptr_t virt_addr, size_t level)
+    {
+        return (virt_addr >> (12 + 9 * (level - 1))) & 0x1FF;
+    }
+
+    /* HHDM view of the table an entry points to */
+    static uint64_t *table_of(uint64_t entry)
+    {
+        return reinterpret_cast<uint64_t *>((entry & x86_64_internal::VMM_ADDR_MASK) + hhdm_offset);
+    }
+
+    /* top-level table of the address space loaded in CR3 */
+    static uint64_t *current_root()
+    {
+        return table_of(cpu_traits<x86_64>::read_cr3());
+    }
+
+    /*
+     * page-table page pool. pooled frames are kept zeroed apart from the first
+     * entry, which links them together, so the map path pays a freelist pop
+     * instead of a trip through the physical allocator plus a 4KB memset
+     */
+    static constexpr size_t PTB_POOL_BATCH = 16; /* frames pulled from the pmm at once */
+    static constexpr size_t PTB_POOL_HIGH = 64; /* above this, empty tables go back to the pmm */
+
+    static uintptr_t ptb_pool = 0;
+    static size_t ptb_pool_count = 0;
+    static IrqSpinlock ptb_lock; /* guards the pool; never held across a pmm call */
+
+    static void ptb_push(uintptr_t phys)
+    {
+        auto *table = reinterpret_cast<uint64_t *>(phys + hhdm_offset);
+        table[0] = ptb_pool;
+        ptb_pool = phys;
+        ptb_pool_count++;
+    }
+
+    static uintptr_t ptb_alloc()
+    {
+        ptb_lock.lock();
+        if (!ptb_pool)
+        {
+            /* refill unlocked: the pmm can map heap pages, which comes back here */
+            ptb_lock.unlock();
+            for (size_t i = 0; i < PTB_POOL_BATCH; i++)
+            {
+                const uintptr_t phys = pmm::pmalloc(1); /* comes back zeroed */
+                if (!phys)
+                    break;
+
+                ptb_lock.lock();
+                ptb_push(phys);
+                ptb_lock.unlock();
+            }
+
+            ptb_lock.lock();
+            if (!ptb_pool)
+            {
+                ptb_lock.unlock();
+                return 0;
+            }
+        }
+
+        const uintptr_t phys = ptb_pool;
+        auto *table = reinterpret_cast<uint64_t *>(phys + hhdm_offset);
+        ptb_pool = table[0];
+        table[0] = 0;
+        ptb_pool_count--;
+        ptb_lock.unlock();
+
+        if (PageFrame *frame = pmm::frame(phys))
+        {
+            frame->live = 0;
+            frame->flags |= PageFrame::PAGE_TABLE;
+        }
+        return phys;
+    }
+
+    /* return an empty table; every entry must already be zero */
+    static void ptb_free(uintptr_t phys)
+    {
+        ptb_lock.lock();
+        if (ptb_pool_count >= PTB_POOL_HIGH)
+        {
+            ptb_lock.unlock();
+            if (PageFrame *frame = pmm::frame(phys))
+                frame->flags &= ~PageFrame::PAGE_TABLE;
+            pmm::pfree(phys, 1);
+            return;
+        }
+
+        ptb_push(phys);
+        ptb_lock.unlock();
+    }
+
+    /*
+     * TLB shootdown. other CPUs may still cache translations for what this one
+     * unmaps or write-protects: kernel stacks of threads that migrated, user
+     * pages of a space loaded elsewhere too. before frames, tables or VA are
+     * reused the initiator IPIs every other CPU and waits until each has
+     * flushed the range. one request runs at a time
+     */
+    static constexpr size_t SHOOTDOWN_INVLPG_MAX = 32; /* past this many pages a full flush is cheaper */
+
+    static_assert(MAX_CPUS <= 64, "the CPUs yet to flush are a single word");
+
+    static Spinlock shootdown_lock; /* taken with interrupts off */
+    static uintptr_t shootdown_start = 0;
+    static size_t shootdown_size = 0;
+    static Atomic<uint64_t> shootdown_pending(0); /* bit n set until CPU n has flushed */
+
+    static void flush_local(uintptr_t start, size_t size)
+    {
+        if (size / PAGE_SIZE <= SHOOTDOWN_INVLPG_MAX)
+        {
+            for (uintptr_t offset = 0; offset < size; offset += PAGE_SIZE)
+                cpu_traits<x86_64>::invlpg(reinterpret_cast<void *>(start + offset));
+            return;
+        }
+
+        /* a CR3 reload keeps global translations, which only the kernel half has */
+        const uint64_t cr4 = cpu_traits<x86_64>::read_cr4();
+        if (static_cast<intptr_t>(start) < 0 && (cr4 & x86_64_internal::CR4_PGE))
+        {
+            cpu_traits<x86_64>::write_cr4(cr4 & ~x86_64_internal::CR4_PGE);
+            cpu_traits<x86_64>::write_cr4(cr4);
+        }
+        else
+        {
+            cpu_traits<x86_64>::write_cr3(cpu_traits<x86_64>::read_cr3());
+        }
+    }
+
+    /* flush [start, start + size) on every other CPU and wait for them; the caller flushes its own */
+    static void shootdown(uintptr_t start, size_t size)
+    {
+        const uint32_t count = cpu_traits<x86_64>::count();
+        if (count < 2)
+            return;
+
+        const uint64_t state = interrupt_traits<x86_64>::save();
+        while (!shootdown_lock.try_lock())
+        {
+            vmm_traits<x86_64>::flush_pending(); /* the holder may be waiting on us */
+            cpu_relax();
+        }
+
+        shootdown_start = start;
+        shootdown_size = size;
+
+        const uint32_t self = cpu_traits<x86_64>::id();
+        const uint64_t targets = (count == 64 ? ~0ULL : (1ULL << count) - 1) & ~(1ULL << self);
+        shootdown_pending.store(targets, MemoryOrder::RELEASE);
+        for (uint32_t cpu = 0; cpu < count; cpu++)
+        {
+            /* one that cannot take IPIs yet has not run anything that could have cached the range */
+            if ((targets & (1ULL << cpu)) && !interrupt_traits<x86_64>::send_ipi(cpu, IPI_TLB_SHOOTDOWN))
+                shootdown_pending.fetch_and(~(1ULL << cpu), MemoryOrder::RELEASE);
+        }
+
+        while (shootdown_pending.load(MemoryOrder::ACQUIRE))
+            cpu_relax();
+
+        shootdown_lock.unlock();
+        interrupt_traits<x86_64>::restore(state);
+    }
+
+    /* account one more present entry in `table` */
+    static void live_inc(uint64_t *table)
+    {
+        if (PageFrame *frame = pmm::frame(reinterpret_cast<uintptr_t>(table) - hhdm_offset))
+            frame->live++;
+    }
+
+    /*
+     * paging depth as a type. every walker below is a template on it, so the
+     * descent is a fixed-trip loop the compiler unrolls and the 4-level path
+     * carries no depth checks; `with_depth` is the one place the live depth is
+     * turned into a type
+     */
+    template<size_t Levels>
+    using Depth = integral_constant<size_t, Levels>;
+
+    template<typename Fn>
+    static inline decltype(auto) with_depth(Fn &&fn)
+    {
+        if (paging_levels == 5)
+            return fn(Depth<5>());
+        return fn(Depth<4>());
+    }
+
+    /* VA covered by one entry at `level` */
+    static constexpr uintptr_t level_span(size_t level)
+    {
+        return 1ULL << (12 + 9 * (level - 1));
+    }
+
+    /*
+     * the descent every single-address walk goes through. `path` receives the
+     * tables on the way down, path[level - 1] being the one at `level`. what an
+     * outcome means is up to the visitor:
+     *   bool missing(table, entry, level)  `entry` is not present; fill it and return true to descend
+     *   R hole(level)                      stopped at a missing entry
+     *   R huge(entry, level)               a 1GB/2MB leaf ends the walk
+     *   R leaf(pt)                         reached the page table
+     */
+    template<size_t Levels, typename Visitor>
+    static auto walk(uint64_t *root, uintptr_t virt_addr, uint64_t **path, Visitor &&visitor)
+    {
+        uint64_t *table = root;
+        path[Levels - 1] = table;
+        for (size_t level = Levels; level > 1; level--)
+        {
+            uint64_t &entry = table[table_index(virt_addr, level)];
+            if (!(entry & x86_64_internal::VMM_PRESENT) && !visitor.missing(table, entry, level))
+                return visitor.hole(level);
+
+            if (entry & x86_64_internal::VMM_HUGE)
+                return visitor.huge(entry, level);
+
+            table = table_of(entry);
+            path[level - 2] = table;
+        }
+
+        return visitor.leaf(table);
+    }
+
+    /*
+     * range walk over [start, end). instead of one descent per page it descends
+     * once per page table and hands the visitor the whole run of PTEs under it,
+     * so bulk operations work straight on the entry array. every callback
+     * returns false to stop the walk, which is then reported as false:
+     *   run(path, first, count, va)  PTEs first..first + count - 1 of path[0]; the first one maps `va`
+     *   huge(entry, level, va, len)  a 1GB/2MB leaf covering [va, va + len) of the range
+     *   hole(va, len)                nothing mapped in [va, va + len)
+     * `run` may free tables on the path; the next run descends again
+     */
+    template<size_t Levels, typename Visitor>
+    static bool walk_range(uint64_t *root, uintptr_t start, uintptr_t end, Visitor &visitor)
+    {
+        uint64_t *path[x86_64_internal::MAX_PAGING_LEVELS];
+
+        uintptr_t virt_addr = start;
+        while (virt_addr < end)
+        {
+            uint64_t *table = root;
+            path[Levels - 1] = table;
+
+            size_t level = Levels;
+            for (; level > 1; level--)
+            {
+                /* end of this entry's span, clamped to the range; wraps to 0 at the very top */
+                const uintptr_t next = (virt_addr & ~(level_span(level) - 1)) + level_span(level);
+                const uintptr_t stop = (next == 0 || next > end) ? end : next;
+
+                uint64_t &entry = table[table_index(virt_addr, level)];
+                if (!(entry & x86_64_internal::VMM_PRESENT))
+                {
+                    if (!visitor.hole(virt_addr, stop - virt_addr))
+                        return false;
+                    virt_addr = stop;
+                    break;
+                }
+
+                if (entry & x86_64_internal::VMM_HUGE)
+                {
+                    if (!visitor.huge(entry, level, virt_addr, stop - virt_addr))
+                        return false;
+                    virt_addr = stop;
+                    break;
+                }
+
+                table = table_of(entry);
+                path[level - 2] = table;
+            }
+
+            if (level > 1)
+                continue; /* the range moved past a hole or huge leaf */
+
+            const uintptr_t next = (virt_addr & ~(PT_SPAN - 1)) + PT_SPAN;
+            const uintptr_t stop = (next == 0 || next > end) ? end : next;
+            const size_t first = table_index(virt_addr, 1);
+            if (!visitor.run(path, first, table_index(stop - 1, 1) - first + 1, virt_addr))
+                return false;
+
+            virt_addr = stop;
+        }
+
+        return true;
+    }
+
+    /* plain lookup; nullptr when unmapped or under a huge leaf */
+    struct LookupVisitor
+    {
+        bool missing(uint64_t *, uint64_t &, size_t) { return false; }
+        uint64_t *hole(size_t) { return nullptr; }
+        uint64_t *huge(uint64_t &, size_t) { return nullptr; }
+        uint64_t *leaf(uint64_t *pt) { return pt; }
+    };
+
+    /* lookup that builds missing tables; nullptr when out of memory or blocked by a huge leaf */
+    struct CreateVisitor
+    {
+        uint64_t user; /* USER bit for the new upper-level entries */
+
+        bool missing(uint64_t *table, uint64_t &entry, size_t)
+        {
+            const uintptr_t phys = ptb_alloc(); /* pre-zeroed */
+            if (!phys)
+                return false;
+
+            entry = phys | x86_64_internal::VMM_PRESENT | x86_64_internal::VMM_WRITABLE | user;
+            live_inc(table);
+            return true;
+        }
+
+        uint64_t *hole(size_t) { return nullptr; }
+        uint64_t *huge(uint64_t &, size_t) { return nullptr; }
+        uint64_t *leaf(uint64_t *pt) { return pt; }
+    };
+
+    /* full translation, huge leaves included; 0 when unmapped */
+    struct TranslateVisitor
+    {
+        uintptr_t virt_addr;
+
+        bool missing(uint64_t *, uint64_t &, size_t) { return false; }
+        uintptr_t hole(size_t) { return 0; }
+
+        uintptr_t huge(uint64_t &entry, size_t level)
+        {
+            const uintptr_t span = level_span(level);
+            return (entry & x86_64_internal::VMM_ADDR_MASK & ~(span - 1)) + (virt_addr & (span - 1));
+        }
+
+        uintptr_t leaf(uint64_t *pt)
+        {
+            const uint64_t pte = pt[table_index(virt_addr, 1)];
+            if (!(pte & x86_64_internal::VMM_PRESENT))
+                return 0; /* not mapped */
+
+            return (pte & x86_64_internal::VMM_ADDR_MASK) + (virt_addr & 0xFFF);
+        }
+    };
+
+    /*
+     * `cleared` leaf entries under path[0], which covers `virt_addr`, were just
+     * zeroed; drop them from the live count and unlink every table the unmap
+     * leaves empty. those go to `emptied`, to be freed once no CPU can still
+     * walk through them. the top level has its kernel half copied into every address
+     * space, so tables hanging off it there are kept. tables not allocated from
+     * the pool (e.g. the ones built by the bootloader) are never counted and
+     * never freed. returns true if path[0] is no longer the table covering
+     * `virt_addr`
+     */
+    template<size_t Levels>
+    static bool reclaim(uint64_t *const *path, uintptr_t virt_addr, size_t cleared, uintptr_t *emptied,
+                        size_t &emptied_count)
+    {
+        for (size_t level = 1; level < Levels; level++)
+        {
+            const uintptr_t phys = reinterpret_cast<uintptr_t>(path[level - 1]) - hhdm_offset;
+            PageFrame *frame = pmm::frame(phys);
+            if (!frame || !(frame->flags & PageFrame::PAGE_TABLE) || frame->live < cleared)
+                return level != 1;
+
+            frame->live -= cleared;
+            if (frame->live != 0)
+                return level != 1;
+
+            if (level + 1 == Levels && table_index(virt_addr, Levels) >= USER_ENTRIES)
+                return true;
+
+            path[level][table_index(virt_addr, level + 1)] = 0;
+            emptied[emptied_count++] = phys;
+            cleared = 1; /* one entry less in the parent */
+        }
+        return true;
+    }
+
+    /*
+     * clears every present leaf in the runs it is shown and drops one reference
+     * on each frame. huge leaves only come from the bootloader and are left be
+     */
+    template<size_t Levels>
+    struct UnmapVisitor
+    {
+        static constexpr size_t BATCH_SIZE = 64;
+        uintptr_t frames[BATCH_SIZE];
+        uintptr_t tables[BATCH_SIZE];
+        size_t gathered = 0;
+        size_t emptied = 0;
+        size_t unmapped = 0;
+        uintptr_t low = UINTPTR_MAX; /* VA cleared since the last flush */
+        uintptr_t high = 0;
+
+        /* release the gathered frames and tables once no CPU has a translation through them left */
+        void flush()
+        {
+            if (low < high)
+                shootdown(low, high - low);
+            low = UINTPTR_MAX;
+            high = 0;
+
+            pmm::pput_batch(frames, gathered);
+            gathered = 0;
+
+            for (size_t i = 0; i < emptied; i++)
+                ptb_free(tables[i]);
+            emptied = 0;
+        }
+
+        bool run(uint64_t *const *path, size_t first, size_t count, uintptr_t virt_addr)
+        {
+            uint64_t *pt = path[0];
+            size_t cleared = 0;
+            for (size_t i = 0; i < count; i++)
+            {
+                uint64_t &pte = pt[first + i];
+                if (!(pte & x86_64_internal::VMM_PRESENT))
+                    continue; /* already unmapped */
+
+                if (gathered == BATCH_SIZE)
+                    flush();
+
+                frames[gathered++] = pte & x86_64_internal::VMM_ADDR_MASK;
+                pte = 0;
+                cleared++;
+                unmapped++;
+
+                /* runs come in ascending order */
+                const uintptr_t page = virt_addr + i * PAGE_SIZE;
+                if (page < low)
+                    low = page;
+                high = page + PAGE_SIZE;
+
+                /* invalidate TLB entry; also drops cached upper-level entries for it */
+                cpu_traits<x86_64>::invlpg(reinterpret_cast<void *>(page));
+            }
+
+            if (cleared)
+            {
+                if (emptied + Levels > BATCH_SIZE)
+                    flush();
+                reclaim<Levels>(path, virt_addr, cleared, tables, emptied);
+            }
+            return true;
+        }
+
+        bool huge(uint64_t &, size_t, uintptr_t, size_t) { return true; }
+        bool hole(uintptr_t, size_t) { return true; }
+    };
+
+    /* unmap [virt_addr, virt_addr + size) of `root`, dropping a reference on every frame; returns the page count */
+    static size_t unmap_range(uint64_t *root, uintptr_t virt_addr, size_t size)
+    {
+        return with_depth([&](auto depth) {
+            UnmapVisitor<decltype(depth)::value> visitor;
+            walk_range<decltype(depth)::value>(root, virt_addr, virt_addr + size, visitor);
+            visitor.flush();
+            return visitor.unmapped;
+        });
+    }
+
+    /*
+     * leaf table covering `virt_addr`. the cursor keeps the path of the last walk,
+     * so consecutive pages under the same table cost a single compare. returns
+     * nullptr when the range is unmapped or covered by a huge page
+     */
+    static uint64_t *cursor_pt(uint64_t *root, uintptr_t virt_addr, WalkCursor &cursor)
+    {
+        const uintptr_t base = virt_addr & ~(PT_SPAN - 1);
+        if (cursor.base == base)
+            return cursor.path[0];
+
+        const uint64_t *pt = with_depth([&](auto depth) {
+            return walk<decltype(depth)::value>(root, virt_addr, cursor.path, LookupVisitor());
+        });
+        if (!pt)
+        {
+            cursor = WalkCursor();
+            return nullptr;
+        }
+
+        cursor.base = base;
+        return cursor.path[0];
+    }
+
+    /*
+     * kernel VA layout. nothing is pinned to a fixed address: every area gets its
+     * own randomly picked top-level slot and a random 2MB-aligned slide inside it,
+     * all derived from the paging geometry below
+     */
+    static constexpr size_t AREA_COUNT = 3;
+    static constexpr size_t AREA_SIZES[AREA_COUNT] = {
+        64ULL << 30, /* HEAP */
+        64ULL << 30, /* VMALLOC */
+        1ULL << 30 /* PERCPU */
+    };
+    static constexpr size_t AREA_ALIGN = 2ULL << 20; /* one page table worth of VA */
+
+    static MemoryRegion areas[AREA_COUNT] = {};
+
+    /* VA bits translated below the top level; 39 with 4 levels, 48 with 5 */
+    static size_t top_shift()
+    {
+        return 12 + 9 * (paging_levels - 1);
+    }
+
+    /* end of the canonical lower half */
+    static uintptr_t user_top()
+    {
+        return 1ULL << (top_shift() + 8);
+    }
+
+    /* canonical base address of a top-level slot */
+    static uintptr_t slot_base(size_t slot)
+    {
+        uintptr_t base = static_cast<uintptr_t>(slot) << top_shift();
+        if (slot >= USER_ENTRIES)
+            base |= ~((1ULL << (top_shift() + 9)) - 1); /* sign-extend into the upper half */
+        return base;
+    }
+
+    static bool layout_init()
+    {
+        const size_t slot_size = 1ULL << top_shift();
+        const size_t candidates = PAGE_TABLE_ENTRIES - USER_ENTRIES - 1; /* the last slot holds the kernel image */
+
+        for (size_t a = 0; a < AREA_COUNT; a++)
+        {
+            size_t slot = 0;
+            for (size_t tries = 0; tries < 64 && !slot; tries++)
+            {
+                const size_t candidate = USER_ENTRIES + cpu_traits<x86_64>::entropy() % candidates;
+                if (!(kernel_root[candidate] & x86_64_internal::VMM_PRESENT))
+                    slot = candidate;
+            }
+
+            /* unlucky or crowded; settle for the highest free slot */
+            for (size_t i = USER_ENTRIES + candidates - 1; !slot && i >= USER_ENTRIES; i--)
+            {
+                if (!(kernel_root[i] & x86_64_internal::VMM_PRESENT))
+                    slot = i;
+            }
+
+            if (!slot)
+                return false;
+
+            /* populate the slot up front so every address space created later inherits it */
+            const uintptr_t table = ptb_alloc();
+            if (!table)
+                return false;
+            kernel_root[slot] = table | x86_64_internal::VMM_PRESENT | x86_64_internal::VMM_WRITABLE;
+
+            const size_t slides = (slot_size - AREA_SIZES[a]) / AREA_ALIGN;
+            const uintptr_t start = slot_base(slot) + (cpu_traits<x86_64>::entropy() % (slides + 1)) * AREA_ALIGN;
+            areas[a] = {
+                .start = start,
+                .end = start + AREA_SIZES[a],
+                .used = false
+            };
+        }
+
+        return true;
+    }
 
     static uintptr_t find_free_region(size_t size)
     {
+        LockGuard<IrqSpinlock> guard(region_lock);
         for (size_t i = 0; i < region_count; i++)
         {
             /* found a region large enough */
@@ -74,6 +647,7 @@ namespace kfk
 
     static void free_region(uintptr_t addr, size_t size)
     {
+        LockGuard<IrqSpinlock> guard(region_lock);
         for (size_t i = 0; i < region_count; i++)
         {
             if (regions[i].start == addr && regions[i].used)
@@ -104,6 +678,26 @@ namespace kfk
         }
     }
 
+    /* install `entry` as the leaf for `virt_addr` under `root`; false when a table could not be allocated */
+    static bool map_leaf(uint64_t *root, uintptr_t virt_addr, uint64_t entry)
+    {
+        uint64_t *path[x86_64_internal::MAX_PAGING_LEVELS];
+        uint64_t *pt = with_depth([&](auto depth) {
+            return walk<decltype(depth)::value>(root, virt_addr, path,
+                                                CreateVisitor{ entry & x86_64_internal::VMM_USER });
+        });
+        if (!pt)
+            return false; /* out of memory */
+
+        uint64_t &pte = pt[table_index(virt_addr, 1)];
+        if (!(pte & x86_64_internal::VMM_PRESENT))
+            live_inc(pt);
+
+        pte = entry; /* set the page table entry */
+        cpu_traits<x86_64>::invlpg(reinterpret_cast<void *>(virt_addr)); /* invalidate TLB for this page */
+        return true;
+    }
+
     uint64_t vmm_traits<x86_64>::translate_flags(VmmFlags flags) noexcept
     {
         uint64_t native_flags = 0;
@@ -134,6 +728,15 @@ namespace kfk
             
         if (static_cast<uint64_t>(flags) & static_cast<uint64_t>(VmmFlags::HUGE))
             native_flags |= x86_64_internal::VMM_HUGE;
+
+        /* PAT index 5 (PAT | PWT) is programmed as WC by cpu init */
+        if (static_cast<uint64_t>(flags) & static_cast<uint64_t>(VmmFlags::WRITE_COMBINE))
+        {
+            native_flags &= ~x86_64_internal::VMM_CACHE_DISABLE;
+            native_flags |= x86_64_internal::VMM_WRITETHROUGH;
+            native_flags |= (native_flags & x86_64_internal::VMM_HUGE) ? x86_64_internal::VMM_PAT_HUGE
+                                                                        : x86_64_internal::VMM_PAT;
+        }
             
         return native_flags;
     }
@@ -148,13 +751,15 @@ namespace kfk
         if (!regions)
             return;
 
-        /* get the current PML4 from CR3 */
-        kernel_pml4 = reinterpret_cast<uint64_t *>(cpu_traits<x86_64>::read_cr3() + hhdm_offset);
-        regions[0] = {
-            .start = KERNEL_HEAP_START,
-            .end = KERNEL_HEAP_END,
-            .used = false
-        };
+        /* the bootloader picked the depth (see the paging mode request); LA57 cannot be toggled with paging on */
+        paging_levels = (cpu_traits<x86_64>::read_cr4() & x86_64_internal::CR4_LA57) ? 5 : 4;
+
+        /* get the current top-level table from CR3 */
+        kernel_root = reinterpret_cast<uint64_t *>(cpu_traits<x86_64>::read_cr3() + hhdm_offset);
+        if (!layout_init())
+            return;
+
+        regions[0] = areas[static_cast<size_t>(KernelArea::HEAP)];
         region_count = 1;
     }
 
@@ -181,187 +786,346 @@ namespace kfk
         return virt_addr;
     }
 
-    void vmm_traits<x86_64>::map_page(uintptr_t virt_addr, uintptr_t phys_addr, VmmFlags flags) noexcept
+    bool vmm_traits<x86_64>::map_page(uintptr_t virt_addr, uintptr_t phys_addr, VmmFlags flags) noexcept
     {
-        map_page_internal(virt_addr, phys_addr, translate_flags(flags));
+        return map_page_internal(virt_addr, phys_addr, translate_flags(flags));
     }
 
-    void vmm_traits<x86_64>::map_page_internal(uintptr_t virt_addr, uintptr_t phys_addr, uint64_t flags) noexcept
+    uintptr_t vmm_traits<x86_64>::map_device(uintptr_t phys_addr, size_t size, VmmFlags flags) noexcept
     {
-        /* compute indices for each level */
-        const size_t pml4_index = (virt_addr >> 39) & 0x1FF;
-        const size_t pdpt_index = (virt_addr >> 30) & 0x1FF;
-        const size_t pd_index = (virt_addr >> 21) & 0x1FF;
-        const size_t pt_index = (virt_addr >> 12) & 0x1FF;
+        const uintptr_t offset = phys_addr & (PAGE_SIZE - 1);
+        const size_t pages = (size + offset + PAGE_SIZE - 1) / PAGE_SIZE;
+        if (pages == 0)
+            return 0;
 
-        /* get or create PDPT */
-        uint64_t &pml4e = kernel_pml4[pml4_index];
-        uint64_t *pdpt;
+        const uintptr_t virt_addr = find_free_region(pages * PAGE_SIZE);
+        if (virt_addr == 0)
+            return 0;
 
-        if (!(pml4e & x86_64_internal::VMM_PRESENT))
-        {
-            const uintptr_t pdpt_phys = pmm::pmalloc(1);
-            if (!pdpt_phys)
-                return; /* out of memory */
+        /* a fresh 4KB mapping, so the memory type never leaks onto neighbours sharing a huge HHDM page */
+        const uint64_t native_flags = translate_flags(flags) | x86_64_internal::VMM_PRESENT;
+        phys_addr -= offset;
+        for (size_t i = 0; i < pages; ++i)
+            map_page_internal(virt_addr + i * PAGE_SIZE, phys_addr + i * PAGE_SIZE, native_flags);
 
-            pdpt = reinterpret_cast<uint64_t *>(pdpt_phys + hhdm_offset);
-            memset(pdpt, 0, PAGE_SIZE);
+        return virt_addr + offset;
+    }
 
-            pml4e = pdpt_phys | x86_64_internal::VMM_PRESENT | x86_64_internal::VMM_WRITABLE | (flags & x86_64_internal::VMM_USER);
-        }
-        else
+    bool vmm_traits<x86_64>::map_page_internal(uintptr_t virt_addr, uintptr_t phys_addr, uint64_t flags) noexcept
+    {
+        return map_leaf(kernel_root, virt_addr, phys_addr | flags);
+    }
+
+    void vmm_traits<x86_64>::unmap_page(uintptr_t virt_addr) noexcept
+    {
+        /* find the region containing this address */
+        uintptr_t start = 0;
+        size_t size = 0;
+        region_lock.lock();
+        for (size_t i = 0; i < region_count; i++)
         {
-            pdpt = reinterpret_cast<uint64_t *>((pml4e & ~0xFFF) + hhdm_offset);
+            if (regions[i].start <= virt_addr && virt_addr < regions[i].end && regions[i].used)
+            {
+                start = regions[i].start;
+                size = regions[i].end - regions[i].start;
+                break;
+            }
         }
+        region_lock.unlock();
 
-        /* get or create PD */
-        uint64_t &pdpte = pdpt[pdpt_index];
-        uint64_t *pd;
+        if (!size)
+            return;
 
-        if (!(pdpte & x86_64_internal::VMM_PRESENT))
-        {
-            const uintptr_t pd_phys = pmm::pmalloc(1);
-            if (!pd_phys)
-                return; /* out of memory */
+        /* one descent per page table, not per page; unlocked, since freeing the frames may come back here */
+        unmap_range(kernel_root, start, size);
 
-            pd = reinterpret_cast<uint64_t *>(pd_phys + hhdm_offset);
-            memset(pd, 0, PAGE_SIZE);
+        /* free the virtual memory region */
+        free_region(start, size);
+    }
 
-            pdpte = pd_phys | x86_64_internal::VMM_PRESENT | x86_64_internal::VMM_WRITABLE | (flags & x86_64_internal::VMM_USER);
-        }
-        else
+    void vmm_traits<x86_64>::unmap_kernel(uintptr_t virt_addr, size_t size) noexcept
+    {
+        size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        if ((virt_addr & (PAGE_SIZE - 1)) || virt_addr < user_top() || virt_addr + size < virt_addr)
+            return;
+
+        unmap_range(kernel_root, virt_addr, size);
+    }
+
+    uintptr_t vmm_traits<x86_64>::get_pmaddr(uintptr_t virt_addr) noexcept
+    {
+        return with_depth([&](auto depth) {
+            uint64_t *path[x86_64_internal::MAX_PAGING_LEVELS];
+            return walk<decltype(depth)::value>(kernel_root, virt_addr, path, TranslateVisitor{ virt_addr });
+        });
+    }
+
+    uintptr_t vmm_traits<x86_64>::get_pmaddr(uintptr_t virt_addr, WalkCursor &cursor) noexcept
+    {
+        const uint64_t *pt = cursor_pt(kernel_root, virt_addr, cursor);
+        if (!pt)
+            return get_pmaddr(virt_addr); /* unmapped or huge; the full walk sorts it out */
+
+        const uint64_t pte = pt[table_index(virt_addr, 1)];
+        if (!(pte & x86_64_internal::VMM_PRESENT))
+            return 0; /* not mapped */
+
+        return (pte & x86_64_internal::VMM_ADDR_MASK) + (virt_addr & 0xFFF);
+    }
+
+    /* collects the physical pieces of a range; stops at the first hole */
+    struct SegmentVisitor
+    {
+        PhysSegment *segments;
+        size_t max_segments;
+        uintptr_t end;
+        size_t count = 0;
+
+        bool append(uintptr_t phys, size_t len)
         {
-            pd = reinterpret_cast<uint64_t *>((pdpte & ~0xFFF) + hhdm_offset);
-        }
+            /* physically contiguous with the previous piece; extend it */
+            if (count && segments[count - 1].phys + segments[count - 1].len == phys)
+            {
+                segments[count - 1].len += len;
+                return true;
+            }
 
-        /* get or create PT */
-        uint64_t &pde = pd[pd_index];
-        uint64_t *pt;
+            if (count == max_segments)
+                return false; /* caller's list is too short */
 
-        if (!(pde & x86_64_internal::VMM_PRESENT))
+            segments[count++] = { phys, len };
+            return true;
+        }
+
+        bool run(uint64_t *const *path, size_t first, size_t n, uintptr_t virt_addr)
         {
-            const uintptr_t pt_phys = pmm::pmalloc(1);
-            if (!pt_phys)
-                return; /* out of memory */
+            for (size_t i = first; i < first + n; i++)
+            {
+                const uint64_t pte = path[0][i];
+                if (!(pte & x86_64_internal::VMM_PRESENT))
+                    return false; /* hole in the range */
 
-            pt = reinterpret_cast<uint64_t *>(pt_phys + hhdm_offset);
-            memset(pt, 0, PAGE_SIZE);
+                const size_t in_page = PAGE_SIZE - (virt_addr & (PAGE_SIZE - 1));
+                const size_t len = (end - virt_addr < in_page) ? end - virt_addr : in_page;
+                if (!append((pte & x86_64_internal::VMM_ADDR_MASK) + (virt_addr & (PAGE_SIZE - 1)), len))
+                    return false;
 
-            pde = pt_phys | x86_64_internal::VMM_PRESENT | x86_64_internal::VMM_WRITABLE | (flags & x86_64_internal::VMM_USER);
+                virt_addr += len;
+            }
+            return true;
         }
-        else
+
+        bool huge(uint64_t &entry, size_t level, uintptr_t virt_addr, size_t len)
         {
-            pt = reinterpret_cast<uint64_t *>((pde & ~0xFFF) + hhdm_offset);
+            const uintptr_t span = level_span(level);
+            return append((entry & x86_64_internal::VMM_ADDR_MASK & ~(span - 1)) + (virt_addr & (span - 1)), len);
         }
 
-        pt[pt_index] = phys_addr | flags; /* set the page table entry */
-        cpu_traits<x86_64>::invlpg(reinterpret_cast<void *>(virt_addr)); /* invalidate TLB for this page */
+        bool hole(uintptr_t, size_t) { return false; }
+    };
+
+    size_t vmm_traits<x86_64>::translate_range(uintptr_t virt_addr, size_t size, PhysSegment *segments,
+                                               size_t max_segments) noexcept
+    {
+        SegmentVisitor visitor{ segments, max_segments, virt_addr + size };
+        const bool complete = with_depth([&](auto depth) {
+            return walk_range<decltype(depth)::value>(kernel_root, virt_addr, virt_addr + size, visitor);
+        });
+
+        return complete ? visitor.count : 0;
     }
 
-    void vmm_traits<x86_64>::unmap_page(uintptr_t virt_addr) noexcept
+    /* address space that owns `virt_addr`; the kernel half is the same in all of them */
+    static uint64_t *root_for(uintptr_t virt_addr)
     {
-        /* find the region containing this address */
-        for (size_t i = 0; i < region_count; i++)
+        return virt_addr < user_top() ? current_root() : kernel_root;
+    }
+
+    /* VmmFlags view of a leaf's access rights; COW leaves count as writable */
+    static VmmFlags leaf_prot(uint64_t entry)
+    {
+        if (!(entry & x86_64_internal::VMM_PRESENT))
+            return VmmFlags::NONE;
+
+        VmmFlags prot = VmmFlags::PROT_READ;
+        if (entry & (x86_64_internal::VMM_WRITABLE | x86_64_internal::VMM_COW))
+            prot |= VmmFlags::PROT_WRITE;
+        if (!(entry & x86_64_internal::VMM_NX))
+            prot |= VmmFlags::PROT_EXEC;
+        if (entry & x86_64_internal::VMM_USER)
+            prot |= VmmFlags::USER;
+        return prot;
+    }
+
+    /* sums a range up as runs of pages with the same access rights */
+    struct QueryVisitor
+    {
+        VmRun *runs;
+        size_t max_runs;
+        size_t count = 0;
+
+        bool append(uintptr_t virt_addr, size_t len, VmmFlags prot)
         {
-            if (regions[i].start <= virt_addr && virt_addr < regions[i].end && regions[i].used)
+            if (count && runs[count - 1].prot == prot && runs[count - 1].start + runs[count - 1].len == virt_addr)
             {
-                const size_t pages = (regions[i].end - regions[i].start) / PAGE_SIZE; /* found the region */
+                runs[count - 1].len += len;
+                return true;
+            }
 
-                const size_t BATCH_SIZE = 64;
-                for (size_t batch_start = 0; batch_start < pages; batch_start += BATCH_SIZE)
-                {
-                    const size_t batch_end = (batch_start + BATCH_SIZE < pages) ? batch_start + BATCH_SIZE : pages;
-                    uintptr_t phys_addrs[BATCH_SIZE]; /* stack allocation with reasonable size */
+            if (count == max_runs)
+                return false; /* caller's list is too short */
 
-                    /* get physical addresses for this batch */
-                    for (size_t j = batch_start; j < batch_end; j++)
-                        phys_addrs[j - batch_start] = get_pmaddr(virt_addr + j * PAGE_SIZE);
+            runs[count++] = { virt_addr, len, prot };
+            return true;
+        }
 
-                    /* unmap all pages in this batch */
-                    for (size_t j = batch_start; j < batch_end; j++)
-                    {
-                        /* calculate indices */
-                        const uintptr_t curr_addr = virt_addr + j * PAGE_SIZE;
-                        const size_t pml4_index = (curr_addr >> 39) & 0x1FF;
-                        const size_t pdpt_index = (curr_addr >> 30) & 0x1FF;
-                        const size_t pd_index = (curr_addr >> 21) & 0x1FF;
-                        const size_t pt_index = (curr_addr >> 12) & 0x1FF;
-
-                        /* check if PML4 entry exists */
-                        if (!(kernel_pml4[pml4_index] & x86_64_internal::VMM_PRESENT))
-                            continue; /* already unmapped */
-
-                        /* navigate to page table */
-                        const auto *pdpt = reinterpret_cast<uint64_t *>(
-                            (kernel_pml4[pml4_index] & ~0xFFF) + hhdm_offset);
-                        if (!(pdpt[pdpt_index] & x86_64_internal::VMM_PRESENT))
-                            continue; /* already unmapped */
-
-                        const auto *pd = reinterpret_cast<uint64_t *>((pdpt[pdpt_index] & ~0xFFF) + hhdm_offset);
-                        if (!(pd[pd_index] & x86_64_internal::VMM_PRESENT))
-                            continue; /* already unmapped */
-
-                        auto *pt = reinterpret_cast<uint64_t *>((pd[pd_index] & ~0xFFF) + hhdm_offset);
-
-                        /* clear the page table entry */
-                        pt[pt_index] = 0;
-
-                        /* invalidate TLB entry */
-                        cpu_traits<x86_64>::invlpg(reinterpret_cast<void *>(curr_addr));
-                    }
+        bool run(uint64_t *const *path, size_t first, size_t n, uintptr_t virt_addr)
+        {
+            for (size_t i = first; i < first + n; i++, virt_addr += PAGE_SIZE)
+            {
+                if (!append(virt_addr, PAGE_SIZE, leaf_prot(path[0][i])))
+                    return false;
+            }
+            return true;
+        }
 
-                    /* free the physical pages for this batch */
-                    for (size_t j = batch_start; j < batch_end; j++)
-                    {
-                        if (phys_addrs[j - batch_start])
-                            pmm::pfree(phys_addrs[j - batch_start], 1);
-                    }
-                }
+        bool huge(uint64_t &entry, size_t, uintptr_t virt_addr, size_t len)
+        {
+            return append(virt_addr, len, leaf_prot(entry));
+        }
 
-                /* free the virtual memory region */
-                free_region(virt_addr, pages * PAGE_SIZE);
-                break;
-            }
+        bool hole(uintptr_t virt_addr, size_t len)
+        {
+            return append(virt_addr, len, VmmFlags::NONE);
         }
+    };
+
+    size_t vmm_traits<x86_64>::query_range(uintptr_t virt_addr, size_t size, VmRun *runs, size_t max_runs) noexcept
+    {
+        virt_addr &= ~(PAGE_SIZE - 1);
+        size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+        QueryVisitor visitor{ runs, max_runs };
+        const bool complete = with_depth([&](auto depth) {
+            return walk_range<decltype(depth)::value>(root_for(virt_addr), virt_addr, virt_addr + size, visitor);
+        });
+
+        return complete ? visitor.count : 0;
     }
 
-    uintptr_t vmm_traits<x86_64>::get_pmaddr(uintptr_t virt_addr) noexcept
+    /*
+     * rewrites the access rights of every leaf in a range. write access to a
+     * frame that is still shared, and not through MAP_SHARED, is granted as COW
+     * so the sharers stay isolated. a hole or a partly covered huge leaf marks
+     * the result incomplete; the rest of the range is still updated
+     */
+    struct ProtectVisitor
     {
-        /* calculate indices */
-        const size_t pml4_index = (virt_addr >> 39) & 0x1FF;
-        const size_t pdpt_index = (virt_addr >> 30) & 0x1FF;
-        const size_t pd_index = (virt_addr >> 21) & 0x1FF;
-        const size_t pt_index = (virt_addr >> 12) & 0x1FF;
+        static constexpr size_t FLUSH_THRESHOLD = 32; /* past this many pages a CR3 reload beats invlpg */
+
+        bool write;
+        bool exec;
+        bool complete = true;
+        bool flush_all = false;
+        bool dirty = false; /* something changed; other CPUs must drop it too */
 
-        /* check if PML4 entry exists */
-        if (!(kernel_pml4[pml4_index] & x86_64_internal::VMM_PRESENT))
+        uint64_t protect(uint64_t entry, uintptr_t phys) const
         {
-            return 0; /* not mapped */
+            entry &= ~(x86_64_internal::VMM_WRITABLE | x86_64_internal::VMM_COW | x86_64_internal::VMM_NX);
+            if (!exec)
+                entry |= x86_64_internal::VMM_NX;
+
+            if (write)
+            {
+                const PageFrame *frame = pmm::frame(phys);
+                if ((entry & x86_64_internal::VMM_SHARED) || !frame || frame->refs == 0)
+                    entry |= x86_64_internal::VMM_WRITABLE;
+                else
+                    entry |= x86_64_internal::VMM_COW;
+            }
+            return entry;
         }
 
-        /* navigate through paging structures */
-        const auto *pdpt = reinterpret_cast<uint64_t *>((kernel_pml4[pml4_index] & ~0xFFF) + hhdm_offset);
-        if (!(pdpt[pdpt_index] & x86_64_internal::VMM_PRESENT))
-            return 0; /* not mapped */
+        bool run(uint64_t *const *path, size_t first, size_t n, uintptr_t virt_addr)
+        {
+            size_t changed = 0;
+            bool global = false;
+            for (size_t i = first; i < first + n; i++)
+            {
+                uint64_t &pte = path[0][i];
+                if (!(pte & x86_64_internal::VMM_PRESENT))
+                {
+                    complete = false;
+                    continue;
+                }
 
-        /* check for 1GB page */
-        if (pdpt[pdpt_index] & x86_64_internal::VMM_HUGE)
-            return (pdpt[pdpt_index] & ~0x3FFFFFFF) + (virt_addr & 0x3FFFFFFF);
+                const uint64_t updated = protect(pte, pte & x86_64_internal::VMM_ADDR_MASK);
+                if (updated == pte)
+                    continue;
 
-        const auto *pd = reinterpret_cast<uint64_t *>((pdpt[pdpt_index] & ~0xFFF) + hhdm_offset);
-        if (!(pd[pd_index] & x86_64_internal::VMM_PRESENT))
-            return 0; /* not mapped */
+                pte = updated;
+                global |= (pte & x86_64_internal::VMM_GLOBAL) != 0;
+                changed++;
+            }
 
-        /* check for 2MB page */
-        if (pd[pd_index] & x86_64_internal::VMM_HUGE)
-            return (pd[pd_index] & ~0x1FFFFF) + (virt_addr & 0x1FFFFF);
+            dirty |= changed != 0;
 
-        /* regular 4KB page */
-        const auto *pt = reinterpret_cast<uint64_t *>((pd[pd_index] & ~0xFFF) + hhdm_offset);
-        if (!(pt[pt_index] & x86_64_internal::VMM_PRESENT))
-            return 0; /* not mapped */
+            /* a CR3 reload does not drop global translations */
+            if (changed > FLUSH_THRESHOLD && !global)
+            {
+                flush_all = true;
+            }
+            else if (changed)
+            {
+                for (size_t i = 0; i < n; i++)
+                    cpu_traits<x86_64>::invlpg(reinterpret_cast<void *>(virt_addr + i * PAGE_SIZE));
+            }
+            return true;
+        }
+
+        bool huge(uint64_t &entry, size_t level, uintptr_t virt_addr, size_t len)
+        {
+            if (len != level_span(level))
+            {
+                complete = false; /* huge leaves are not split here */
+                return true;
+            }
 
-        return (pt[pt_index] & ~0xFFF) + (virt_addr & 0xFFF);
+            entry = protect(entry, entry & x86_64_internal::VMM_ADDR_MASK & ~(level_span(level) - 1));
+            cpu_traits<x86_64>::invlpg(reinterpret_cast<void *>(virt_addr));
+            dirty = true;
+            return true;
+        }
+
+        bool hole(uintptr_t, size_t)
+        {
+            complete = false;
+            return true;
+        }
+    };
+
+    bool vmm_traits<x86_64>::mprotect_range(uintptr_t virt_addr, size_t size, VmmFlags prot) noexcept
+    {
+        size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        if ((virt_addr & (PAGE_SIZE - 1)) || virt_addr + size < virt_addr)
+            return false;
+
+        /* PROT_NONE has no page-table encoding here; a present x86 page is always readable */
+        if (!(prot & static_cast<uint64_t>(VmmFlags::PROT_READ | VmmFlags::PROT_WRITE | VmmFlags::PROT_EXEC)))
+            return false;
+
+        ProtectVisitor visitor{ prot & static_cast<uint64_t>(VmmFlags::PROT_WRITE),
+                                prot & static_cast<uint64_t>(VmmFlags::PROT_EXEC) };
+        with_depth([&](auto depth) {
+            return walk_range<decltype(depth)::value>(root_for(virt_addr), virt_addr, virt_addr + size, visitor);
+        });
+
+        if (visitor.flush_all)
+            cpu_traits<x86_64>::write_cr3(cpu_traits<x86_64>::read_cr3());
+        if (visitor.dirty)
+            shootdown(virt_addr, size);
+
+        return visitor.complete;
     }
 
     void vmm_traits<x86_64>::dynamic_mode() noexcept
@@ -370,29 +1134,278 @@ namespace kfk
         region_alloc.use_dynamic();
     }
 
-    uintptr_t vmm_traits<x86_64>::create_ptb() noexcept
+    MemoryRegion vmm_traits<x86_64>::area(KernelArea which) noexcept
+    {
+        return areas[static_cast<size_t>(which)];
+    }
+
+    /*
+     * leaf bits for a user page. MAP_SHARED pages stay writable and shared
+     * across clones; writable MAP_PRIVATE pages are mapped COW so the first
+     * write takes a private copy. with neither, the page is exclusively owned
+     */
+    static uint64_t user_leaf(VmmFlags flags)
     {
-        /* allocate physical memory for new PML4 */
-        const uintptr_t pml4_phys = pmm::pmalloc(1);
-        if (!pml4_phys)
+        const VmmFlags prot = flags & (VmmFlags::PROT_READ | VmmFlags::PROT_WRITE | VmmFlags::PROT_EXEC);
+        uint64_t leaf = vmm_traits<x86_64>::translate_flags(prot | VmmFlags::USER) | x86_64_internal::VMM_PRESENT;
+
+        if (flags & static_cast<uint64_t>(VmmFlags::MAP_SHARED))
+            leaf |= x86_64_internal::VMM_SHARED;
+        else if ((flags & static_cast<uint64_t>(VmmFlags::MAP_PRIVATE)) && (leaf & x86_64_internal::VMM_WRITABLE))
+            leaf = (leaf & ~x86_64_internal::VMM_WRITABLE) | x86_64_internal::VMM_COW; /* copied on first write */
+
+        return leaf;
+    }
+
+    uintptr_t vmm_traits<x86_64>::user_limit() noexcept
+    {
+        return user_top();
+    }
+
+    bool vmm_traits<x86_64>::map_user(uintptr_t ptb_phys, uintptr_t virt_addr, uintptr_t phys_addr,
+                                      VmmFlags flags) noexcept
+    {
+        if ((virt_addr & (PAGE_SIZE - 1)) || virt_addr >= user_top())
+            return false;
+
+        return map_leaf(table_of(ptb_phys), virt_addr, phys_addr | user_leaf(flags));
+    }
+
+    size_t vmm_traits<x86_64>::unmap_user(uintptr_t ptb_phys, uintptr_t virt_addr, size_t size) noexcept
+    {
+        size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        if ((virt_addr & (PAGE_SIZE - 1)) || virt_addr >= user_top() || size > user_top() - virt_addr)
             return 0;
 
-        auto *new_pml4 = reinterpret_cast<uint64_t *>(pml4_phys + hhdm_offset);
+        return unmap_range(table_of(ptb_phys), virt_addr, size);
+    }
+
+    uintptr_t vmm_traits<x86_64>::create_ptb() noexcept
+    {
+        /* allocate physical memory for the new top-level table */
+        const uintptr_t root_phys = ptb_alloc(); /* pre-zeroed */
+        if (!root_phys)
+            return 0;
 
-        /* clear the table */
-        memset(new_pml4, 0, PAGE_SIZE);
+        auto *new_root = reinterpret_cast<uint64_t *>(root_phys + hhdm_offset);
 
         /* copy kernel entries (typically higher half) */
         /* for x86_64, kernel space usually starts at entry 256 */
-        /* NOTE: add ASLR here */
+        /* the randomized kernel areas already own populated slots up here; see `layout_init` */
         for (size_t i = 256; i < PAGE_TABLE_ENTRIES; i++)
-            new_pml4[i] = kernel_pml4[i];
+            new_root[i] = kernel_root[i];
+
+        return root_phys;
+    }
+
+    /*
+     * drop a user paging structure; leaves lose one reference and tables are
+     * freed. `user_leaf` never builds huge leaves and frames are counted per
+     * 4KB page, so a huge one here is not ours to count: it is just unlinked
+     */
+    static void release_table(uint64_t *table, size_t level)
+    {
+        for (size_t i = 0; i < PAGE_TABLE_ENTRIES; i++)
+        {
+            const uint64_t entry = table[i];
+            if (!(entry & x86_64_internal::VMM_PRESENT))
+                continue;
+
+            if (level == 1)
+                pmm::pput(entry & x86_64_internal::VMM_ADDR_MASK);
+            else if (!(entry & x86_64_internal::VMM_HUGE))
+                release_table(table_of(entry), level - 1);
+
+            table[i] = 0; /* the pool wants tables back zeroed */
+        }
+
+        ptb_free(reinterpret_cast<uintptr_t>(table) - hhdm_offset);
+    }
+
+    /*
+     * duplicate a user paging structure. only the tables are copied; every leaf
+     * is shared by both sides, write-protected and tagged COW so the first write
+     * from either side copies just that page. see `handle_fault`
+     */
+    static uintptr_t clone_table(uint64_t *src, size_t level)
+    {
+        const uintptr_t dst_phys = ptb_alloc(); /* pre-zeroed */
+        if (!dst_phys)
+            return 0;
+
+        auto *dst = reinterpret_cast<uint64_t *>(dst_phys + hhdm_offset);
+        for (size_t i = 0; i < PAGE_TABLE_ENTRIES; i++)
+        {
+            uint64_t &entry = src[i];
+            if (!(entry & x86_64_internal::VMM_PRESENT))
+                continue;
+
+            /* user space only holds 4KB leaves; a huge one could be neither counted nor split on a COW fault */
+            if (entry & x86_64_internal::VMM_HUGE)
+            {
+                release_table(dst, level);
+                return 0;
+            }
+
+            if (level == 1)
+            {
+                if ((entry & x86_64_internal::VMM_WRITABLE) && !(entry & x86_64_internal::VMM_SHARED))
+                    entry = (entry & ~x86_64_internal::VMM_WRITABLE) | x86_64_internal::VMM_COW;
+
+                pmm::pget(entry & x86_64_internal::VMM_ADDR_MASK);
+                dst[i] = entry;
+                live_inc(dst);
+                continue;
+            }
+
+            const uintptr_t child = clone_table(table_of(entry), level - 1);
+            if (!child)
+            {
+                release_table(dst, level); /* out of memory; undo the partial copy */
+                return 0;
+            }
 
-        return pml4_phys;
+            dst[i] = child | (entry & ~x86_64_internal::VMM_ADDR_MASK);
+            live_inc(dst);
+        }
+
+        return dst_phys;
+    }
+
+    uintptr_t vmm_traits<x86_64>::clone_ptb(uintptr_t ptb_phys) noexcept
+    {
+        const size_t below = paging_levels - 1; /* depth of the tables hanging off the top level */
+        auto *src = reinterpret_cast<uint64_t *>((ptb_phys & x86_64_internal::VMM_ADDR_MASK) + hhdm_offset);
+
+        const uintptr_t root_phys = ptb_alloc();
+        if (!root_phys)
+            return 0;
+
+        auto *new_root = reinterpret_cast<uint64_t *>(root_phys + hhdm_offset);
+
+        /* kernel half is shared as-is just like `create_ptb` */
+        for (size_t i = USER_ENTRIES; i < PAGE_TABLE_ENTRIES; i++)
+            new_root[i] = kernel_root[i];
+
+        for (size_t i = 0; i < USER_ENTRIES; i++)
+        {
+            if (!(src[i] & x86_64_internal::VMM_PRESENT))
+                continue;
+
+            const uintptr_t child = clone_table(table_of(src[i]), below);
+            if (!child)
+            {
+                /* out of memory; the source stays valid since COW entries resolve on their own */
+                for (size_t j = 0; j < PAGE_TABLE_ENTRIES; j++)
+                {
+                    if (j < i && (new_root[j] & x86_64_internal::VMM_PRESENT))
+                        release_table(table_of(new_root[j]), below);
+                    new_root[j] = 0;
+                }
+                ptb_free(root_phys);
+                return 0;
+            }
+
+            new_root[i] = child | (src[i] & ~x86_64_internal::VMM_ADDR_MASK);
+        }
+
+        /* source leaves were write-protected; drop stale writable translations if it is live */
+        const uint64_t cr3 = cpu_traits<x86_64>::read_cr3();
+        if ((cr3 & x86_64_internal::VMM_ADDR_MASK) == (ptb_phys & x86_64_internal::VMM_ADDR_MASK))
+            cpu_traits<x86_64>::write_cr3(cr3);
+        shootdown(0, user_top()); /* it may be loaded on other CPUs too */
+
+        return root_phys;
+    }
+
+    void vmm_traits<x86_64>::destroy_ptb(uintptr_t ptb_phys) noexcept
+    {
+        auto *root = table_of(ptb_phys);
+        const size_t below = paging_levels - 1; /* depth of the tables hanging off the top level */
+
+        /* only tables that exist are visited, so this is linear in what was mapped */
+        for (size_t i = 0; i < USER_ENTRIES; i++)
+        {
+            if (root[i] & x86_64_internal::VMM_PRESENT)
+                release_table(table_of(root[i]), below);
+            root[i] = 0;
+        }
+
+        /* the kernel half is borrowed from `kernel_root`; just forget it */
+        for (size_t i = USER_ENTRIES; i < PAGE_TABLE_ENTRIES; i++)
+            root[i] = 0;
+
+        ptb_free(ptb_phys & x86_64_internal::VMM_ADDR_MASK);
     }
 
     void vmm_traits<x86_64>::switch_ptb(uintptr_t ptb_phys) noexcept
     {
         cpu_traits<x86_64>::write_cr3(ptb_phys);
     }
+
+    void vmm_traits<x86_64>::flush_pending() noexcept
+    {
+        const uint64_t self = 1ULL << cpu_traits<x86_64>::id();
+        if (!(shootdown_pending.load(MemoryOrder::ACQUIRE) & self))
+            return;
+
+        /* the initiator waits for our bit, so the range stays put until we clear it */
+        flush_local(shootdown_start, shootdown_size);
+        shootdown_pending.fetch_and(~self, MemoryOrder::RELEASE);
+    }
+
+    bool vmm_traits<x86_64>::handle_fault(uintptr_t fault_addr, uint64_t error) noexcept
+    {
+        /* copy-on-write only ever shows up as a write to a present page */
+        if ((error & (x86_64_internal::PF_PRESENT | x86_64_internal::PF_WRITE)) !=
+            (x86_64_internal::PF_PRESENT | x86_64_internal::PF_WRITE))
+            return false;
+
+        /* walk the live address space rather than the kernel one */
+        uint64_t *path[x86_64_internal::MAX_PAGING_LEVELS];
+        uint64_t *pt = with_depth([&](auto depth) {
+            return walk<decltype(depth)::value>(current_root(), fault_addr, path, LookupVisitor());
+        });
+        if (!pt)
+            return false; /* huge COW leaves are not split here */
+
+        uint64_t &pte = pt[table_index(fault_addr, 1)];
+        if (!(pte & x86_64_internal::VMM_COW))
+        {
+            /* another CPU resolved it while we waited for the space lock; the fault dropped our stale translation */
+            return (pte & x86_64_internal::VMM_WRITABLE) &&
+                   (!(error & x86_64_internal::PF_USER) || (pte & x86_64_internal::VMM_USER));
+        }
+
+        const uintptr_t old_phys = pte & x86_64_internal::VMM_ADDR_MASK;
+        const uint64_t flags = (pte & ~(x86_64_internal::VMM_ADDR_MASK | x86_64_internal::VMM_COW)) |
+                               x86_64_internal::VMM_WRITABLE;
+
+        const PageFrame *frame = pmm::frame(old_phys);
+        if (frame && frame->refs == 0)
+        {
+            /* every other sharer is gone; take the frame over without copying */
+            pte = old_phys | flags;
+        }
+        else
+        {
+            const uintptr_t new_phys = pmm::pmalloc(1);
+            if (!new_phys)
+                return false;
+
+            simd_traits<x86_64>::copy_pages(reinterpret_cast<void *>(new_phys + hhdm_offset),
+                                            reinterpret_cast<void *>(old_phys + hhdm_offset), 1);
+
+            pte = new_phys | flags;
+            cpu_traits<x86_64>::invlpg(reinterpret_cast<void *>(fault_addr & ~(PAGE_SIZE - 1)));
+
+            /* other CPUs running this space may still read the old frame */
+            shootdown(fault_addr & ~(PAGE_SIZE - 1), PAGE_SIZE);
+            pmm::pput(old_phys);
+            return true;
+        }
+
+        cpu_traits<x86_64>::invlpg(reinterpret_cast<void *>(fault_addr & ~(PAGE_SIZE - 1)));
+        return true;
+    }
 }
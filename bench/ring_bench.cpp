@@ -0,0 +1,224 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+/*
+ * hosted stress test and throughput benchmark for include/ring.hpp; runs under
+ * Linux with pthreads, see `make bench`. MPMC: 4 producers and 4 consumers,
+ * checking that every item arrives exactly once (count and sum) and that each
+ * consumer sees any one producer's items in the order they were pushed.
+ * SPSC: 1 producer and 1 consumer, checking that the sequence arrives intact.
+ * exits non-zero if any check failed
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <ring.hpp>
+
+namespace
+{
+    constexpr size_t RING_SIZE = 1024;
+    constexpr uint64_t MPMC_ITEMS = 2000000; /* per producer */
+    constexpr uint64_t SPSC_ITEMS = 20000000;
+    constexpr uint32_t PRODUCERS = 4;
+    constexpr uint32_t CONSUMERS = 4;
+
+    /* item layout: producer in the top 16 bits, its sequence number in the rest */
+    constexpr uint64_t SEQ_BITS = 48;
+    constexpr uint64_t SEQ_MASK = (1ULL << SEQ_BITS) - 1;
+
+    kfk::MpmcRing<uint64_t, RING_SIZE> mpmc;
+    kfk::SpscRing<uint64_t, RING_SIZE> spsc;
+
+    kfk::Atomic<uint64_t> mpmc_popped(0);
+    kfk::Atomic<uint32_t> failures(0);
+
+    struct ConsumerResult
+    {
+        uint64_t count;
+        uint64_t sum;
+    };
+
+    /* spin a little, then give the CPU up; with more threads than cores the other side must get to run */
+    void backoff(uint32_t& spins)
+    {
+        if (++spins < 64)
+        {
+            kfk::cpu_relax();
+            return;
+        }
+
+        spins = 0;
+        sched_yield();
+    }
+
+    double now()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
+    void fail(const char* what, uint64_t got, uint64_t expected)
+    {
+        if (failures.fetch_add(1) < 8)
+            fprintf(stderr, "FAIL: %s: got %llu, expected %llu\n", what, static_cast<unsigned long long>(got),
+                    static_cast<unsigned long long>(expected));
+    }
+
+    void* mpmc_producer(void* arg)
+    {
+        const uint64_t id = reinterpret_cast<uintptr_t>(arg);
+        for (uint64_t seq = 1; seq <= MPMC_ITEMS; seq++)
+        {
+            const uint64_t item = (id << SEQ_BITS) | seq;
+            uint32_t spins = 0;
+            while (!mpmc.try_push(item))
+                backoff(spins);
+        }
+        return nullptr;
+    }
+
+    void* mpmc_consumer(void* arg)
+    {
+        auto* result = static_cast<ConsumerResult*>(arg);
+        uint64_t last[PRODUCERS] = {};
+        uint32_t spins = 0;
+
+        while (mpmc_popped.load(kfk::MemoryOrder::RELAXED) < PRODUCERS * MPMC_ITEMS)
+        {
+            uint64_t item;
+            if (!mpmc.try_pop(item))
+            {
+                backoff(spins);
+                continue;
+            }
+            mpmc_popped.fetch_add(1, kfk::MemoryOrder::RELAXED);
+
+            const uint64_t producer = item >> SEQ_BITS;
+            const uint64_t seq = item & SEQ_MASK;
+            if (producer >= PRODUCERS)
+            {
+                fail("mpmc producer id", producer, PRODUCERS - 1);
+                continue;
+            }
+
+            /* one producer's pushes are ordered, so any one consumer sees them increasing */
+            if (seq <= last[producer])
+                fail("mpmc per-producer order", seq, last[producer] + 1);
+            last[producer] = seq;
+
+            result->count++;
+            result->sum += seq;
+        }
+        return nullptr;
+    }
+
+    void* spsc_producer(void*)
+    {
+        for (uint64_t i = 0; i < SPSC_ITEMS; i++)
+        {
+            uint32_t spins = 0;
+            while (!spsc.try_push(i))
+                backoff(spins);
+        }
+        return nullptr;
+    }
+
+    void* spsc_consumer(void* arg)
+    {
+        auto* result = static_cast<ConsumerResult*>(arg);
+        uint32_t spins = 0;
+        for (uint64_t expected = 0; expected < SPSC_ITEMS; )
+        {
+            uint64_t item;
+            if (!spsc.try_pop(item))
+            {
+                backoff(spins);
+                continue;
+            }
+
+            if (item != expected)
+                fail("spsc order", item, expected);
+            result->count++;
+            result->sum += item;
+            expected++;
+        }
+        return nullptr;
+    }
+
+    void run_mpmc()
+    {
+        pthread_t producers[PRODUCERS];
+        pthread_t consumers[CONSUMERS];
+        ConsumerResult results[CONSUMERS] = {};
+
+        const double start = now();
+        for (uint32_t i = 0; i < CONSUMERS; i++)
+            pthread_create(&consumers[i], nullptr, mpmc_consumer, &results[i]);
+        for (uint32_t i = 0; i < PRODUCERS; i++)
+            pthread_create(&producers[i], nullptr, mpmc_producer, reinterpret_cast<void*>(static_cast<uintptr_t>(i)));
+
+        for (pthread_t thread : producers)
+            pthread_join(thread, nullptr);
+        for (pthread_t thread : consumers)
+            pthread_join(thread, nullptr);
+        const double elapsed = now() - start;
+
+        uint64_t count = 0;
+        uint64_t sum = 0;
+        for (const ConsumerResult& result : results)
+        {
+            count += result.count;
+            sum += result.sum;
+        }
+
+        const uint64_t total = PRODUCERS * MPMC_ITEMS;
+        if (count != total)
+            fail("mpmc item count", count, total);
+        if (sum != PRODUCERS * (MPMC_ITEMS * (MPMC_ITEMS + 1) / 2))
+            fail("mpmc item sum", sum, PRODUCERS * (MPMC_ITEMS * (MPMC_ITEMS + 1) / 2));
+
+        printf("mpmc %ux%u: %llu items in %.3f s, %.1f Mops/s\n", PRODUCERS, CONSUMERS,
+               static_cast<unsigned long long>(count), elapsed, count / elapsed / 1e6);
+    }
+
+    void run_spsc()
+    {
+        pthread_t producer;
+        pthread_t consumer;
+        ConsumerResult result = {};
+
+        const double start = now();
+        pthread_create(&consumer, nullptr, spsc_consumer, &result);
+        pthread_create(&producer, nullptr, spsc_producer, nullptr);
+        pthread_join(producer, nullptr);
+        pthread_join(consumer, nullptr);
+        const double elapsed = now() - start;
+
+        if (result.count != SPSC_ITEMS)
+            fail("spsc item count", result.count, SPSC_ITEMS);
+        if (result.sum != SPSC_ITEMS * (SPSC_ITEMS - 1) / 2)
+            fail("spsc item sum", result.sum, SPSC_ITEMS * (SPSC_ITEMS - 1) / 2);
+
+        printf("spsc 1x1: %llu items in %.3f s, %.1f Mops/s\n", static_cast<unsigned long long>(result.count),
+               elapsed, result.count / elapsed / 1e6);
+    }
+}
+
+int main()
+{
+    run_mpmc();
+    run_spsc();
+
+    const uint32_t failed = failures.load();
+    if (failed)
+    {
+        fprintf(stderr, "%u check(s) failed\n", failed);
+        return 1;
+    }
+
+    printf("all checks passed\n");
+    return 0;
+}
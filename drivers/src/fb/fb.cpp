@@ -8,6 +8,7 @@ namespace kfk
     namespace g
     {
         const limine_framebuffer* fb = nullptr;
+		void* base = nullptr; /* where we draw; starts as the bootloader mapping */
 		auto init = false;
     }
 
@@ -17,9 +18,18 @@ namespace kfk
             return;
 
         g::fb = fb;
+        g::base = fb->address;
         g::init = true;
     }
 
+    void Fb::remap(void* address) noexcept
+    {
+        if (!g::init || !address)
+            return;
+
+        g::base = address;
+    }
+
     Fb::FBInfo Fb::fbinfo() noexcept
     {
         if (!g::init)
@@ -48,7 +58,7 @@ namespace kfk
 			return;
 
 		const uint32_t ppr = g::fb->pitch / bpp; /* pixels per row */
-		uint32_t* p = static_cast<uint32_t*>(g::fb->address) + y * ppr + x;
+		uint32_t* p = static_cast<uint32_t*>(g::base) + y * ppr + x;
 		*p = color;
     }
 
@@ -82,7 +92,7 @@ namespace kfk
 			return;
 
 		const uint32_t ppr = g::fb->pitch / bpp;
-		uint32_t* pixel = static_cast<uint32_t*>(g::fb->address) + y * ppr + x1;
+		uint32_t* pixel = static_cast<uint32_t*>(g::base) + y * ppr + x1;
 		for (int x = x1; x <= x2; x++)
 			*pixel++ = color;
     }
@@ -117,7 +127,7 @@ namespace kfk
 		const uint32_t ppr = g::fb->pitch / bpp;
 		for (int y = y1; y <= y2; y++)
 		{
-			uint32_t* pixel = static_cast<uint32_t*>(g::fb->address) + y * ppr + x;
+			uint32_t* pixel = static_cast<uint32_t*>(g::base) + y * ppr + x;
 			*pixel = color;
 		}
     }
@@ -166,7 +176,7 @@ namespace kfk
 			return;
 
 		const uint32_t ppr = g::fb->pitch / bpp;
-		uint32_t* base = static_cast<uint32_t*>(g::fb->address) + y * ppr + x;
+		uint32_t* base = static_cast<uint32_t*>(g::base) + y * ppr + x;
 
 		for (uint32_t row = 0; row < height; ++row)
 		{
@@ -200,7 +210,7 @@ namespace kfk
 			return;
 
 		const uint32_t ppr = g::fb->pitch / bpp;
-		auto* fb_start = static_cast<uint32_t*>(g::fb->address);
+		auto* fb_start = static_cast<uint32_t*>(g::base);
 		const uint32_t total_pixels = g::fb->height * ppr;
 		uint32_t i = 0;
 		for (; i + 15 < total_pixels; i += 16)
@@ -238,7 +248,7 @@ namespace kfk
 		const uint32_t bpp = g::fb->bpp / 8;
 		const uint32_t ppr = g::fb->pitch / bpp;
 
-		uint32_t* base_addr = static_cast<uint32_t*>(g::fb->address) + y * ppr + x;
+		uint32_t* base_addr = static_cast<uint32_t*>(g::base) + y * ppr + x;
 		for (auto row = 0; row < FONT_CHAR_HEIGHT; row++)
 		{
 			if (y + row >= static_cast<int>(g::fb->height))
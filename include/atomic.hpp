@@ -2,6 +2,9 @@
 
 #pragma once
 
+#include <stdint.h>
+#include <kafka/hal/interrupt.hpp>
+
 #ifndef __has_builtin
     #define __has_builtin(x) 0
 #endif
@@ -21,22 +24,45 @@
 #else
 #	define ATOMIC_BUILTIN(name) __atomic_##name##_n
 #endif
+#if __has_builtin(__c11_atomic_fetch_add)
+#	define ATOMIC_FETCH_BUILTIN(name) __c11_atomic_fetch_##name
+#else
+#	define ATOMIC_FETCH_BUILTIN(name) __atomic_fetch_##name
+#endif
 
 namespace kfk
 {
-    /* C++11 memory orders; we need only a subset of them */
+    /* C++11 memory orders; consume is left out since compilers promote it to acquire anyway */
     enum class MemoryOrder 
     {
+        RELAXED = __ATOMIC_RELAXED, /* atomicity only; no ordering of surrounding accesses */
         ACQUIRE = __ATOMIC_ACQUIRE, /* acquire order */
         RELEASE = __ATOMIC_RELEASE, /* release order */
+        ACQ_REL = __ATOMIC_ACQ_REL, /* acquire and release; for read-modify-write operations */
         SEQCST = __ATOMIC_SEQ_CST /* sequentially consistent memory ordering; also the default if unspecified  */
     };
 
+    /* strongest order allowed for the load of a failed compare-exchange, which never stores */
+    constexpr MemoryOrder failure_order(MemoryOrder order)
+    {
+        switch (order)
+        {
+        case MemoryOrder::RELEASE:
+            return MemoryOrder::RELAXED;
+        case MemoryOrder::ACQ_REL:
+            return MemoryOrder::ACQUIRE;
+        default:
+            return order;
+        }
+    }
+
     /* the atomic class; a subset of `std::atomic` */
     template<typename T>
     class Atomic
     {
     public:
+        constexpr Atomic() : value() {} /* zero */
+
         constexpr explicit Atomic(T init) : value(init) {}
 
         /* atomically load with the specified memory order */
@@ -55,17 +81,390 @@ namespace kfk
             return ATOMIC_BUILTIN(exchange)(&value, v, static_cast<int>(order));
         }
 
-        bool compare_exchange(T& expected, T desired, MemoryOrder order = MemoryOrder::SEQCST)
+        /* fetch_* return the previous value; integral `T` only */
+        T fetch_add(T v, MemoryOrder order = MemoryOrder::SEQCST)
+        {
+            return ATOMIC_FETCH_BUILTIN(add)(&value, v, static_cast<int>(order));
+        }
+
+        T fetch_sub(T v, MemoryOrder order = MemoryOrder::SEQCST)
+        {
+            return ATOMIC_FETCH_BUILTIN(sub)(&value, v, static_cast<int>(order));
+        }
+
+        T fetch_and(T v, MemoryOrder order = MemoryOrder::SEQCST)
+        {
+            return ATOMIC_FETCH_BUILTIN(and)(&value, v, static_cast<int>(order));
+        }
+
+        T fetch_or(T v, MemoryOrder order = MemoryOrder::SEQCST)
+        {
+            return ATOMIC_FETCH_BUILTIN(or)(&value, v, static_cast<int>(order));
+        }
+
+        T fetch_xor(T v, MemoryOrder order = MemoryOrder::SEQCST)
+        {
+            return ATOMIC_FETCH_BUILTIN(xor)(&value, v, static_cast<int>(order));
+        }
+
+        /* on failure `expected` is updated with the current value */
+        bool compare_exchange_strong(T& expected, T desired, MemoryOrder success, MemoryOrder failure)
         {
 #if __has_builtin(__c11_atomic_compare_exchange_strong)
-            return __c11_atomic_compare_exchange_strong(&value, &expected, desired, static_cast<int>(order), static_cast<int>(order));
+            return __c11_atomic_compare_exchange_strong(&value, &expected, desired, static_cast<int>(success), static_cast<int>(failure));
 #else
-            return __atomic_compare_exchange_n(&value, &expected, desired, true, static_cast<int>(order), static_cast<int>(order));
+            return __atomic_compare_exchange_n(&value, &expected, desired, false, static_cast<int>(success), static_cast<int>(failure));
 #endif
         }
 
+        /* may fail spuriously; cheaper where the caller retries in a loop anyway */
+        bool compare_exchange_weak(T& expected, T desired, MemoryOrder success, MemoryOrder failure)
+        {
+#if __has_builtin(__c11_atomic_compare_exchange_weak)
+            return __c11_atomic_compare_exchange_weak(&value, &expected, desired, static_cast<int>(success), static_cast<int>(failure));
+#else
+            return __atomic_compare_exchange_n(&value, &expected, desired, true, static_cast<int>(success), static_cast<int>(failure));
+#endif
+        }
+
+        bool compare_exchange_strong(T& expected, T desired, MemoryOrder order = MemoryOrder::SEQCST)
+        {
+            return compare_exchange_strong(expected, desired, order, failure_order(order));
+        }
+
+        bool compare_exchange_weak(T& expected, T desired, MemoryOrder order = MemoryOrder::SEQCST)
+        {
+            return compare_exchange_weak(expected, desired, order, failure_order(order));
+        }
+
+        bool compare_exchange(T& expected, T desired, MemoryOrder order = MemoryOrder::SEQCST)
+        {
+            return compare_exchange_strong(expected, desired, order);
+        }
+
     private:
         _Atomic(T) value;
 
     };
+
+#if defined(__x86_64__)
+    /*
+     * 128-bit atomic built on `lock cmpxchg16b`, typically a pointer paired with
+     * a generation count so that lock-free lists are immune to ABA. compilers
+     * only inline 16-byte atomics with -mcx16 and fall back to libatomic
+     * otherwise, hence the asm. every operation is a locked instruction and
+     * thus sequentially consistent; the order arguments exist for symmetry
+     */
+    template<>
+    class Atomic<unsigned __int128>
+    {
+    public:
+        using T = unsigned __int128;
+
+        constexpr explicit Atomic(T init) : value(init) {}
+
+        /* cmpxchg16b always writes, so even a load needs the line exclusive */
+        T load(MemoryOrder = MemoryOrder::SEQCST)
+        {
+            T current = 0;
+            cmpxchg(current, 0);
+            return current;
+        }
+
+        void store(T v, MemoryOrder order = MemoryOrder::SEQCST)
+        {
+            exchange(v, order);
+        }
+
+        T exchange(T v, MemoryOrder = MemoryOrder::SEQCST)
+        {
+            T current = value; /* a torn read only costs one extra round */
+            while (!cmpxchg(current, v))
+                ;
+            return current;
+        }
+
+        bool compare_exchange_strong(T& expected, T desired, MemoryOrder = MemoryOrder::SEQCST,
+                                     MemoryOrder = MemoryOrder::SEQCST)
+        {
+            return cmpxchg(expected, desired);
+        }
+
+        bool compare_exchange_weak(T& expected, T desired, MemoryOrder = MemoryOrder::SEQCST,
+                                   MemoryOrder = MemoryOrder::SEQCST)
+        {
+            return cmpxchg(expected, desired);
+        }
+
+        bool compare_exchange(T& expected, T desired, MemoryOrder = MemoryOrder::SEQCST)
+        {
+            return cmpxchg(expected, desired);
+        }
+
+    private:
+        alignas(16) T value; /* cmpxchg16b faults on a misaligned operand */
+
+        bool cmpxchg(T& expected, T desired)
+        {
+            uint64_t lo = static_cast<uint64_t>(expected);
+            uint64_t hi = static_cast<uint64_t>(expected >> 64);
+            bool ok;
+
+            asm volatile("lock cmpxchg16b %[value]"
+                         : [value] "+m"(value), "+a"(lo), "+d"(hi), "=@ccz"(ok)
+                         : "b"(static_cast<uint64_t>(desired)), "c"(static_cast<uint64_t>(desired >> 64))
+                         : "memory");
+
+            expected = (static_cast<T>(hi) << 64) | lo;
+            return ok;
+        }
+    };
+#endif
+
+    /*
+     * spin-wait hint. `cpu::pause` cannot be used from here: arch code includes
+     * this header before its `cpu_traits` specialization is visible
+     */
+    inline void cpu_relax() noexcept
+    {
+#if defined(__x86_64__)
+        asm volatile("pause" : : : "memory");
+#elif defined(__aarch64__)
+        asm volatile("yield" : : : "memory");
+#endif
+    }
+
+    /*
+     * test-and-test-and-set spinlock. waiters spin on a plain load, which stays
+     * in their own cache, and back off exponentially with `pause`; only when the
+     * lock looks free do they retry the bus-locking exchange
+     */
+    class Spinlock
+    {
+    public:
+        constexpr Spinlock() : locked(false) {}
+
+        void lock() noexcept
+        {
+            while (locked.exchange(true, MemoryOrder::ACQUIRE))
+            {
+                unsigned int backoff = 1;
+                while (locked.load(MemoryOrder::ACQUIRE))
+                {
+                    for (unsigned int i = 0; i < backoff; i++)
+                        cpu_relax();
+
+                    if (backoff < MAX_BACKOFF)
+                        backoff <<= 1;
+                }
+            }
+        }
+
+        bool try_lock() noexcept
+        {
+            return !locked.load(MemoryOrder::ACQUIRE) && !locked.exchange(true, MemoryOrder::ACQUIRE);
+        }
+
+        void unlock() noexcept
+        {
+            locked.store(false, MemoryOrder::RELEASE);
+        }
+
+    private:
+        static constexpr unsigned int MAX_BACKOFF = 1024; /* in `pause`s */
+
+        Atomic<bool> locked;
+    };
+
+    /* FIFO-fair spinlock; each waiter backs off in proportion to its place in the queue */
+    class TicketLock
+    {
+    public:
+        constexpr TicketLock() : next(0), serving(0) {}
+
+        void lock() noexcept
+        {
+            const uint32_t ticket = next.fetch_add(1, MemoryOrder::RELAXED);
+            for (;;)
+            {
+                const uint32_t current = serving.load(MemoryOrder::ACQUIRE);
+                if (current == ticket)
+                    return;
+
+                for (uint32_t i = 0; i < (ticket - current) * BACKOFF_PER_WAITER; i++)
+                    cpu_relax();
+            }
+        }
+
+        bool try_lock() noexcept
+        {
+            uint32_t ticket = serving.load(MemoryOrder::ACQUIRE);
+            return next.compare_exchange(ticket, ticket + 1, MemoryOrder::ACQUIRE);
+        }
+
+        void unlock() noexcept
+        {
+            /* only the holder ever writes `serving` */
+            serving.store(serving.load(MemoryOrder::RELAXED) + 1, MemoryOrder::RELEASE);
+        }
+
+    private:
+        static constexpr uint32_t BACKOFF_PER_WAITER = 64; /* in `pause`s */
+
+        Atomic<uint32_t> next;
+        Atomic<uint32_t> serving;
+    };
+
+    /* MCS queue entry; must stay alive, usually on the caller's stack, from lock until unlock */
+    struct McsNode
+    {
+        constexpr McsNode() : next(nullptr), locked(false) {}
+
+        Atomic<McsNode*> next;
+        Atomic<bool> locked;
+        uint64_t irq_state = 0; /* used by `IrqMcsLock` */
+    };
+
+    /*
+     * MCS queue lock for contended paths. waiters form a queue and each spins on
+     * its own node, so a release touches exactly one remote cache line no matter
+     * how many CPUs are waiting
+     */
+    class McsLock
+    {
+    public:
+        constexpr McsLock() : tail(nullptr) {}
+
+        void lock(McsNode& node) noexcept
+        {
+            node.next.store(nullptr, MemoryOrder::RELEASE);
+            node.locked.store(true, MemoryOrder::RELEASE);
+
+            McsNode* prev = tail.exchange(&node);
+            if (!prev)
+                return; /* uncontended */
+
+            prev->next.store(&node, MemoryOrder::RELEASE);
+            while (node.locked.load(MemoryOrder::ACQUIRE))
+                cpu_relax();
+        }
+
+        bool try_lock(McsNode& node) noexcept
+        {
+            node.next.store(nullptr, MemoryOrder::RELEASE);
+            node.locked.store(true, MemoryOrder::RELEASE);
+
+            McsNode* expected = nullptr;
+            return tail.compare_exchange(expected, &node, MemoryOrder::ACQUIRE);
+        }
+
+        void unlock(McsNode& node) noexcept
+        {
+            McsNode* next = node.next.load(MemoryOrder::ACQUIRE);
+            if (!next)
+            {
+                /* nobody queued behind us yet; try to leave the lock empty */
+                McsNode* expected = &node;
+                if (tail.compare_exchange(expected, nullptr))
+                    return;
+
+                /* someone swapped the tail but has not linked in yet */
+                while (!(next = node.next.load(MemoryOrder::ACQUIRE)))
+                    cpu_relax();
+            }
+
+            next->locked.store(false, MemoryOrder::RELEASE);
+        }
+
+    private:
+        Atomic<McsNode*> tail;
+    };
+
+    /*
+     * `Lock` held with local interrupts off, for data that interrupt handlers
+     * take too. `Int` is a parameter only so that it is looked up at use
+     */
+    template<typename Lock, typename Int = interrupt>
+    class IrqSave
+    {
+    public:
+        void lock() noexcept
+        {
+            const uint64_t state = Int::save();
+            inner.lock();
+            irq_state = state;
+        }
+
+        bool try_lock() noexcept
+        {
+            const uint64_t state = Int::save();
+            if (!inner.try_lock())
+            {
+                Int::restore(state);
+                return false;
+            }
+
+            irq_state = state;
+            return true;
+        }
+
+        void unlock() noexcept
+        {
+            const uint64_t state = irq_state;
+            inner.unlock();
+            Int::restore(state);
+        }
+
+    private:
+        Lock inner;
+        uint64_t irq_state = 0; /* only touched by the holder */
+    };
+
+    using IrqSpinlock = IrqSave<Spinlock>;
+    using IrqTicketLock = IrqSave<TicketLock>;
+
+    template<typename Int = interrupt>
+    class IrqMcsLockT
+    {
+    public:
+        void lock(McsNode& node) noexcept
+        {
+            node.irq_state = Int::save();
+            inner.lock(node);
+        }
+
+        void unlock(McsNode& node) noexcept
+        {
+            const uint64_t state = node.irq_state;
+            inner.unlock(node);
+            Int::restore(state);
+        }
+
+    private:
+        McsLock inner;
+    };
+
+    using IrqMcsLock = IrqMcsLockT<>;
+
+    /* holds a lock for the rest of the scope */
+    template<typename Lock>
+    class LockGuard
+    {
+    public:
+        explicit LockGuard(Lock& lock) noexcept : held(lock)
+        {
+            held.lock();
+        }
+
+        ~LockGuard()
+        {
+            held.unlock();
+        }
+
+        LockGuard(const LockGuard&) = delete;
+        LockGuard& operator=(const LockGuard&) = delete;
+
+    private:
+        Lock& held;
+    };
 }
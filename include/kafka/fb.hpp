@@ -42,6 +42,9 @@ namespace kfk
         /* init the fb renderer */
 		static void init(limine_framebuffer* fb) noexcept;
 
+		/* draw through another mapping of the same framebuffer, e.g. a write-combining one */
+		static void remap(void* address) noexcept;
+
 		/* get information about the framebuffer */
 		static FBInfo fbinfo() noexcept;
 
@@ -2,12 +2,16 @@
 
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 #include <limine.h>
 #include <kafka/types.hpp>
 
 namespace kfk
 {
+    /* upper bound for per-CPU arrays; CPUs past it are left parked by the bootloader */
+    static constexpr size_t MAX_CPUS = 64;
+
     /* please do not call this */
     template<typename Arch>
     class cpu_traits
@@ -16,10 +20,47 @@ namespace kfk
         /* initialize CPU, add */
         static void init(uint64_t offset) noexcept;
 
+        /* boot the other CPUs; each runs `entry` once it is set up, or parks if it is nullptr */
+        static void smp_init(volatile limine_smp_request* request, void (*entry)() = nullptr) noexcept;
+
+        /* index of the calling CPU; dense, the BSP is 0 */
+        static uint32_t id() noexcept;
+
+        /* CPUs brought up so far; ids below this are valid */
+        static uint32_t count() noexcept;
+
+        /* stack the calling CPU enters the kernel on from user mode; the scheduler points it at the running thread's */
+        static void set_kernel_stack(uintptr_t top) noexcept;
+
+        /*
+         * drop the calling thread to user mode at `entry` on `stack_top`, with
+         * `arg` as the first argument. it only comes back through syscalls and
+         * traps. without `interrupts` user mode runs with them masked, so
+         * nothing preempts it until a call that may block turns them on
+         */
+        [[noreturn]] static void enter_user(uintptr_t entry, uintptr_t stack_top, uintptr_t arg,
+                                            bool interrupts = true) noexcept;
+
         /* CPU utils */
         [[noreturn]] static void halt() noexcept;
 
         static void pause() noexcept;
+
+        /* enable interrupts and sleep until one arrives; returns with interrupts disabled again */
+        static void idle() noexcept;
+
+        /*
+         * kernel thread contexts. `init_context` lays out a fresh stack so the
+         * first switch to it calls `entry(arg)` with interrupts disabled;
+         * `switch_context` saves the current context to `*save_sp` and resumes
+         * the one at `load_sp`
+         */
+        static uintptr_t init_context(uintptr_t stack_top, void (*entry)(void*), void* arg) noexcept;
+
+        static void switch_context(uintptr_t* save_sp, uintptr_t load_sp) noexcept;
+
+        /* random bits for boot-time decisions such as address space layout */
+        static uint64_t entropy() noexcept;
     };
 
     using cpu = cpu_traits<current_arch>;
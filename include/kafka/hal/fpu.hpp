@@ -0,0 +1,77 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#pragma once
+
+#include <stdint.h>
+#include <kafka/types.hpp>
+#include <kafka/hal/interrupt.hpp>
+
+namespace kfk
+{
+    /* a thread's FPU/SIMD register state; the save area is only allocated once the thread uses the FPU */
+    struct FpuContext
+    {
+        void* area = nullptr;
+        uintptr_t area_phys = 0;
+        uint32_t last_cpu = ~0U; /* CPU whose registers last had this state loaded */
+    };
+
+    /*
+     * lazy FPU switching. the kernel itself never touches FPU registers, so a
+     * thread's state only has to be saved if it used them since it was switched
+     * in, and only loaded once it touches them again
+     */
+    template<typename Arch>
+    class fpu_traits
+    {
+    public:
+        /* the context switch is leaving `context`'s thread */
+        static void switch_out(FpuContext* context) noexcept;
+
+        /* ... and entering `context`'s */
+        static void switch_in(FpuContext* context) noexcept;
+
+        /* free the save area of a thread that is gone */
+        static void release(FpuContext* context) noexcept;
+
+        /*
+         * kernel-mode SIMD section; the running thread's state is saved first
+         * and reloaded on its next FPU use after `end`. nests. interrupts must
+         * be off throughout, which `SimdGuard` takes care of
+         */
+        static void begin() noexcept;
+
+        static void end() noexcept;
+    };
+
+    using fpu = fpu_traits<current_arch>;
+
+    /*
+     * scope in which the kernel may use SIMD registers, e.g. to call into code
+     * built for AVX2. it keeps interrupts off, so keep it short and never block
+     * in it. `Fpu` and `Int` are parameters only so that they are looked up at use
+     */
+    template<typename Fpu = fpu, typename Int = interrupt>
+    class SimdGuardT
+    {
+    public:
+        SimdGuardT() noexcept : irq_state(Int::save())
+        {
+            Fpu::begin();
+        }
+
+        ~SimdGuardT()
+        {
+            Fpu::end();
+            Int::restore(irq_state);
+        }
+
+        SimdGuardT(const SimdGuardT&) = delete;
+        SimdGuardT& operator=(const SimdGuardT&) = delete;
+
+    private:
+        uint64_t irq_state;
+    };
+
+    using SimdGuard = SimdGuardT<>;
+}
@@ -56,6 +56,10 @@ namespace kfk
 		/* software interrupts (0x0200 - 0x02FF) */
 		SYSCALL = 0x0200,
 
+		/* inter-processor (0x0300 - 0x030F) */
+		IPI_RESCHEDULE = 0x0300, /* wakes an idle CPU to look at its run queue */
+		IPI_TLB_SHOOTDOWN = 0x0301, /* handled by the vmm itself */
+
 		/* platform specific (0x1000 - 0x1FFF) */
 		PLAT_SPECIFIC_BASE = 0x1000,
 
@@ -90,6 +94,9 @@ namespace kfk
 	public:
 		static void init() noexcept;
 
+		/* find and program the external interrupt controllers; needs the heap. until then IRQs stay masked */
+		static void init_controllers(volatile limine_rsdp_request *request) noexcept;
+
 		static void enable(uint16_t n) noexcept; /* enable an interrupt  */
 
 		static void disable(uint16_t n) noexcept; /* disable an interrupt  */
@@ -98,6 +105,17 @@ namespace kfk
 
 		static void disable() noexcept;
 
+		/* disable interrupts and return the previous state for `restore` */
+		static uint64_t save() noexcept;
+
+		static void restore(uint64_t state) noexcept;
+
+		/* deliver IRQ `n` to CPU `cpu` from now on; false if it cannot be routed there */
+		static bool set_affinity(uint16_t n, uint32_t cpu) noexcept;
+
+		/* raise `id` on CPU `cpu`; false if that CPU cannot be addressed yet */
+		static bool send_ipi(uint32_t cpu, Vint id) noexcept;
+
         static void register_handler(Vint id, int_handler handler, 
             void* context = nullptr, 
             uint8_t priority = 128,
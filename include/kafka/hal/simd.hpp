@@ -0,0 +1,29 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <kafka/types.hpp>
+
+namespace kfk
+{
+    /*
+     * bulk memory kernels with per-CPU-model implementations. the widest the
+     * CPU supports is picked once at boot; callers need no SIMD section of
+     * their own. all pointers page aligned
+     */
+    template<typename Arch>
+    class simd_traits
+    {
+    public:
+        /* choose implementations; until then the general register ones run */
+        static void init() noexcept;
+
+        static void clear_pages(void* dst, size_t pages) noexcept;
+
+        static void copy_pages(void* dst, const void* src, size_t pages) noexcept;
+    };
+
+    using simd = simd_traits<current_arch>;
+}
@@ -0,0 +1,32 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#pragma once
+
+#include <stdint.h>
+#include <kafka/types.hpp>
+
+namespace kfk
+{
+    /*
+     * per-CPU one-shot event timer plus the monotonic clock it is programmed
+     * in. there is no periodic tick: whoever needs an interrupt arms one for
+     * the time it needs it, so an idle CPU sleeps until its next real deadline
+     */
+    template<typename Arch>
+    class timer_traits
+    {
+    public:
+        /* calibrate and start the boot CPU's timer; the other CPUs start theirs as they come up */
+        static void init() noexcept;
+
+        /* ns since boot; the same on every CPU */
+        static uint64_t now() noexcept;
+
+        /* raise IRQ_TIMER on the calling CPU once `now` reaches `deadline`; replaces the previous request */
+        static void arm(uint64_t deadline) noexcept;
+
+        static void disarm() noexcept;
+    };
+
+    using timer = timer_traits<current_arch>;
+}
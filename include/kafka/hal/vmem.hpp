@@ -15,6 +15,21 @@ namespace kfk
         bool used;
     };
 
+    /* a physically contiguous piece of a virtual range, e.g. one DMA scatter-list element */
+    struct PhysSegment
+    {
+        uintptr_t phys;
+        size_t len;
+    };
+
+    /* kernel virtual address areas; placement is randomized on every boot */
+    enum class KernelArea
+    {
+        HEAP, /* backs `map_page(n)` and device mappings */
+        VMALLOC, /* virtually contiguous allocations such as kernel stacks */
+        PERCPU /* per-CPU data copies */
+    };
+
     /* arch-independent VMM flags for POSIX compatibility */
     enum class VmmFlags : uint64_t
     {
@@ -37,7 +52,8 @@ namespace kfk
         GLOBAL = 1ULL << 18,
         HUGE = 1ULL << 19, 
         KERNEL = 1ULL << 20, 
-        USER = 1ULL << 21 
+        USER = 1ULL << 21,
+        WRITE_COMBINE = 1ULL << 22 /* memory type for framebuffers and other streaming device memory */
     };
 
     inline VmmFlags operator|(VmmFlags a, VmmFlags b) 
@@ -73,6 +89,14 @@ namespace kfk
     static const VmmFlags USER_RW = VmmFlags::PROT_READ | VmmFlags::PROT_WRITE | VmmFlags::USER;
     static const VmmFlags USER_RX = VmmFlags::PROT_READ | VmmFlags::PROT_EXEC | VmmFlags::USER;
 
+    /* pages with the same access rights, as reported by `query_range` */
+    struct VmRun
+    {
+        uintptr_t start;
+        size_t len;
+        VmmFlags prot; /* PROT_* plus USER; NONE for unmapped */
+    };
+
     template<typename Arch>
     class vmm_traits
     {
@@ -83,18 +107,64 @@ namespace kfk
         
         static uintptr_t map_page(size_t n = 1) noexcept;
         
-        static void map_page(uintptr_t virt_addr, uintptr_t phys_addr, VmmFlags flags) noexcept;
+        /* false if a page table for it could not be allocated; nothing is mapped then */
+        static bool map_page(uintptr_t virt_addr, uintptr_t phys_addr, VmmFlags flags) noexcept;
+
+        /* map device memory into the kernel heap area; the frames are not owned so never `unmap_page` it */
+        static uintptr_t map_device(uintptr_t phys_addr, size_t size, VmmFlags flags) noexcept;
         
         static void unmap_page(uintptr_t virt_addr) noexcept;
+
+        /* unmap a kernel range mapped page by page with `map_page`, e.g. in the vmalloc area; frees the frames */
+        static void unmap_kernel(uintptr_t virt_addr, size_t size) noexcept;
         
         static uintptr_t get_pmaddr(uintptr_t virt_addr) noexcept;
 
+        /* translate a whole range at once, coalescing contiguous frames; returns 0 on a hole or overflow */
+        static size_t translate_range(uintptr_t virt_addr, size_t size, PhysSegment *segments,
+                                      size_t max_segments) noexcept;
+
+        /* describe a range as runs of equally protected pages; returns 0 if `runs` is too short */
+        static size_t query_range(uintptr_t virt_addr, size_t size, VmRun *runs, size_t max_runs) noexcept;
+
+        /* change the access rights of a mapped range; false if part of it could not be changed */
+        static bool mprotect_range(uintptr_t virt_addr, size_t size, VmmFlags prot) noexcept;
+
         static void dynamic_mode() noexcept;
+
+        static MemoryRegion area(KernelArea which) noexcept;
         
+        /* end of the user half of every address space */
+        static uintptr_t user_limit() noexcept;
+
+        /*
+         * install one user page in the address space rooted at `ptb_phys`. `flags`
+         * carries the PROT_* bits plus MAP_SHARED or MAP_PRIVATE as for `mmap`;
+         * with neither the page is exclusively owned. the frame reference passes
+         * to the mapping
+         */
+        static bool map_user(uintptr_t ptb_phys, uintptr_t virt_addr, uintptr_t phys_addr, VmmFlags flags) noexcept;
+
+        /* drop the user pages of a range in the address space rooted at `ptb_phys`; returns how many were mapped */
+        static size_t unmap_user(uintptr_t ptb_phys, uintptr_t virt_addr, size_t size) noexcept;
+
         /* page table operations for proc mm */
         static uintptr_t create_ptb() noexcept;
 
+        /* duplicate an address space; user pages are shared copy-on-write */
+        static uintptr_t clone_ptb(uintptr_t ptb_phys) noexcept;
+
+        /* free an address space that is no longer loaded, along with every user page it still maps */
+        static void destroy_ptb(uintptr_t ptb_phys) noexcept;
+
         static void switch_ptb(uintptr_t ptb_phys) noexcept;
+
+        /*
+         * run the TLB shootdown aimed at this CPU, if there is one. its IPI does
+         * this; code that spins with interrupts off on something a shootdown's
+         * initiator may hold calls it too, or both would wait forever
+         */
+        static void flush_pending() noexcept;
     };
 
     using vmm = vmm_traits<current_arch>;
@@ -0,0 +1,49 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace kfk
+{
+    /* syscall numbers; the index into `syscall_table` */
+    enum Syscall : uint64_t
+    {
+        SYS_YIELD,
+        SYS_EXIT,
+        SYS_GETCPU,
+        SYS_GETTID,
+
+        SYSCALL_COUNT
+    };
+
+    /* errors come back negated in the return register */
+    static constexpr int64_t ENOSYS = 38;
+
+    using SyscallHandler = int64_t (*)(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
+
+    /* what the entry code has to do around a handler */
+    enum SyscallFlags : uint64_t
+    {
+        /*
+         * only the argument registers are saved and interrupts stay off; for
+         * short calls that neither block nor look at the caller's registers
+         */
+        SYSCALL_FAST = 0,
+
+        /* every user register saved in the frame and interrupts on; the handler may block, switch or rewrite the frame */
+        SYSCALL_FULL = 1
+    };
+
+    struct SyscallEntry
+    {
+        SyscallHandler handler;
+        uint64_t flags;
+    };
+
+    static_assert(sizeof(SyscallEntry) == 16, "entry code indexes the table by shifting");
+
+    /* built at compile time by the kernel; named for the entry asm */
+    extern const SyscallEntry syscall_table[SYSCALL_COUNT] asm("syscall_table");
+}
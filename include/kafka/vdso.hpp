@@ -0,0 +1,112 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * the vDSO data page: a read-only page the kernel maps into every address
+ * space, with what user code needs to read the clock and its CPU id without
+ * a syscall. this header is shared with userspace, so it depends on nothing
+ * but the compiler
+ */
+namespace kfk
+{
+    /* fixed until there is an auxiliary vector to pass it in; the last page of the lower half stays unmapped */
+    static constexpr uintptr_t VDSO_DATA_ADDRESS = 0x00007FFFFFFFE000ULL;
+
+    /* VdsoData::flags */
+    static constexpr uint32_t VDSO_CLOCK_TSC = 1U << 0; /* the TSC fields are valid; otherwise use the syscall */
+    static constexpr uint32_t VDSO_RDTSCP = 1U << 1; /* TSC_AUX holds the CPU id */
+    static constexpr uint32_t VDSO_RDPID = 1U << 2;
+
+    /*
+     * written by the kernel under a seqlock: `seq` is odd while an update is in
+     * progress, and a reader retries if it changed under it. monotonic time in
+     * ns is `base_ns + ((tsc - base_tsc) * mult >> shift)`
+     */
+    struct VdsoData
+    {
+        uint32_t seq;
+        uint32_t flags;
+        uint64_t base_tsc;
+        uint64_t base_ns;
+        uint64_t mult;
+        uint32_t shift;
+        uint32_t reserved;
+    };
+
+    /* user library */
+    namespace vdso_user
+    {
+        inline const VdsoData* data()
+        {
+            return reinterpret_cast<const VdsoData*>(VDSO_DATA_ADDRESS);
+        }
+
+#if defined(__x86_64__)
+        /* lfence keeps the read from running ahead of the seqlock load */
+        inline uint64_t read_tsc()
+        {
+            uint32_t low, high;
+            asm volatile("lfence\n rdtsc" : "=a"(low), "=d"(high) : : "memory");
+            return (static_cast<uint64_t>(high) << 32) | low;
+        }
+
+        /* CLOCK_MONOTONIC in ns; false if the kernel has no usable TSC and the syscall has to do */
+        inline bool clock_ns(uint64_t* ns)
+        {
+            const VdsoData* vdso = data();
+
+            uint32_t seq;
+            uint64_t base_tsc, base_ns, mult, tsc;
+            uint32_t shift, flags;
+            do
+            {
+                while ((seq = __atomic_load_n(&vdso->seq, __ATOMIC_ACQUIRE)) & 1)
+                    asm volatile("pause");
+
+                flags = __atomic_load_n(&vdso->flags, __ATOMIC_RELAXED);
+                base_tsc = __atomic_load_n(&vdso->base_tsc, __ATOMIC_RELAXED);
+                base_ns = __atomic_load_n(&vdso->base_ns, __ATOMIC_RELAXED);
+                mult = __atomic_load_n(&vdso->mult, __ATOMIC_RELAXED);
+                shift = __atomic_load_n(&vdso->shift, __ATOMIC_RELAXED);
+                tsc = read_tsc();
+
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            } while (__atomic_load_n(&vdso->seq, __ATOMIC_RELAXED) != seq);
+
+            if (!(flags & VDSO_CLOCK_TSC))
+                return false;
+
+            const uint64_t delta = tsc > base_tsc ? tsc - base_tsc : 0;
+            *ns = base_ns + static_cast<uint64_t>((static_cast<unsigned __int128>(delta) * mult) >> shift);
+            return true;
+        }
+
+        /* CPU the caller ran on a moment ago; false if neither instruction is usable */
+        inline bool getcpu(uint32_t* cpu)
+        {
+            const uint32_t flags = __atomic_load_n(&data()->flags, __ATOMIC_RELAXED);
+            if (flags & VDSO_RDPID)
+            {
+                uint64_t id;
+                asm volatile("rdpid %0" : "=r"(id));
+                *cpu = static_cast<uint32_t>(id);
+                return true;
+            }
+
+            if (flags & VDSO_RDTSCP)
+            {
+                uint32_t low, high, id;
+                asm volatile("rdtscp" : "=a"(low), "=d"(high), "=c"(id));
+                *cpu = id;
+                return true;
+            }
+
+            return false;
+        }
+#endif
+    }
+}
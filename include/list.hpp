@@ -31,7 +31,13 @@ namespace kfk
             );
         }
 
-        List()
+        constexpr List()
+        {
+            reset();
+        }
+
+        /* empty the list; also re-points the sentinel at itself after the list was copied bytewise */
+        constexpr void reset()
         {
             head.next = &head;
             head.prev = &head;
@@ -70,6 +76,12 @@ namespace kfk
             return head.next == &head;
         }
 
+        /* first element or nullptr */
+        [[nodiscard]] T* front() noexcept
+        {
+            return empty() ? nullptr : container_of(head.next);
+        }
+
         class Iterator
         {
         public:
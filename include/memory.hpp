@@ -219,12 +219,14 @@ namespace kfk
         
         void increment() noexcept
         {
-            ref_count.store(ref_count.load(MemoryOrder::ACQUIRE) + 1, MemoryOrder::RELEASE);
+            /* the caller already holds a reference, so nothing to order against */
+            ref_count.fetch_add(1, MemoryOrder::RELAXED);
         }
         
         bool decrement() noexcept
         {
-            return ref_count.exchange(ref_count.load(MemoryOrder::ACQUIRE) - 1, MemoryOrder::ACQUIRE) == 1;
+            /* release our writes to the object; acquire everyone else's before it is destroyed */
+            return ref_count.fetch_sub(1, MemoryOrder::ACQ_REL) == 1;
         }
 
         Atomic<int> ref_count;
@@ -0,0 +1,197 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic.hpp>
+#include <utilities.hpp>
+
+namespace kfk
+{
+    static constexpr size_t CACHE_LINE_SIZE = 64;
+
+    /*
+     * bounded multi-producer multi-consumer queue (Vyukov). each slot carries a
+     * sequence number telling whose turn it is, so producers and consumers only
+     * contend on their own index and never wait on one another: a full or empty
+     * ring fails the call instead of spinning, which keeps it safe in IRQ context.
+     * storage is inline; nothing is allocated after construction
+     */
+    template<typename T, size_t Capacity>
+    class MpmcRing
+    {
+        static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+
+    public:
+        MpmcRing() noexcept : enqueue_pos(0), dequeue_pos(0)
+        {
+            for (size_t i = 0; i < Capacity; i++)
+                cells[i].sequence.store(i, MemoryOrder::RELAXED);
+        }
+
+        MpmcRing(const MpmcRing&) = delete;
+        MpmcRing& operator=(const MpmcRing&) = delete;
+
+        /* false if the ring is full */
+        bool try_push(const T& item) noexcept
+        {
+            T copy = item;
+            return try_push(move(copy));
+        }
+
+        bool try_push(T&& item) noexcept
+        {
+            size_t pos = enqueue_pos.load(MemoryOrder::RELAXED);
+            Cell* cell;
+            for (;;)
+            {
+                cell = &cells[pos & MASK];
+                const size_t seq = cell->sequence.load(MemoryOrder::ACQUIRE);
+                const intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+
+                if (diff == 0)
+                {
+                    /* the slot is free for lap `pos`; claim it */
+                    if (enqueue_pos.compare_exchange_weak(pos, pos + 1, MemoryOrder::RELAXED))
+                        break;
+                }
+                else if (diff < 0)
+                {
+                    return false; /* the consumer of the previous lap has not finished with it */
+                }
+                else
+                {
+                    pos = enqueue_pos.load(MemoryOrder::RELAXED); /* another producer got here first */
+                }
+            }
+
+            cell->data = move(item);
+            cell->sequence.store(pos + 1, MemoryOrder::RELEASE);
+            return true;
+        }
+
+        /* false if the ring is empty */
+        bool try_pop(T& item) noexcept
+        {
+            size_t pos = dequeue_pos.load(MemoryOrder::RELAXED);
+            Cell* cell;
+            for (;;)
+            {
+                cell = &cells[pos & MASK];
+                const size_t seq = cell->sequence.load(MemoryOrder::ACQUIRE);
+                const intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+
+                if (diff == 0)
+                {
+                    if (dequeue_pos.compare_exchange_weak(pos, pos + 1, MemoryOrder::RELAXED))
+                        break;
+                }
+                else if (diff < 0)
+                {
+                    return false;
+                }
+                else
+                {
+                    pos = dequeue_pos.load(MemoryOrder::RELAXED);
+                }
+            }
+
+            item = move(cell->data);
+            cell->sequence.store(pos + Capacity, MemoryOrder::RELEASE); /* free for the next lap */
+            return true;
+        }
+
+        [[nodiscard]] static constexpr size_t capacity() noexcept
+        {
+            return Capacity;
+        }
+
+    private:
+        static constexpr size_t MASK = Capacity - 1;
+
+        struct Cell
+        {
+            Atomic<size_t> sequence{0};
+            T data;
+        };
+
+        /* the two indices are written by different sides; keep them off each other's line */
+        alignas(CACHE_LINE_SIZE) Atomic<size_t> enqueue_pos;
+        alignas(CACHE_LINE_SIZE) Atomic<size_t> dequeue_pos;
+        alignas(CACHE_LINE_SIZE) Cell cells[Capacity];
+    };
+
+    /*
+     * bounded single-producer single-consumer queue; wait-free on both ends.
+     * each side caches the other's index and only rereads it when the ring
+     * looks full or empty, so the steady state touches no shared line
+     */
+    template<typename T, size_t Capacity>
+    class SpscRing
+    {
+        static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+
+    public:
+        SpscRing() noexcept : head(0), tail(0) {}
+
+        SpscRing(const SpscRing&) = delete;
+        SpscRing& operator=(const SpscRing&) = delete;
+
+        /* producer side; false if the ring is full */
+        bool try_push(const T& item) noexcept
+        {
+            T copy = item;
+            return try_push(move(copy));
+        }
+
+        bool try_push(T&& item) noexcept
+        {
+            const size_t pos = tail.load(MemoryOrder::RELAXED);
+            if (pos - head_cache == Capacity)
+            {
+                head_cache = head.load(MemoryOrder::ACQUIRE);
+                if (pos - head_cache == Capacity)
+                    return false;
+            }
+
+            slots[pos & MASK] = move(item);
+            tail.store(pos + 1, MemoryOrder::RELEASE);
+            return true;
+        }
+
+        /* consumer side; false if the ring is empty */
+        bool try_pop(T& item) noexcept
+        {
+            const size_t pos = head.load(MemoryOrder::RELAXED);
+            if (pos == tail_cache)
+            {
+                tail_cache = tail.load(MemoryOrder::ACQUIRE);
+                if (pos == tail_cache)
+                    return false;
+            }
+
+            item = move(slots[pos & MASK]);
+            head.store(pos + 1, MemoryOrder::RELEASE);
+            return true;
+        }
+
+        [[nodiscard]] static constexpr size_t capacity() noexcept
+        {
+            return Capacity;
+        }
+
+    private:
+        static constexpr size_t MASK = Capacity - 1;
+
+        /* consumer's line: its index and its view of the producer's */
+        alignas(CACHE_LINE_SIZE) Atomic<size_t> head;
+        size_t tail_cache = 0;
+
+        /* producer's line */
+        alignas(CACHE_LINE_SIZE) Atomic<size_t> tail;
+        size_t head_cache = 0;
+
+        alignas(CACHE_LINE_SIZE) T slots[Capacity];
+    };
+}
@@ -0,0 +1,20 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#pragma once
+
+namespace kfk
+{
+    /*
+     * boot-time benchmarks, each compiled in only when the build asks for it
+     * (`make run KBENCH=...`, see the top-level Makefile). results go to the
+     * console
+     */
+    class Bench
+    {
+    public:
+        /* spawn a thread for every enabled benchmark; call once the scheduler is up */
+        static void start() noexcept;
+    };
+
+    using bench = Bench;
+}
@@ -0,0 +1,48 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace kfk
+{
+    struct HrTimer
+    {
+        uint64_t expires; /* `timer::now` time in ns */
+        void (*func)(HrTimer*);
+        uint32_t index; /* slot in its CPU's heap; NOT_QUEUED while not armed */
+        uint32_t cpu; /* CPU it is queued on */
+    };
+
+    /*
+     * high-resolution one-shot timers. every CPU keeps its pending timers in a
+     * binary min-heap and programs its event timer for the earliest one only,
+     * so nothing fires between deadlines. callbacks run in interrupt context
+     * on the CPU the timer was started on
+     */
+    class HrTimers
+    {
+    public:
+        static constexpr uint32_t NOT_QUEUED = UINT32_MAX;
+
+        /* take over IRQ_TIMER; call once the timer hal is up */
+        static void init() noexcept;
+
+        /* a timer to be `start`ed; it is not queued yet */
+        static constexpr HrTimer make(void (*func)(HrTimer*)) noexcept
+        {
+            return { 0, func, NOT_QUEUED, 0 };
+        }
+
+        /* (re)arm on the calling CPU to fire at `expires`; false if out of memory */
+        static bool start(HrTimer* timer, uint64_t expires) noexcept;
+
+        /* true if it was pending; a callback that is already running is not waited for */
+        static bool cancel(HrTimer* timer) noexcept;
+
+        static bool pending(const HrTimer* timer) noexcept;
+    };
+
+    using hrtimer = HrTimers;
+}
@@ -0,0 +1,91 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <list.hpp>
+#include <kafka/aspace.hpp>
+#include <kafka/hal/fpu.hpp>
+
+namespace kfk
+{
+    enum class ThreadState : uint8_t
+    {
+        RUNNING,
+        READY, /* on a run queue */
+        BLOCKED,
+        DEAD /* waiting for the next thread on its CPU to free it */
+    };
+
+    struct Thread
+    {
+        uintptr_t sp; /* saved context while switched out */
+        uintptr_t stack; /* top of the kernel stack */
+        Node node; /* run queue link */
+
+        void (*entry)(void*);
+        void* arg;
+
+        uint64_t id;
+        uint8_t priority; /* 0 is the most urgent */
+        ThreadState state;
+        bool wake_pending; /* woken while not blocked; the next `block` returns at once */
+        uint32_t cpu; /* CPU it last ran on; wakeups go back there while its cache is warm */
+        uint32_t slice; /* ticks left before it is preempted */
+        uint64_t last_ran; /* `cpu`'s tick count when it last stopped running */
+
+        VmaHint vma_hint; /* its last VMA lookup; see `AddressSpace::set_hint` */
+        FpuContext fpu; /* extended register state; switched lazily, see `fpu_traits` */
+    };
+
+    /* one CPU's scheduling counters since it came up */
+    struct SchedStats
+    {
+        uint64_t switches; /* to a thread other than the idle one */
+        uint64_t steals; /* threads taken from other CPUs' queues */
+    };
+
+    /*
+     * preemptive priority scheduler. every CPU has its own run queue with one
+     * FIFO per priority and a bitmap of the non-empty ones, so picking the next
+     * thread is a find-first-set. threads stay on the CPU they last ran on; a
+     * CPU that runs dry steals from the busiest one, preferring threads whose
+     * cache footprint has gone cold. the tick is an hrtimer that only runs
+     * while a thread does, so an idle CPU stays halted until it has work
+     */
+    class Scheduler
+    {
+    public:
+        static constexpr size_t PRIORITIES = 64;
+        static constexpr uint8_t DEFAULT_PRIORITY = 32;
+
+        /* set up the boot CPU; the calling context becomes its idle thread once it calls `run` */
+        static void init() noexcept;
+
+        /* new thread, ready to run; nullptr if out of memory */
+        static Thread* spawn(void (*entry)(void*), void* arg, uint8_t priority = DEFAULT_PRIORITY) noexcept;
+
+        /* turn the calling context into this CPU's idle thread and start scheduling; `cpu::smp_init` entry for the APs */
+        [[noreturn]] static void run() noexcept;
+
+        static void yield() noexcept;
+
+        /* stop the calling thread until someone `wake`s it; a wakeup that came first is not lost */
+        static void block() noexcept;
+
+        static void wake(Thread* thread) noexcept;
+
+        [[noreturn]] static void exit() noexcept;
+
+        /* timer tick on this CPU, from interrupt context; preempts once the running thread's slice is used up */
+        static void tick() noexcept;
+
+        static Thread* current() noexcept;
+
+        /* read without stopping `cpu`, so only roughly current */
+        static SchedStats stats(uint32_t cpu) noexcept;
+    };
+
+    using sched = Scheduler;
+}
@@ -0,0 +1,50 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <list.hpp>
+
+namespace kfk
+{
+    struct Timeout
+    {
+        Node node; /* slot link; unlinked while not armed */
+        uint64_t expires; /* in wheel ticks */
+        void (*func)(Timeout*);
+        uint32_t cpu; /* CPU whose wheel it is on */
+        uint16_t slot; /* level * 64 + index */
+    };
+
+    /*
+     * coarse timeouts for the many that are armed and mostly cancelled before
+     * they fire (network, IPC). every CPU has a hierarchical wheel of 6 levels
+     * with 64 slots each, every level 64 times coarser than the one below, so
+     * arming and cancelling are a list insert or unlink. timers move down a
+     * level when the level below wraps around, and a whole slot expires in one
+     * pass. the wheel is driven by an hrtimer set for its next event only.
+     * callbacks run in interrupt context on the CPU the timeout was started on
+     */
+    class TimerWheel
+    {
+    public:
+        static constexpr uint64_t TICK_NS = 1000000; /* resolution; timeouts fire up to one tick late */
+
+        /* a timeout to be `start`ed; it is not armed yet */
+        static constexpr Timeout make(void (*func)(Timeout*)) noexcept
+        {
+            return { {}, 0, func, 0, 0 };
+        }
+
+        /* (re)arm on the calling CPU to fire `ns` from now; never allocates */
+        static void start(Timeout* timeout, uint64_t ns) noexcept;
+
+        /* true if it was pending; a callback that is already running is not waited for */
+        static bool cancel(Timeout* timeout) noexcept;
+
+        static bool pending(const Timeout* timeout) noexcept;
+    };
+
+    using timer_wheel = TimerWheel;
+}
@@ -5,7 +5,6 @@
  */
 
 #include <atomic.hpp>
-#include <kafka/hal/cpu.hpp>
 
 #define MAX_ATEXIT_HANDLERS 256
 
@@ -22,44 +21,19 @@ namespace
     AtExitHandler atexit_handlers[MAX_ATEXIT_HANDLERS];
 
     kfk::Atomic atexit_handler_count(0);
-    kfk::Atomic atexit_lock(false);
-
-    void acquire_lock() 
-    {
-        auto expected = false;
-        unsigned int spins = 0;
-
-        while (!atexit_lock.compare_exchange(expected, true, 
-            kfk::MemoryOrder::ACQUIRE)) 
-        {
-             expected = false;
-
-            /* performance: exponentially backoff to avoid */
-            for (unsigned int i = 0; i < (1U << spins); ++i)
-                kfk::cpu::pause();
-
-            /* cap the maximum backoff */
-            if (spins < 10)
-                spins++;
-        }
-    }
-
-    void release_lock() 
-    {
-        atexit_lock.store(false, kfk::MemoryOrder::RELEASE); 
-    }
+    kfk::Spinlock atexit_lock;
 }
 
 extern "C" int __cxa_atexit(void (*func)(void *), void *arg, void *dso_handle)
 {
-    acquire_lock();
+    atexit_lock.lock();
 
     auto result = 1; /* default to */
     const int count = atexit_handler_count.load(kfk::MemoryOrder::ACQUIRE);
 
     if (count >= MAX_ATEXIT_HANDLERS) 
     {
-        release_lock();
+        atexit_lock.unlock();
         return result;
     }
 
@@ -74,7 +48,7 @@ extern "C" int __cxa_atexit(void (*func)(void *), void *arg, void *dso_handle)
             atexit_handlers[i].dso_handle = dso_handle;
             atexit_handlers[i].used = true;
             result = 0; /* success */
-            release_lock();
+            atexit_lock.unlock();
             return result;
         }
     }
@@ -90,13 +64,13 @@ extern "C" int __cxa_atexit(void (*func)(void *), void *arg, void *dso_handle)
         result = 0; /* success */
     }
 
-    release_lock();
+    atexit_lock.unlock();
     return result;
  }
 
 extern "C" void __cxa_finalize(const void *dso_handle)
 {
-    acquire_lock();
+    atexit_lock.lock();
 
     const int count = atexit_handler_count.load(kfk::MemoryOrder::ACQUIRE);
     for (int i = count - 1; i >= 0; i--) /* call the handlers in LIFO manner */
@@ -113,11 +87,11 @@ extern "C" void __cxa_finalize(const void *dso_handle)
             atexit_handlers[i].used = false;
 
             /* release then call restore again */
-            release_lock();
+            atexit_lock.unlock();
             (*fn)(arg);
-            acquire_lock();
+            atexit_lock.lock();
         }
     }
 
-    release_lock();
+    atexit_lock.unlock();
 }
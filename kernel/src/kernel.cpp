@@ -9,9 +9,14 @@
 #include <kafka/fb.hpp>
 #include <kafka/heap.hpp>
 #include <kafka/pmem.hpp>
+#include <kafka/vdso_page.hpp>
+#include <kernel/bench.hpp>
+#include <kernel/hrtimer.hpp>
 #include <kernel/policy.hpp>
+#include <kernel/sched.hpp>
 #include <kafka/hal/cpu.hpp>
 #include <kafka/hal/interrupt.hpp>
+#include <kafka/hal/timer.hpp>
 #include <kafka/hal/vmem.hpp>
 
 namespace
@@ -30,6 +35,24 @@ namespace
 		.id = LIMINE_MEMMAP_REQUEST, .response = nullptr
 	};
 
+	__attribute__((used, section(".limine_requests"))) volatile limine_rsdp_request rsdp_request = {
+		.id = LIMINE_RSDP_REQUEST, .revision = 0, .response = nullptr
+	};
+
+	__attribute__((used, section(".limine_requests"))) volatile limine_smp_request smp_request = {
+		.id = LIMINE_SMP_REQUEST, .revision = 0, .response = nullptr, .flags = 0
+	};
+
+#if defined(__x86_64__)
+	/* take 5-level paging when the CPU has it; vmm reads the outcome back from CR4 */
+	__attribute__((used, section(".limine_requests"))) volatile limine_paging_mode_request paging_mode_request = {
+		.id = LIMINE_PAGING_MODE_REQUEST, .revision = 1, .response = nullptr,
+		.mode = LIMINE_PAGING_MODE_X86_64_5LVL,
+		.max_mode = LIMINE_PAGING_MODE_X86_64_5LVL,
+		.min_mode = LIMINE_PAGING_MODE_X86_64_4LVL
+	};
+#endif
+
 	__attribute__((used, section(".limine_requests_start"))) volatile LIMINE_REQUESTS_START_MARKER;
 
 	__attribute__((used, section(".limine_requests_end"))) volatile LIMINE_REQUESTS_END_MARKER;
@@ -59,13 +82,28 @@ extern "C" void kernel_main()
 
 	kfk::vmm::init(hhdm_offset);
 	kfk::heap::init();
+	kfk::vdso::init();
 
 	/* use dynamic allocation policy */
 	policy::dynamic_alloc();
 
 	kfk::cpu::init(hhdm_offset);
 	kfk::interrupt::init();
-
-	kfk::cpu::pause();
-	kfk::cpu::halt();
+	kfk::interrupt::init_controllers(&rsdp_request);
+	kfk::timer::init();
+	kfk::hrtimer::init();
+	kfk::sched::init();
+	kfk::cpu::smp_init(&smp_request, kfk::sched::run);
+
+	/* the HHDM view of the framebuffer has whatever memory type firmware left; draw through a WC one */
+	limine_framebuffer* framebuffer = framebuffer_requests.response->framebuffers[0];
+	const uintptr_t fb_phys = reinterpret_cast<uintptr_t>(framebuffer->address) - hhdm_offset;
+	if (const uintptr_t fb_wc = kfk::vmm::map_device(fb_phys, framebuffer->pitch * framebuffer->height,
+		kfk::KERNEL_RW | kfk::VmmFlags::WRITE_COMBINE))
+		kfk::fb::remap(reinterpret_cast<void*>(fb_wc));
+
+	kfk::bench::start();
+
+	/* the boot context becomes the BSP's idle thread */
+	kfk::sched::run();
 }
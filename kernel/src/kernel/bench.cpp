@@ -0,0 +1,245 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <iostream.hpp>
+#include <string.hpp>
+#include <kafka/pmem.hpp>
+#include <atomic.hpp>
+#include <kafka/syscall.hpp>
+#include <kernel/bench.hpp>
+#include <kernel/sched.hpp>
+#include <kafka/hal/cpu.hpp>
+#include <kafka/hal/timer.hpp>
+#include <kafka/hal/vmem.hpp>
+
+namespace kfk
+{
+#if defined(KBENCH_SYSCALL) && defined(__x86_64__)
+    static constexpr size_t PAGE_SIZE = 4096;
+    static constexpr uint64_t SYSCALL_ROUNDS = 100000;
+    static constexpr uintptr_t STUB_CODE = 0x400000;
+    static constexpr uintptr_t STUB_DATA = STUB_CODE + PAGE_SIZE; /* results at the bottom, stack from the top */
+
+    struct SyscallResult
+    {
+        uint64_t null_ticks; /* number past the table: entry, the range check and exit only */
+        uint64_t getcpu_ticks; /* the cheapest real call, a SYSCALL_FAST one */
+        uint64_t done;
+    };
+
+    extern "C" const char syscall_stub_end[];
+
+    /*
+     * the ring-3 side; its bytes are copied to STUB_CODE, so it must not refer
+     * to anything outside itself. times SYSCALL_ROUNDS back-to-back calls of
+     * each kind with the TSC, fenced so the reads stay out of the loop, leaves
+     * the totals in the `SyscallResult` at rdi and exits
+     */
+    static void syscall_stub() __attribute__((naked));
+
+    static void syscall_stub()
+    {
+        asm volatile(
+            "movq %[null], %%rbx\n"
+            "callq 1f\n"
+            "movq %%rax, %c[null_off](%%rdi)\n"
+            "movq %[getcpu], %%rbx\n"
+            "callq 1f\n"
+            "movq %%rax, %c[getcpu_off](%%rdi)\n"
+            "movq $1, %c[done_off](%%rdi)\n"
+            "movq %[exit], %%rax\n"
+            "syscall\n"
+            "ud2\n"
+
+            /* SYSCALL_ROUNDS calls of number rbx; TSC ticks in rax. entry gives back all but rax, rcx and r11 */
+            "1:\n"
+            "movq %[rounds], %%r12\n"
+            "lfence\n"
+            "rdtsc\n"
+            "shlq $32, %%rdx\n"
+            "orq %%rax, %%rdx\n"
+            "movq %%rdx, %%r13\n"
+            "2:\n"
+            "movq %%rbx, %%rax\n"
+            "syscall\n"
+            "decq %%r12\n"
+            "jnz 2b\n"
+            "lfence\n"
+            "rdtsc\n"
+            "shlq $32, %%rdx\n"
+            "orq %%rdx, %%rax\n"
+            "subq %%r13, %%rax\n"
+            "retq\n"
+
+            ".globl syscall_stub_end\n"
+            "syscall_stub_end:\n"
+            : : [null] "i"(SYSCALL_COUNT), [getcpu] "i"(SYS_GETCPU), [exit] "i"(SYS_EXIT),
+                [rounds] "i"(SYSCALL_ROUNDS), [null_off] "i"(offsetof(SyscallResult, null_ticks)),
+                [getcpu_off] "i"(offsetof(SyscallResult, getcpu_ticks)), [done_off] "i"(offsetof(SyscallResult, done))
+        );
+    }
+
+    static void syscall_user(void* ptb)
+    {
+        vmm::switch_ptb(reinterpret_cast<uintptr_t>(ptb));
+
+        /* interrupts stay masked in ring 3 too: no preemption, so no migration off this page table and no tick in the numbers */
+        cpu::enter_user(STUB_CODE, STUB_DATA + PAGE_SIZE, STUB_DATA, false);
+    }
+
+    /*
+     * syscall round trip from ring 3, in TSC ticks per call. the stub's
+     * space is not torn down afterwards: the CPU that ran it may still have
+     * it loaded, and nothing here can switch that CPU away from it
+     */
+    static void syscall_latency(void*)
+    {
+        const uintptr_t ptb = vmm::create_ptb();
+        const uintptr_t code = pmm::pmalloc();
+        const uintptr_t data = pmm::pmalloc();
+        if (!ptb || !code || !data)
+        {
+            if (code)
+                pmm::pfree(code);
+            if (data)
+                pmm::pfree(data);
+            if (ptb)
+                vmm::destroy_ptb(ptb);
+            printf("bench: syscall: out of memory\n");
+            return;
+        }
+
+        const auto* stub = reinterpret_cast<const char*>(+syscall_stub);
+        memcpy(pmm::phys_to_virt(code), stub, syscall_stub_end - stub);
+        memset(pmm::phys_to_virt(data), 0, PAGE_SIZE);
+
+        /* the frame references pass to the mappings, so from here on `destroy_ptb` drops them */
+        const bool mapped = vmm::map_user(ptb, STUB_CODE, code, PROT_READ_EXEC);
+        if (!mapped)
+            pmm::pfree(code);
+        if (!mapped || !vmm::map_user(ptb, STUB_DATA, data, PROT_READ_WRITE))
+        {
+            pmm::pfree(data);
+            vmm::destroy_ptb(ptb);
+            printf("bench: syscall: out of memory\n");
+            return;
+        }
+
+        if (!sched::spawn(syscall_user, reinterpret_cast<void*>(ptb)))
+        {
+            vmm::destroy_ptb(ptb);
+            printf("bench: syscall: out of memory\n");
+            return;
+        }
+
+        auto* result = static_cast<volatile SyscallResult*>(pmm::phys_to_virt(data));
+        while (!result->done)
+            sched::yield();
+
+        printf("bench: syscall round trip: %u ticks null, %u ticks getcpu (%u calls each)\n",
+               static_cast<unsigned>(result->null_ticks / SYSCALL_ROUNDS),
+               static_cast<unsigned>(result->getcpu_ticks / SYSCALL_ROUNDS), static_cast<unsigned>(SYSCALL_ROUNDS));
+    }
+#endif
+
+#if defined(KBENCH_SCHED)
+    static constexpr uint32_t SCHED_ROUNDS = 100;
+    static constexpr uint32_t SCHED_CHUNKS = 4; /* of CPU-bound work per round */
+    static constexpr uint64_t SCHED_CHUNK_SPINS = 20000;
+    static constexpr uint32_t SCHED_MAX_WORKERS = 2 * MAX_CPUS + 2;
+
+    /* workers go in pairs, `i` with `i ^ 1`, that wake each other once a round */
+    static Thread* sched_workers[SCHED_MAX_WORKERS];
+    static uint32_t sched_count;
+    static Thread* sched_reporter;
+    static Atomic<bool> sched_go(false);
+    static Atomic<bool> sched_abort(false);
+    static Atomic<uint32_t> sched_finished(0);
+    static Atomic<uint64_t> sched_chunks[MAX_CPUS]; /* work done on each CPU */
+
+    static void sched_worker(void* arg)
+    {
+        const auto index = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(arg));
+        while (!sched_go.load(MemoryOrder::ACQUIRE))
+            sched::yield();
+        if (sched_abort.load(MemoryOrder::RELAXED))
+            return;
+
+        Thread* partner = sched_workers[index ^ 1];
+        for (uint32_t round = 0; round < SCHED_ROUNDS; round++)
+        {
+            for (uint32_t chunk = 0; chunk < SCHED_CHUNKS; chunk++)
+            {
+                for (uint64_t i = 0; i < SCHED_CHUNK_SPINS; i++)
+                    asm volatile("" : : : "memory");
+                sched_chunks[cpu::id()].fetch_add(1, MemoryOrder::RELAXED);
+            }
+
+            /* both sides wake once and block once a round, so neither is left asleep */
+            sched::wake(partner);
+            sched::block();
+        }
+
+        if (sched_finished.fetch_add(1, MemoryOrder::ACQ_REL) + 1 == sched_count)
+            sched::wake(sched_reporter);
+    }
+
+    /*
+     * load balancing under pressure: twice as many CPU-bound threads as
+     * CPUs, plus two, handing off to each other through block and wake so
+     * queues keep draining and refilling. prints where the work ran and how
+     * often each CPU switched and stole; run with `SMP=N` for N CPUs
+     */
+    static void sched_balance(void*)
+    {
+        const uint32_t cpus = cpu::count();
+        sched_count = 2 * cpus + 2;
+        sched_reporter = sched::current();
+
+        SchedStats before[MAX_CPUS];
+        for (uint32_t i = 0; i < cpus; i++)
+            before[i] = sched::stats(i);
+
+        for (uint32_t i = 0; i < sched_count; i++)
+        {
+            sched_workers[i] = sched::spawn(sched_worker, reinterpret_cast<void*>(static_cast<uintptr_t>(i)));
+            if (!sched_workers[i])
+            {
+                /* the ones already spawned only wait for the gate; open it and let them return */
+                sched_abort.store(true, MemoryOrder::RELAXED);
+                sched_go.store(true, MemoryOrder::RELEASE);
+                printf("bench: sched: out of memory\n");
+                return;
+            }
+        }
+
+        const uint64_t start = timer::now();
+        sched_go.store(true, MemoryOrder::RELEASE);
+        while (sched_finished.load(MemoryOrder::ACQUIRE) < sched_count)
+            sched::block();
+        const uint64_t elapsed = timer::now() - start;
+
+        printf("bench: sched: %u threads on %u CPUs in %u ms\n", sched_count, cpus,
+               static_cast<unsigned>(elapsed / 1000000));
+        for (uint32_t i = 0; i < cpus; i++)
+        {
+            const SchedStats after = sched::stats(i);
+            printf("bench: sched: cpu %u: %u chunks, %u switches, %u steals\n", i,
+                   static_cast<unsigned>(sched_chunks[i].load(MemoryOrder::RELAXED)),
+                   static_cast<unsigned>(after.switches - before[i].switches),
+                   static_cast<unsigned>(after.steals - before[i].steals));
+        }
+    }
+#endif
+
+    void Bench::start() noexcept
+    {
+#if defined(KBENCH_SYSCALL) && defined(__x86_64__)
+        sched::spawn(syscall_latency, nullptr);
+#endif
+#if defined(KBENCH_SCHED)
+        sched::spawn(sched_balance, nullptr);
+#endif
+    }
+}
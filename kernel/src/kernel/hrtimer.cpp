@@ -0,0 +1,223 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic.hpp>
+#include <string.hpp>
+#include <kafka/heap.hpp>
+#include <kafka/percpu.hpp>
+#include <kernel/hrtimer.hpp>
+#include <kafka/hal/cpu.hpp>
+#include <kafka/hal/interrupt.hpp>
+#include <kafka/hal/timer.hpp>
+
+namespace kfk
+{
+    static constexpr uint32_t INITIAL_CAPACITY = 16;
+
+    struct TimerQueue
+    {
+        Spinlock lock; /* always taken with interrupts off */
+        HrTimer** heap = nullptr; /* min-heap on `expires` */
+        uint32_t count = 0;
+        uint32_t capacity = 0;
+        uint64_t programmed = UINT64_MAX; /* deadline the hardware is set for; UINT64_MAX if none */
+    };
+
+    PER_CPU static TimerQueue timer_queue;
+
+    static TimerQueue& local_queue()
+    {
+        return *this_cpu_ptr(timer_queue);
+    }
+
+    static void place(TimerQueue& queue, HrTimer* timer, uint32_t index)
+    {
+        queue.heap[index] = timer;
+        timer->index = index;
+    }
+
+    static void sift_up(TimerQueue& queue, uint32_t index)
+    {
+        HrTimer* timer = queue.heap[index];
+        while (index)
+        {
+            const uint32_t parent = (index - 1) / 2;
+            if (queue.heap[parent]->expires <= timer->expires)
+                break;
+
+            place(queue, queue.heap[parent], index);
+            index = parent;
+        }
+        place(queue, timer, index);
+    }
+
+    static void sift_down(TimerQueue& queue, uint32_t index)
+    {
+        HrTimer* timer = queue.heap[index];
+        while (true)
+        {
+            uint32_t child = 2 * index + 1;
+            if (child >= queue.count)
+                break;
+            if (child + 1 < queue.count && queue.heap[child + 1]->expires < queue.heap[child]->expires)
+                child++;
+            if (timer->expires <= queue.heap[child]->expires)
+                break;
+
+            place(queue, queue.heap[child], index);
+            index = child;
+        }
+        place(queue, timer, index);
+    }
+
+    static void remove(TimerQueue& queue, HrTimer* timer)
+    {
+        const uint32_t index = timer->index;
+        timer->index = HrTimers::NOT_QUEUED;
+
+        HrTimer* last = queue.heap[--queue.count];
+        if (index == queue.count)
+            return;
+
+        place(queue, last, index);
+        if (index && queue.heap[(index - 1) / 2]->expires > last->expires)
+            sift_up(queue, index);
+        else
+            sift_down(queue, index);
+    }
+
+    static bool grow(TimerQueue& queue)
+    {
+        const uint32_t capacity = queue.capacity ? queue.capacity * 2 : INITIAL_CAPACITY;
+        auto** heap = static_cast<HrTimer**>(heap::allocate(sizeof(HrTimer*), capacity));
+        if (!heap)
+            return false;
+
+        if (queue.heap)
+        {
+            memcpy(heap, queue.heap, queue.count * sizeof(HrTimer*));
+            heap::free(queue.heap);
+        }
+
+        queue.heap = heap;
+        queue.capacity = capacity;
+        return true;
+    }
+
+    /* point the hardware at the earliest timer; only for the calling CPU's own queue */
+    static void program(TimerQueue& queue)
+    {
+        const uint64_t next = queue.count ? queue.heap[0]->expires : UINT64_MAX;
+        if (next == queue.programmed)
+            return;
+
+        queue.programmed = next;
+        if (next == UINT64_MAX)
+            timer::disarm();
+        else
+            timer::arm(next);
+    }
+
+    /* lock the queue `timer` is on; nullptr with nothing locked if it is not queued */
+    static TimerQueue* lock_queue(HrTimer* timer)
+    {
+        while (true)
+        {
+            if (timer->index == HrTimers::NOT_QUEUED)
+                return nullptr;
+
+            /* it only moves between queues while unqueued, so the lock settles it */
+            TimerQueue* queue = per_cpu_ptr(timer_queue, timer->cpu);
+            queue->lock.lock();
+            if (timer->index != HrTimers::NOT_QUEUED && per_cpu_ptr(timer_queue, timer->cpu) == queue)
+                return queue;
+            queue->lock.unlock();
+        }
+    }
+
+    /*
+     * run everything that is due. the hardware is set for the next timer before
+     * each callback, so one that switches threads (the scheduler tick) cannot
+     * hold up the rest: they fire on this CPU whatever runs next
+     */
+    static void timer_interrupt(void*)
+    {
+        TimerQueue& queue = local_queue();
+        while (true)
+        {
+            queue.lock.lock();
+            queue.programmed = UINT64_MAX; /* it just fired */
+
+            if (!queue.count || queue.heap[0]->expires > timer::now())
+            {
+                program(queue);
+                queue.lock.unlock();
+                return;
+            }
+
+            HrTimer* timer = queue.heap[0];
+            remove(queue, timer);
+            program(queue);
+            queue.lock.unlock();
+
+            timer->func(timer);
+        }
+    }
+
+    void HrTimers::init() noexcept
+    {
+        interrupt::register_handler(IRQ_TIMER, timer_interrupt);
+    }
+
+    bool HrTimers::start(HrTimer* timer, uint64_t expires) noexcept
+    {
+        const uint64_t state = interrupt::save();
+
+        if (TimerQueue* old = lock_queue(timer))
+        {
+            remove(*old, timer);
+            old->lock.unlock();
+        }
+
+        TimerQueue& queue = local_queue();
+        queue.lock.lock();
+        if (queue.count == queue.capacity && !grow(queue))
+        {
+            queue.lock.unlock();
+            interrupt::restore(state);
+            return false;
+        }
+
+        timer->expires = expires;
+        timer->cpu = cpu::id();
+        place(queue, timer, queue.count++);
+        sift_up(queue, timer->index);
+        program(queue);
+
+        queue.lock.unlock();
+        interrupt::restore(state);
+        return true;
+    }
+
+    bool HrTimers::cancel(HrTimer* timer) noexcept
+    {
+        const uint64_t state = interrupt::save();
+
+        /* the hardware of its CPU may still fire for it; the handler then finds nothing due and moves on */
+        TimerQueue* queue = lock_queue(timer);
+        if (queue)
+        {
+            remove(*queue, timer);
+            queue->lock.unlock();
+        }
+
+        interrupt::restore(state);
+        return queue != nullptr;
+    }
+
+    bool HrTimers::pending(const HrTimer* timer) noexcept
+    {
+        return timer->index != NOT_QUEUED;
+    }
+}
@@ -0,0 +1,458 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic.hpp>
+#include <list.hpp>
+#include <kafka/heap.hpp>
+#include <kafka/kstack.hpp>
+#include <kafka/percpu.hpp>
+#include <kafka/rcu.hpp>
+#include <kernel/hrtimer.hpp>
+#include <kernel/sched.hpp>
+#include <kafka/hal/cpu.hpp>
+#include <kafka/hal/fpu.hpp>
+#include <kafka/hal/interrupt.hpp>
+#include <kafka/hal/timer.hpp>
+
+namespace kfk
+{
+    static constexpr uint64_t TICK_NS = 1000000;
+    static constexpr uint32_t SLICE_TICKS = 10;
+    static constexpr uint64_t CACHE_HOT_TICKS = 4; /* a thread that ran this recently still has its working set cached */
+
+    static_assert(Scheduler::PRIORITIES <= 64, "the ready bitmap is a single word");
+
+    using RunList = List<Thread, &Thread::node>;
+
+    struct RunQueue
+    {
+        Spinlock lock; /* always taken with interrupts off */
+        uint64_t bitmap = 0; /* bit n set while queues[n] is non-empty */
+        RunList queues[Scheduler::PRIORITIES];
+        Atomic<size_t> queued; /* threads waiting in `queues`; read unlocked by stealers */
+        Atomic<uint64_t> ticks;
+        Atomic<uint64_t> switches; /* only written by its own CPU; see `SchedStats` */
+        Atomic<uint64_t> steals;
+
+        Thread* current = nullptr;
+        Thread* prev = nullptr; /* just switched away from; settled by `finish_switch` on the next thread */
+        Thread idle = {}; /* the CPU's boot context; never queued */
+        Atomic<bool> ready; /* set up; other CPUs may steal from it */
+        HrTimer tick; /* runs only while a thread does, or RCU has work; an idle CPU sleeps until its next event */
+    };
+
+    PER_CPU static RunQueue runqueue;
+
+    static Atomic<uint64_t> next_id(1);
+
+    /* threads still switching out; `wake` must not requeue one before its context is saved */
+    static Atomic<Thread*> switching_out[MAX_CPUS] = {};
+
+    static RunQueue& local_rq()
+    {
+        return *this_cpu_ptr(runqueue);
+    }
+
+    static void enqueue(RunQueue& rq, Thread* thread)
+    {
+        thread->state = ThreadState::READY;
+        rq.queues[thread->priority].push_back(thread);
+        rq.bitmap |= 1ULL << thread->priority;
+        rq.queued.fetch_add(1, MemoryOrder::RELAXED);
+    }
+
+    static void unqueue(RunQueue& rq, Thread* thread)
+    {
+        RunList& list = rq.queues[thread->priority];
+        list.remove(thread);
+        if (list.empty())
+            rq.bitmap &= ~(1ULL << thread->priority);
+        rq.queued.fetch_sub(1, MemoryOrder::RELAXED);
+    }
+
+    /* most urgent ready thread or nullptr; O(1) through the bitmap */
+    static Thread* dequeue(RunQueue& rq)
+    {
+        if (!rq.bitmap)
+            return nullptr;
+
+        Thread* thread = rq.queues[__builtin_ctzll(rq.bitmap)].front();
+        unqueue(rq, thread);
+        return thread;
+    }
+
+    /*
+     * take a thread from the busiest other CPU. cold threads go first so the
+     * victim keeps the ones whose data is still in its caches; a hot one is
+     * only taken when the victim has more than it can run soon anyway
+     */
+    static Thread* steal()
+    {
+        const uint32_t self = cpu::id();
+        const uint32_t count = cpu::count();
+
+        RunQueue* victim = nullptr;
+        size_t most = 0;
+        for (uint32_t i = 1; i < count; i++)
+        {
+            RunQueue* rq = per_cpu_ptr(runqueue, (self + i) % count);
+            if (!rq->ready.load(MemoryOrder::ACQUIRE))
+                continue;
+
+            const size_t queued = rq->queued.load(MemoryOrder::RELAXED);
+            if (queued > most)
+            {
+                victim = rq;
+                most = queued;
+            }
+        }
+
+        /* try_lock only: we hold no lock here, but never wait on a remote queue from the idle path */
+        if (!victim || !victim->lock.try_lock())
+            return nullptr;
+
+        Thread* taken = nullptr;
+        const uint64_t now = victim->ticks.load(MemoryOrder::RELAXED);
+        for (uint64_t pending = victim->bitmap; pending && !taken; pending &= pending - 1)
+        {
+            for (Thread* thread : victim->queues[__builtin_ctzll(pending)])
+            {
+                if (now - thread->last_ran >= CACHE_HOT_TICKS)
+                {
+                    taken = thread;
+                    break;
+                }
+            }
+        }
+
+        if (!taken && victim->queued.load(MemoryOrder::RELAXED) > 1)
+            taken = victim->queues[__builtin_ctzll(victim->bitmap)].front();
+
+        if (taken)
+        {
+            unqueue(*victim, taken);
+            taken->cpu = self;
+        }
+
+        victim->lock.unlock();
+        return taken;
+    }
+
+    /* settle the thread we switched away from; runs first thing on the thread switched to */
+    static void finish_switch()
+    {
+        RunQueue& rq = local_rq();
+        Thread* prev = rq.prev;
+        rq.prev = nullptr;
+        switching_out[cpu::id()].store(nullptr, MemoryOrder::RELEASE);
+
+        if (!prev || prev == &rq.idle)
+            return;
+
+        if (prev->state == ThreadState::READY)
+        {
+            /* queued only now that its context is saved, so no other CPU can steal a half-switched thread */
+            rq.lock.lock();
+            enqueue(rq, prev);
+            rq.lock.unlock();
+        }
+        else if (prev->state == ThreadState::DEAD)
+        {
+            fpu::release(&prev->fpu);
+            kstack::free(prev->stack);
+            heap::free(prev);
+        }
+    }
+
+    /* switch to `next`; interrupts off and `rq.lock` held, which this drops */
+    static void switch_to(RunQueue& rq, Thread* next)
+    {
+        Thread* prev = rq.current;
+        if (next == prev)
+        {
+            prev->state = ThreadState::RUNNING;
+            rq.lock.unlock();
+            return;
+        }
+
+        prev->last_ran = rq.ticks.load(MemoryOrder::RELAXED);
+        next->state = ThreadState::RUNNING;
+        next->slice = SLICE_TICKS;
+        next->cpu = cpu::id();
+
+        if (next != &rq.idle)
+            rq.switches.store(rq.switches.load(MemoryOrder::RELAXED) + 1, MemoryOrder::RELAXED);
+
+        rq.current = next;
+        rq.prev = prev;
+        switching_out[next->cpu].store(prev, MemoryOrder::RELEASE);
+        rq.lock.unlock();
+
+        if (next == &rq.idle)
+            hrtimer::cancel(&rq.tick);
+        else if (!hrtimer::pending(&rq.tick))
+            hrtimer::start(&rq.tick, timer::now() + TICK_NS);
+
+        /* only the callee-saved GPRs go through the switch; FPU state moves only if it was used */
+        fpu::switch_out(&prev->fpu);
+        fpu::switch_in(&next->fpu);
+        if (next->stack)
+            cpu::set_kernel_stack(next->stack); /* syscalls and traps from user mode land on its own stack */
+        AddressSpace::set_hint(&next->vma_hint);
+        cpu::switch_context(&prev->sp, next->sp);
+
+        /* back on `prev`, possibly on another CPU */
+        finish_switch();
+    }
+
+    /* pick the next thread after the current one set its own state; same contract as `switch_to` */
+    static void schedule_locked(RunQueue& rq)
+    {
+        Thread* next = dequeue(rq);
+        if (!next)
+            next = rq.current->state == ThreadState::READY ? rq.current : &rq.idle;
+
+        switch_to(rq, next);
+    }
+
+    static void thread_start(void* arg)
+    {
+        finish_switch();
+        interrupt::enable();
+
+        auto* thread = static_cast<Thread*>(arg);
+        thread->entry(thread->arg);
+        Scheduler::exit();
+    }
+
+    static void tick_handler(HrTimer* timer)
+    {
+        /* re-arm first: the tick may switch threads, and the next one finds it running */
+        if (Scheduler::current() != &local_rq().idle)
+            hrtimer::start(timer, timer::now() + TICK_NS);
+
+        Scheduler::tick();
+    }
+
+    static void init_cpu()
+    {
+        RunQueue& rq = local_rq();
+
+        /* the copy carries the template's sentinel addresses */
+        for (RunList& list : rq.queues)
+            list.reset();
+
+        rq.idle.state = ThreadState::RUNNING;
+        rq.idle.priority = Scheduler::PRIORITIES - 1;
+        rq.idle.cpu = cpu::id();
+        rq.current = &rq.idle;
+        rq.tick = HrTimers::make(tick_handler);
+        rq.ready.store(true, MemoryOrder::RELEASE);
+    }
+
+    void Scheduler::init() noexcept
+    {
+        init_cpu();
+    }
+
+    Thread* Scheduler::spawn(void (*entry)(void*), void* arg, uint8_t priority) noexcept
+    {
+        if (priority >= PRIORITIES)
+            priority = PRIORITIES - 1;
+
+        auto* thread = static_cast<Thread*>(heap::allocate(sizeof(Thread)));
+        if (!thread)
+            return nullptr;
+
+        const uintptr_t stack = kstack::allocate();
+        if (!stack)
+        {
+            heap::free(thread);
+            return nullptr;
+        }
+
+        *thread = {
+            .sp = cpu::init_context(stack, thread_start, thread),
+            .stack = stack,
+            .node = {},
+            .entry = entry,
+            .arg = arg,
+            .id = next_id.fetch_add(1, MemoryOrder::RELAXED),
+            .priority = priority,
+            .state = ThreadState::READY,
+            .wake_pending = false,
+            .cpu = cpu::id(),
+            .slice = SLICE_TICKS,
+            .last_ran = 0,
+            .vma_hint = {},
+            .fpu = {}
+        };
+
+        const uint64_t state = interrupt::save();
+        RunQueue& rq = local_rq();
+        rq.lock.lock();
+        enqueue(rq, thread);
+        rq.lock.unlock();
+        interrupt::restore(state);
+
+        return thread;
+    }
+
+    void Scheduler::run() noexcept
+    {
+        if (!local_rq().ready.load(MemoryOrder::ACQUIRE))
+            init_cpu();
+
+        interrupt::disable();
+        while (true)
+        {
+            rcu::quiescent();
+
+            RunQueue& rq = local_rq();
+            rq.lock.lock();
+            if (rq.bitmap)
+            {
+                schedule_locked(rq);
+                continue;
+            }
+            rq.lock.unlock();
+
+            if (Thread* stolen = steal())
+            {
+                rq.steals.store(rq.steals.load(MemoryOrder::RELAXED) + 1, MemoryOrder::RELAXED);
+                rq.lock.lock();
+                switch_to(rq, stolen);
+                continue;
+            }
+
+            /*
+             * nothing to run here or elsewhere; sleep until the next interrupt.
+             * no tick unless RCU callbacks wait on this CPU's quiescent states
+             */
+            if (rcu::pending() && !hrtimer::pending(&rq.tick))
+                hrtimer::start(&rq.tick, timer::now() + TICK_NS);
+
+            rcu::idle_enter();
+            cpu::idle();
+            rcu::idle_exit();
+        }
+    }
+
+    void Scheduler::yield() noexcept
+    {
+        rcu::quiescent();
+
+        const uint64_t state = interrupt::save();
+        RunQueue& rq = local_rq();
+        rq.lock.lock();
+        rq.current->state = ThreadState::READY;
+        schedule_locked(rq);
+        interrupt::restore(state);
+    }
+
+    void Scheduler::block() noexcept
+    {
+        rcu::quiescent();
+
+        const uint64_t state = interrupt::save();
+        RunQueue& rq = local_rq();
+        rq.lock.lock();
+        if (rq.current->wake_pending)
+        {
+            rq.current->wake_pending = false;
+            rq.lock.unlock();
+            interrupt::restore(state);
+            return;
+        }
+
+        rq.current->state = ThreadState::BLOCKED;
+        schedule_locked(rq);
+        interrupt::restore(state);
+    }
+
+    void Scheduler::wake(Thread* thread) noexcept
+    {
+        const uint64_t state = interrupt::save();
+
+        /* its CPU only changes while it sits on a queue, under that queue's lock */
+        RunQueue* rq;
+        for (;;)
+        {
+            rq = per_cpu_ptr(runqueue, thread->cpu);
+            rq->lock.lock();
+            if (per_cpu_ptr(runqueue, thread->cpu) == rq)
+                break;
+            rq->lock.unlock();
+        }
+
+        if (thread->state == ThreadState::BLOCKED)
+        {
+            /* it may have set BLOCKED but not yet saved its registers */
+            while (switching_out[thread->cpu].load(MemoryOrder::ACQUIRE) == thread)
+                cpu_relax();
+
+            enqueue(*rq, thread);
+        }
+        else
+        {
+            thread->wake_pending = true; /* running or about to; its next `block` must not sleep */
+        }
+
+        /*
+         * an idle CPU has no tick and sits in `hlt`; nor would others steal a
+         * lone cache-hot thread from it, as its clock stops too. kick it.
+         * `current` only changes under the lock, so this cannot miss it going idle
+         */
+        const uint32_t target = thread->cpu;
+        const bool kick = thread->state == ThreadState::READY && rq->current == &rq->idle && target != cpu::id();
+
+        rq->lock.unlock();
+        if (kick)
+            interrupt::send_ipi(target, IPI_RESCHEDULE);
+        interrupt::restore(state);
+    }
+
+    void Scheduler::exit() noexcept
+    {
+        rcu::quiescent();
+
+        interrupt::disable();
+        RunQueue& rq = local_rq();
+        rq.lock.lock();
+        rq.current->state = ThreadState::DEAD;
+        schedule_locked(rq);
+
+        __builtin_unreachable(); /* freed by `finish_switch` on the next thread */
+    }
+
+    void Scheduler::tick() noexcept
+    {
+        RunQueue& rq = local_rq();
+        rq.ticks.fetch_add(1, MemoryOrder::RELAXED);
+
+        Thread* current = rq.current;
+        if (current == &rq.idle)
+            return; /* the idle loop looks for work as soon as this interrupt returns */
+
+        if (current->slice && --current->slice)
+            return;
+
+        /* a read-side section must not be switched away from; try again next tick */
+        if (rcu::in_read())
+            return;
+
+        yield();
+    }
+
+    Thread* Scheduler::current() noexcept
+    {
+        return local_rq().current;
+    }
+
+    SchedStats Scheduler::stats(uint32_t cpu) noexcept
+    {
+        RunQueue* rq = per_cpu_ptr(runqueue, cpu);
+        return { rq->switches.load(MemoryOrder::RELAXED), rq->steals.load(MemoryOrder::RELAXED) };
+    }
+}
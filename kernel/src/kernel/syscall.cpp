@@ -0,0 +1,39 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <kafka/syscall.hpp>
+#include <kernel/sched.hpp>
+#include <kafka/hal/cpu.hpp>
+
+namespace kfk
+{
+    static int64_t sys_yield(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t)
+    {
+        sched::yield();
+        return 0;
+    }
+
+    static int64_t sys_exit(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t)
+    {
+        sched::exit();
+    }
+
+    static int64_t sys_getcpu(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t)
+    {
+        return cpu::id();
+    }
+
+    static int64_t sys_gettid(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t)
+    {
+        return static_cast<int64_t>(sched::current()->id);
+    }
+
+    /* in `Syscall` order */
+    constexpr SyscallEntry syscall_table[SYSCALL_COUNT] = {
+        /* SYS_YIELD  */ { sys_yield, SYSCALL_FULL },
+        /* SYS_EXIT   */ { sys_exit, SYSCALL_FULL },
+        /* SYS_GETCPU */ { sys_getcpu, SYSCALL_FAST },
+        /* SYS_GETTID */ { sys_gettid, SYSCALL_FAST }
+    };
+}
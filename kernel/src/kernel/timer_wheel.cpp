@@ -0,0 +1,279 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic.hpp>
+#include <list.hpp>
+#include <kafka/percpu.hpp>
+#include <kernel/hrtimer.hpp>
+#include <kernel/timer_wheel.hpp>
+#include <kafka/hal/cpu.hpp>
+#include <kafka/hal/interrupt.hpp>
+#include <kafka/hal/timer.hpp>
+
+namespace kfk
+{
+    static constexpr uint32_t LEVEL_BITS = 6;
+    static constexpr uint32_t LEVEL_SIZE = 1U << LEVEL_BITS;
+    static constexpr uint64_t LEVEL_MASK = LEVEL_SIZE - 1;
+    static constexpr uint32_t LEVELS = 6;
+    static constexpr uint64_t MAX_DELTA = (1ULL << (LEVELS * LEVEL_BITS)) - 1; /* about two years; longer ones fire then */
+
+    static_assert(LEVEL_SIZE <= 64, "a level's occupancy bitmap is a single word");
+
+    using SlotList = List<Timeout, &Timeout::node>;
+
+    struct Wheel
+    {
+        Spinlock lock; /* always taken with interrupts off */
+        bool ready = false; /* slots reset for this CPU's copy; done on first use */
+        uint64_t clock = 0; /* next tick to process */
+        uint64_t armed = UINT64_MAX; /* tick `event` is set for; UINT64_MAX if none */
+        uint64_t occupied[LEVELS] = {}; /* bit n set while slots[level][n] is non-empty */
+        SlotList slots[LEVELS][LEVEL_SIZE];
+        HrTimer event;
+    };
+
+    PER_CPU static Wheel timer_wheel_base;
+
+    static uint64_t now_tick()
+    {
+        return timer::now() / TimerWheel::TICK_NS;
+    }
+
+    static void wheel_event(HrTimer*);
+
+    static Wheel& local_wheel()
+    {
+        Wheel& wheel = *this_cpu_ptr(timer_wheel_base);
+        if (!wheel.ready)
+        {
+            /* the copy carries the template's sentinel addresses */
+            for (auto& level : wheel.slots)
+                for (SlotList& list : level)
+                    list.reset();
+
+            wheel.event = HrTimers::make(wheel_event);
+            wheel.clock = now_tick();
+            wheel.ready = true;
+        }
+        return wheel;
+    }
+
+    static bool empty(const Wheel& wheel)
+    {
+        for (uint64_t bits : wheel.occupied)
+        {
+            if (bits)
+                return false;
+        }
+        return true;
+    }
+
+    /* file it by how far off it is: level n holds timeouts due within 64^(n+1) ticks */
+    static void insert(Wheel& wheel, Timeout* timeout)
+    {
+        if (timeout->expires < wheel.clock)
+            timeout->expires = wheel.clock; /* overdue; goes out with the next tick */
+        if (timeout->expires - wheel.clock > MAX_DELTA)
+            timeout->expires = wheel.clock + MAX_DELTA;
+
+        const uint64_t delta = timeout->expires - wheel.clock;
+        uint32_t level = 0;
+        while (level + 1 < LEVELS && delta >= 1ULL << ((level + 1) * LEVEL_BITS))
+            level++;
+
+        const uint32_t index = (timeout->expires >> (level * LEVEL_BITS)) & LEVEL_MASK;
+        timeout->slot = static_cast<uint16_t>(level * LEVEL_SIZE + index);
+        wheel.slots[level][index].push_back(timeout);
+        wheel.occupied[level] |= 1ULL << index;
+    }
+
+    static void unlink(Wheel& wheel, Timeout* timeout)
+    {
+        const uint32_t level = timeout->slot / LEVEL_SIZE;
+        const uint32_t index = timeout->slot % LEVEL_SIZE;
+
+        SlotList& list = wheel.slots[level][index];
+        list.remove(timeout);
+        if (list.empty())
+            wheel.occupied[level] &= ~(1ULL << index);
+    }
+
+    /* move a slot down now that its range has come close; none of it lands back in the same slot */
+    static void cascade(Wheel& wheel, uint32_t level, uint32_t index)
+    {
+        SlotList& list = wheel.slots[level][index];
+        while (Timeout* timeout = list.front())
+        {
+            list.remove(timeout);
+            insert(wheel, timeout);
+        }
+        wheel.occupied[level] &= ~(1ULL << index);
+    }
+
+    /*
+     * first tick that has work: a level 0 slot expiring or a higher one
+     * cascading. a slot cascades when the clock reaches the start of its range
+     * with every lower index at 0, which the occupancy bitmaps find in O(levels)
+     */
+    static uint64_t next_event(const Wheel& wheel)
+    {
+        uint64_t next = UINT64_MAX;
+        for (uint32_t level = 0; level < LEVELS; level++)
+        {
+            const uint64_t bits = wheel.occupied[level];
+            if (!bits)
+                continue;
+
+            const uint32_t shift = level * LEVEL_BITS;
+            const uint64_t base = wheel.clock >> shift;
+            const uint32_t current = base & LEVEL_MASK;
+
+            /* rotate so bit 0 is the current slot */
+            const uint64_t rotated = current ? (bits >> current) | (bits << (LEVEL_SIZE - current)) : bits;
+            uint64_t ahead = __builtin_ctzll(rotated);
+
+            /* the current slot already cascaded unless the clock sits right at its start */
+            if (!ahead && (wheel.clock & ((1ULL << shift) - 1)))
+                ahead = LEVEL_SIZE;
+
+            const uint64_t tick = (base + ahead) << shift;
+            if (tick < next)
+                next = tick;
+        }
+        return next;
+    }
+
+    /* set the hrtimer for the next event, if that moved; `wheel.lock` held */
+    static void arm_event(Wheel& wheel)
+    {
+        const uint64_t next = next_event(wheel);
+        if (next == wheel.armed)
+            return;
+
+        if (next == UINT64_MAX)
+        {
+            hrtimer::cancel(&wheel.event);
+            wheel.armed = UINT64_MAX;
+            return;
+        }
+
+        /* on failure the next `start` tries again */
+        wheel.armed = hrtimer::start(&wheel.event, next * TimerWheel::TICK_NS) ? next : UINT64_MAX;
+    }
+
+    /*
+     * process every tick up to `now`, skipping straight over stretches with
+     * nothing due, so a CPU that slept through a long idle catches up in a few
+     * steps. a slot's timeouts are taken off one at a time and run with the
+     * lock dropped, so they may re-arm themselves or be cancelled from elsewhere
+     */
+    static void advance(Wheel& wheel, uint64_t now)
+    {
+        while (wheel.clock <= now)
+        {
+            const uint64_t next = next_event(wheel);
+            if (next > now)
+            {
+                wheel.clock = now + 1;
+                return;
+            }
+            wheel.clock = next;
+
+            const uint32_t index = wheel.clock & LEVEL_MASK;
+            for (uint32_t level = 1; level < LEVELS; level++)
+            {
+                if ((wheel.clock >> ((level - 1) * LEVEL_BITS)) & LEVEL_MASK)
+                    break;
+                cascade(wheel, level, (wheel.clock >> (level * LEVEL_BITS)) & LEVEL_MASK);
+            }
+            wheel.clock++;
+
+            SlotList& list = wheel.slots[0][index];
+            while (Timeout* timeout = list.front())
+            {
+                unlink(wheel, timeout);
+                wheel.lock.unlock();
+                timeout->func(timeout);
+                wheel.lock.lock();
+            }
+        }
+    }
+
+    static void wheel_event(HrTimer*)
+    {
+        Wheel& wheel = local_wheel();
+        wheel.lock.lock();
+        wheel.armed = UINT64_MAX; /* it just fired */
+        advance(wheel, now_tick());
+        arm_event(wheel);
+        wheel.lock.unlock();
+    }
+
+    /* lock the wheel `timeout` is on; nullptr with nothing locked if it is not armed */
+    static Wheel* lock_wheel(Timeout* timeout)
+    {
+        while (true)
+        {
+            if (!TimerWheel::pending(timeout))
+                return nullptr;
+
+            /* it only moves between wheels while unarmed, so the lock settles it */
+            Wheel* wheel = per_cpu_ptr(timer_wheel_base, timeout->cpu);
+            wheel->lock.lock();
+            if (TimerWheel::pending(timeout) && per_cpu_ptr(timer_wheel_base, timeout->cpu) == wheel)
+                return wheel;
+            wheel->lock.unlock();
+        }
+    }
+
+    void TimerWheel::start(Timeout* timeout, uint64_t ns) noexcept
+    {
+        const uint64_t state = interrupt::save();
+
+        if (Wheel* old = lock_wheel(timeout))
+        {
+            unlink(*old, timeout);
+            old->lock.unlock();
+        }
+
+        Wheel& wheel = local_wheel();
+        wheel.lock.lock();
+
+        /* an empty wheel's clock stops while the CPU is tickless; bring it up to date instead of walking it there */
+        const uint64_t now = timer::now();
+        if (empty(wheel) && wheel.clock < now / TICK_NS)
+            wheel.clock = now / TICK_NS;
+
+        /* round the deadline up so it never fires early */
+        timeout->expires = (now + ns + TICK_NS - 1) / TICK_NS;
+        timeout->cpu = cpu::id();
+        insert(wheel, timeout);
+        arm_event(wheel);
+
+        wheel.lock.unlock();
+        interrupt::restore(state);
+    }
+
+    bool TimerWheel::cancel(Timeout* timeout) noexcept
+    {
+        const uint64_t state = interrupt::save();
+
+        /* its wheel's hrtimer may still fire for it; the wheel then finds nothing due and moves on */
+        Wheel* wheel = lock_wheel(timeout);
+        if (wheel)
+        {
+            unlink(*wheel, timeout);
+            wheel->lock.unlock();
+        }
+
+        interrupt::restore(state);
+        return wheel != nullptr;
+    }
+
+    bool TimerWheel::pending(const Timeout* timeout) noexcept
+    {
+        return timeout->node.next != nullptr;
+    }
+}
@@ -0,0 +1,112 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic.hpp>
+#include <kafka/hal/vmem.hpp>
+
+namespace kfk
+{
+    class VmObject;
+
+    /* a mapped range of an address space; also its node in the VMA tree */
+    struct Vma
+    {
+        uintptr_t start;
+        uintptr_t end;
+        VmmFlags prot; /* PROT_* */
+        VmmFlags flags; /* MAP_SHARED or MAP_PRIVATE */
+        VmObject* object; /* one reference held per VMA */
+        size_t offset; /* of `start` into `object` */
+
+        /* AVL links keyed on `start`; VMAs never overlap so this orders them by `end` too */
+        Vma* left;
+        Vma* right;
+        int height;
+    };
+
+    /*
+     * a thread's last VMA lookup, kept with the thread so threads faulting in
+     * the same space do not share one cache. only trusted while `generation`
+     * still matches its space's: VMAs it may point at have not been freed since
+     */
+    struct VmaHint
+    {
+        Vma* vma = nullptr;
+        uint64_t generation = 0;
+    };
+
+    /*
+     * a user address space: the top-level page table plus the VMAs describing
+     * what may live in it. pages are only populated when first touched, through
+     * `fault`, so the VMAs are the source of truth and the page tables a cache
+     */
+    class AddressSpace
+    {
+    public:
+        static AddressSpace* create() noexcept;
+
+        /* tear the space down; it must not be the loaded one */
+        void destroy() noexcept;
+
+        void activate() noexcept;
+
+        /* the space loaded on this CPU or nullptr while running on the kernel one */
+        static AddressSpace* current() noexcept;
+
+        /*
+         * map `len` bytes of `object` starting at `offset`. MAP_SHARED mappings
+         * see each other's writes; MAP_PRIVATE ones copy a page on its first
+         * write. without MAP_FIXED `addr` is only a hint. a null `object` needs
+         * MAP_ANONYMOUS and gets a fresh zero-filled one. nothing is populated
+         * until first touched; returns the address or 0
+         */
+        uintptr_t mmap(uintptr_t addr, size_t len, VmmFlags prot, VmmFlags flags, VmObject* object,
+                       size_t offset) noexcept;
+
+        void munmap(uintptr_t addr, size_t len) noexcept;
+
+        /* resolve a fault on a page that is not present; false if no VMA allows the access */
+        bool fault(uintptr_t addr, bool write) noexcept;
+
+        /* VMA containing `addr` or nullptr; call with the space locked */
+        Vma* find_vma(uintptr_t addr) noexcept;
+
+        /* hint `find_vma` starts from on this CPU; the scheduler hands it the running thread's */
+        static void set_hint(VmaHint* hint) noexcept;
+
+        /*
+         * taken with interrupts off, and by the #PF handler for demand and
+         * copy-on-write faults. so nothing may touch this space's user memory
+         * while holding it: that fault would spin on the lock its own CPU
+         * holds. a holder may wait on a TLB shootdown, so waiters keep
+         * answering those while they spin
+         */
+        void lock() noexcept;
+
+        void unlock() noexcept;
+
+        /* resident pages, split by whether they are shared with other mappings */
+        [[nodiscard]] size_t rss_private() const noexcept;
+
+        [[nodiscard]] size_t rss_shared() const noexcept;
+
+        [[nodiscard]] uintptr_t ptb() const noexcept;
+
+    private:
+        uintptr_t root; /* physical address of the top-level table */
+        Vma* tree;
+        uint64_t generation; /* replaced whenever VMAs may have been freed, so older hints miss */
+        size_t resident_private;
+        size_t resident_shared;
+        Spinlock lock_word;
+        uint64_t irq_state; /* interrupt state `lock` saved; only touched by the holder */
+
+        /* false if it ran out of memory splitting a VMA */
+        bool unmap_locked(uintptr_t start, uintptr_t end) noexcept;
+
+        uintptr_t find_gap(size_t len, uintptr_t hint) noexcept;
+    };
+}
@@ -0,0 +1,30 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace kfk
+{
+    /*
+     * kernel stacks carved out of the vmalloc area. each one sits above an
+     * unmapped guard page, so running off the bottom faults instead of quietly
+     * corrupting whatever lies below. freed stacks stay mapped in a per-CPU
+     * cache for the next thread
+     */
+    class KernelStack
+    {
+    public:
+        static constexpr size_t PAGES = 4;
+        static constexpr size_t SIZE = PAGES * 4096;
+
+        /* top of a stack ready to be loaded into rsp, or 0 */
+        static uintptr_t allocate() noexcept;
+
+        /* give back a stack by the top `allocate` returned */
+        static void free(uintptr_t top) noexcept;
+    };
+
+    using kstack = KernelStack;
+}
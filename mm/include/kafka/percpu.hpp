@@ -0,0 +1,117 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <kafka/hal/cpu.hpp>
+
+/*
+ * per-CPU variables. everything marked PER_CPU is linked into `.percpu`, which
+ * only serves as the template: each CPU gets a copy of the section and its
+ * thread pointer (GS base on x86_64) is set to `copy - __percpu_start`. a
+ * variable's link address then doubles as its offset, so `%gs:var` reaches
+ * this CPU's instance in one instruction. until `PerCpu::setup` has run the
+ * thread pointer is 0 and the accessors hit the template itself
+ */
+#define PER_CPU __attribute__((section(".percpu")))
+
+extern "C" char __percpu_start[];
+extern "C" char __percpu_end[];
+
+namespace kfk
+{
+    class PerCpu
+    {
+    public:
+        /* allocate CPU `id`'s copy of the section; returns the value for its thread pointer, 0 if out of memory */
+        static uintptr_t setup(uint32_t id) noexcept;
+
+        /* thread pointer value of CPU `id`, as `setup` returned it */
+        static uintptr_t offset(uint32_t id) noexcept;
+    };
+
+    using percpu = PerCpu;
+
+    /* this CPU's thread pointer; kept in every copy so reading it is one load */
+    extern PER_CPU uintptr_t this_cpu_off;
+
+#if defined(__x86_64__)
+    /*
+     * plain loads and read-modify-writes through GS. a single instruction cannot
+     * be split by an interrupt, so these need no lock prefix as long as only the
+     * owning CPU writes the variable. `T` must be an integer or pointer of 1 to 8 bytes
+     */
+    template<typename T>
+    inline T this_cpu_read(T& var) noexcept
+    {
+        T value;
+        asm volatile("mov %%gs:%1, %0" : "=r"(value) : "m"(var));
+        return value;
+    }
+
+    template<typename T>
+    inline void this_cpu_write(T& var, T value) noexcept
+    {
+        asm volatile("mov %1, %%gs:%0" : "=m"(var) : "r"(value) : "memory");
+    }
+
+    template<typename T>
+    inline void this_cpu_add(T& var, T value) noexcept
+    {
+        asm volatile("add %1, %%gs:%0" : "+m"(var) : "r"(value) : "memory");
+    }
+
+    template<typename T>
+    inline void this_cpu_sub(T& var, T value) noexcept
+    {
+        asm volatile("sub %1, %%gs:%0" : "+m"(var) : "r"(value) : "memory");
+    }
+#else
+    inline uintptr_t thread_pointer() noexcept
+    {
+        uintptr_t value;
+        asm volatile("mrs %0, tpidr_el1" : "=r"(value));
+        return value;
+    }
+
+    template<typename T>
+    inline T this_cpu_read(T& var) noexcept
+    {
+        return *reinterpret_cast<volatile T*>(thread_pointer() + reinterpret_cast<uintptr_t>(&var));
+    }
+
+    template<typename T>
+    inline void this_cpu_write(T& var, T value) noexcept
+    {
+        *reinterpret_cast<volatile T*>(thread_pointer() + reinterpret_cast<uintptr_t>(&var)) = value;
+    }
+
+    /* not interrupt-safe here; callers that need that must disable interrupts around it */
+    template<typename T>
+    inline void this_cpu_add(T& var, T value) noexcept
+    {
+        this_cpu_write(var, static_cast<T>(this_cpu_read(var) + value));
+    }
+
+    template<typename T>
+    inline void this_cpu_sub(T& var, T value) noexcept
+    {
+        this_cpu_write(var, static_cast<T>(this_cpu_read(var) - value));
+    }
+#endif
+
+    /* this CPU's instance of `var`; only stable while the thread cannot migrate */
+    template<typename T>
+    inline T* this_cpu_ptr(T& var) noexcept
+    {
+        return reinterpret_cast<T*>(this_cpu_read(this_cpu_off) + reinterpret_cast<uintptr_t>(&var));
+    }
+
+    /* CPU `id`'s instance of `var` */
+    template<typename T>
+    inline T* per_cpu_ptr(T& var, uint32_t id) noexcept
+    {
+        return reinterpret_cast<T*>(PerCpu::offset(id) + reinterpret_cast<uintptr_t>(&var));
+    }
+}
@@ -1,10 +1,23 @@
 /* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
 
+#pragma once
+
+#include <stddef.h>
 #include <stdint.h>
 #include <limine.h>
 
 namespace kfk
 {
+    /* per-frame metadata; indexed by physical frame number */
+    struct PageFrame
+    {
+        uint32_t refs; /* sharers beyond the owner; 0 means the frame is exclusively owned */
+        uint16_t live; /* present entries while the frame backs a page table */
+        uint16_t flags;
+
+        static constexpr uint16_t PAGE_TABLE = 0x1; /* owned by the page-table pool */
+    };
+
     class PhysicalPageManager
     {
     public:
@@ -14,8 +27,23 @@ namespace kfk
 
         static void pfree(uintptr_t base, uint64_t n = 1) noexcept;
 
+        /* free a gathered list of single frames; sorts `frames` and releases each contiguous run at once */
+        static void pfree_batch(uintptr_t* frames, size_t count) noexcept;
+
         static void* phys_to_virt(uintptr_t phys) noexcept;
 
+        /* metadata of the frame containing `phys` or nullptr if it is not managed memory */
+        static PageFrame* frame(uintptr_t phys) noexcept;
+
+        /* take an extra reference on a shared frame */
+        static void pget(uintptr_t phys) noexcept;
+
+        /* drop a reference; frees the frame and returns true once the last one is gone. unmanaged frames are left alone */
+        static bool pput(uintptr_t phys) noexcept;
+
+        /* `pput` a gathered list; frames whose last reference goes are freed through `pfree_batch` */
+        static void pput_batch(uintptr_t* frames, size_t count) noexcept;
+
         static void dynamic_mode() noexcept;
     };
     
@@ -0,0 +1,85 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic.hpp>
+
+namespace kfk
+{
+    /* embedded in objects freed through `Rcu::call`; `func` gets it back once no reader can see the object */
+    struct RcuHead
+    {
+        RcuHead* next;
+        void (*func)(RcuHead*);
+    };
+
+    /*
+     * quiescent-state-based read-copy-update. readers run between `read_lock`
+     * and `read_unlock` without any lock or atomic; writers publish a new
+     * version with a release store and retire the old one with `call` or
+     * `synchronize`. a grace period ends once every CPU has passed through a
+     * quiescent state, i.e. called `quiescent` from outside any read-side
+     * section; the context switch and the idle loop are where that happens
+     */
+    class Rcu
+    {
+    public:
+        /*
+         * read-side section; may nest but must not sleep or switch context.
+         * interrupt handlers are read-side sections by construction
+         */
+        static void read_lock() noexcept;
+
+        static void read_unlock() noexcept;
+
+        /* true inside a read-side section; the scheduler must not preempt then */
+        static bool in_read() noexcept;
+
+        /* wait for every reader that might still see the old version; not from a read-side section */
+        static void synchronize() noexcept;
+
+        /* run `func(head)` after a grace period; callbacks are batched per CPU. usable from IRQ context */
+        static void call(RcuHead* head, void (*func)(RcuHead*)) noexcept;
+
+        /* report a quiescent state for this CPU and run the callbacks whose grace period has ended */
+        static void quiescent() noexcept;
+
+        /* true while this CPU has callbacks queued; it must keep waking up to push them through */
+        static bool pending() noexcept;
+
+        /*
+         * an idle CPU is in an extended quiescent state: grace periods do not
+         * wait for it, so a halted CPU holds nobody up. no read-side sections in between
+         */
+        static void idle_enter() noexcept;
+
+        static void idle_exit() noexcept;
+
+        /*
+         * bracket every interrupt handler. an interrupt that wakes an idle CPU
+         * is a reader like any other, so the CPU leaves its extended quiescent
+         * state for the handler's duration and grace periods wait for it again
+         */
+        static void irq_enter() noexcept;
+
+        static void irq_exit() noexcept;
+    };
+
+    using rcu = Rcu;
+
+    /* read an RCU-published pointer; a plain load on every arch we run on */
+    template<typename T>
+    T* rcu_dereference(Atomic<T*>& ptr) noexcept
+    {
+        return ptr.load(MemoryOrder::ACQUIRE);
+    }
+
+    /* publish `value` once it is fully initialised; returns the version it replaced */
+    template<typename T>
+    T* rcu_assign_pointer(Atomic<T*>& ptr, T* value) noexcept
+    {
+        return ptr.exchange(value, MemoryOrder::ACQ_REL);
+    }
+}
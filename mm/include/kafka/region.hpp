@@ -49,6 +49,42 @@ namespace kfk
         static void merge_adjacent() noexcept;
         
         static bool split(Region* region, size_t offset) noexcept;
+
+        /*
+         * mark [base, base + len) free and merge it with its free neighbours only.
+         * the range may span several used regions (adjacent allocations freed
+         * together), but all of it must be in use; nothing is released otherwise
+         */
+        static bool release(uintptr_t base, size_t len) noexcept;
+
+        /*
+         * make room for `n` more regions under a caller's `lock`, so that `split`
+         * and `release` never grow while it is held. growing allocates from the
+         * heap, which can come back here for pages, so the lock is dropped around
+         * the allocation and the new array swapped in once it is taken again
+         */
+        template<typename Lock>
+        static bool reserve(size_t n, Lock& lock) noexcept
+        {
+            while (count + n > capacity)
+            {
+                const size_t wanted = count + n > capacity * 2 ? count + n : capacity * 2;
+
+                lock.unlock();
+                auto* fresh = static_cast<Region*>(region_alloc.allocate(wanted * sizeof(Region)));
+                lock.lock();
+                if (!fresh)
+                    return false;
+
+                /* another CPU may have grown it meanwhile; then ours is the one to drop */
+                Region* stale = wanted > capacity ? adopt(fresh, wanted) : fresh;
+
+                lock.unlock();
+                region_alloc.free(stale);
+                lock.lock();
+            }
+            return true;
+        }
         
         static void dump() noexcept;
 
@@ -62,5 +98,16 @@ namespace kfk
         static size_t count;
 
         static bool grow(size_t new_capacity) noexcept;
+
+        /* switch to the larger `fresh` array; returns the old one for the caller to free */
+        static Region* adopt(Region* fresh, size_t new_capacity) noexcept;
+
+        /* index of the region containing `addr` or `count` */
+        static size_t locate(uintptr_t addr) noexcept;
+
+        static void remove(size_t index) noexcept;
+
+        /* `release` for a range inside the single used region at `index` */
+        static bool release_in(size_t index, uintptr_t base, size_t len) noexcept;
     };
 }
@@ -0,0 +1,31 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <kafka/vdso.hpp>
+
+namespace kfk
+{
+    class AddressSpace;
+
+    /* kernel side of the vDSO data page; see kafka/vdso.hpp for the layout */
+    class VdsoPage
+    {
+    public:
+        /* allocate the page; needs the heap */
+        static bool init() noexcept;
+
+        /* map it read-only at VDSO_DATA_ADDRESS; false if out of memory */
+        static bool map(AddressSpace* space) noexcept;
+
+        /* tell the user library it may use more; flags are never taken back */
+        static void add_flags(uint32_t flags) noexcept;
+
+        /* new clock parameters; seqlock writer, so only one CPU may call it at a time */
+        static void update_clock(uint64_t base_tsc, uint64_t base_ns, uint64_t mult, uint32_t shift) noexcept;
+    };
+
+    using vdso = VdsoPage;
+}
@@ -0,0 +1,37 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic.hpp>
+
+namespace kfk
+{
+    /*
+     * page cache of a mappable object. the object owns one reference on every
+     * frame it has populated and each mapping takes another through `pmm::pget`,
+     * so frames outlive the object for as long as something still maps them
+     */
+    class VmObject
+    {
+    public:
+        /* anonymous zero-filled object of `size` bytes; pages are only allocated once touched */
+        static VmObject* create(size_t size) noexcept;
+
+        void get() noexcept;
+
+        /* drop a reference; the last one releases the object and its own frame references */
+        void put() noexcept;
+
+        /* frame backing byte `offset`, populated on first use; 0 past the end or out of memory */
+        uintptr_t page(size_t offset) noexcept;
+
+        [[nodiscard]] size_t size() const noexcept;
+
+    private:
+        uintptr_t* pages; /* physical frames by page index, 0 while not populated */
+        size_t page_count;
+        Atomic<uint32_t> refs;
+    };
+}
@@ -0,0 +1,497 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm.hpp>
+#include <string.hpp>
+#include <kafka/aspace.hpp>
+#include <kafka/heap.hpp>
+#include <kafka/percpu.hpp>
+#include <kafka/pmem.hpp>
+#include <kafka/vdso_page.hpp>
+#include <kafka/vmobject.hpp>
+#include <kafka/hal/interrupt.hpp>
+#include <kafka/hal/simd.hpp>
+#include <kafka/hal/vmem.hpp>
+
+namespace kfk
+{
+    static constexpr size_t PAGE_SIZE = 4096;
+
+    /* mappings go above this unless MAP_FIXED says otherwise; keeps low memory for the program image */
+    static constexpr uintptr_t MMAP_BASE = 1ULL << 30;
+
+    PER_CPU static AddressSpace* current_space = nullptr; /* the #PF handler resolves against this CPU's own */
+    PER_CPU static VmaHint* current_hint = nullptr; /* the running thread's */
+
+    /* unique across spaces, so a hint never matches a space other than the one it came from; 0 is never handed out */
+    static Atomic<uint64_t> next_generation(1);
+
+    /* VMA tree; an AVL tree keyed on `start` */
+    static int height(const Vma* node)
+    {
+        return node ? node->height : 0;
+    }
+
+    static void update(Vma* node)
+    {
+        node->height = 1 + max(height(node->left), height(node->right));
+    }
+
+    static Vma* rotate_right(Vma* node)
+    {
+        Vma* pivot = node->left;
+        node->left = pivot->right;
+        pivot->right = node;
+        update(node);
+        update(pivot);
+        return pivot;
+    }
+
+    static Vma* rotate_left(Vma* node)
+    {
+        Vma* pivot = node->right;
+        node->right = pivot->left;
+        pivot->left = node;
+        update(node);
+        update(pivot);
+        return pivot;
+    }
+
+    static Vma* rebalance(Vma* node)
+    {
+        update(node);
+
+        const int balance = height(node->left) - height(node->right);
+        if (balance > 1)
+        {
+            if (height(node->left->left) < height(node->left->right))
+                node->left = rotate_left(node->left);
+            return rotate_right(node);
+        }
+
+        if (balance < -1)
+        {
+            if (height(node->right->right) < height(node->right->left))
+                node->right = rotate_right(node->right);
+            return rotate_left(node);
+        }
+
+        return node;
+    }
+
+    static Vma* insert(Vma* node, Vma* vma)
+    {
+        if (!node)
+            return vma;
+
+        if (vma->start < node->start)
+            node->left = insert(node->left, vma);
+        else
+            node->right = insert(node->right, vma);
+
+        return rebalance(node);
+    }
+
+    static Vma* remove_min(Vma* node, Vma*& min)
+    {
+        if (!node->left)
+        {
+            min = node;
+            return node->right;
+        }
+
+        node->left = remove_min(node->left, min);
+        return rebalance(node);
+    }
+
+    static Vma* remove(Vma* node, uintptr_t start)
+    {
+        if (!node)
+            return nullptr;
+
+        if (start < node->start)
+        {
+            node->left = remove(node->left, start);
+        }
+        else if (start > node->start)
+        {
+            node->right = remove(node->right, start);
+        }
+        else
+        {
+            if (!node->left)
+                return node->right;
+            if (!node->right)
+                return node->left;
+
+            /* replace the node with its successor */
+            Vma* successor = nullptr;
+            Vma* right = remove_min(node->right, successor);
+            successor->left = node->left;
+            successor->right = right;
+            return rebalance(successor);
+        }
+
+        return rebalance(node);
+    }
+
+    /* lowest VMA ending above `addr`, i.e. the one containing it or the next one up */
+    static Vma* first_ending_after(Vma* node, uintptr_t addr)
+    {
+        Vma* best = nullptr;
+        while (node)
+        {
+            if (node->end > addr)
+            {
+                best = node;
+                node = node->left;
+            }
+            else
+            {
+                node = node->right;
+            }
+        }
+        return best;
+    }
+
+    static void release_tree(Vma* node)
+    {
+        if (!node)
+            return;
+
+        release_tree(node->left);
+        release_tree(node->right);
+        node->object->put();
+        heap::free(node);
+    }
+
+    AddressSpace* AddressSpace::create() noexcept
+    {
+        const uintptr_t root = vmm::create_ptb();
+        if (!root)
+            return nullptr;
+
+        auto* space = static_cast<AddressSpace*>(heap::allocate(sizeof(AddressSpace)));
+        if (!space)
+        {
+            vmm::destroy_ptb(root);
+            return nullptr;
+        }
+
+        space->root = root;
+        space->tree = nullptr;
+        space->generation = next_generation.fetch_add(1, MemoryOrder::RELAXED);
+        space->resident_private = 0;
+        space->resident_shared = 0;
+        space->lock_word.unlock(); /* raw heap memory; put the lock in its released state */
+
+        if (!vdso::map(space))
+        {
+            space->destroy();
+            return nullptr;
+        }
+
+        return space;
+    }
+
+    void AddressSpace::destroy() noexcept
+    {
+        /* the page tables are released in one pass over the tables that exist, not VMA by VMA */
+        release_tree(tree);
+        vmm::destroy_ptb(root);
+        heap::free(this);
+    }
+
+    void AddressSpace::activate() noexcept
+    {
+        vmm::switch_ptb(root);
+        this_cpu_write(current_space, this);
+    }
+
+    AddressSpace* AddressSpace::current() noexcept
+    {
+        return this_cpu_read(current_space);
+    }
+
+    uintptr_t AddressSpace::mmap(uintptr_t addr, size_t len, VmmFlags prot, VmmFlags flags, VmObject* object,
+                                 size_t offset) noexcept
+    {
+        const bool shared = flags & static_cast<uint64_t>(VmmFlags::MAP_SHARED);
+        const bool priv = flags & static_cast<uint64_t>(VmmFlags::MAP_PRIVATE);
+        if (len == 0 || shared == priv || (offset & (PAGE_SIZE - 1)))
+            return 0;
+
+        len = (len + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+        if (object)
+        {
+            if (offset > object->size() || len > object->size() - offset)
+                return 0;
+            object->get();
+        }
+        else
+        {
+            if (!(flags & static_cast<uint64_t>(VmmFlags::MAP_ANONYMOUS)))
+                return 0;
+
+            object = VmObject::create(len);
+            if (!object)
+                return 0;
+            offset = 0;
+        }
+
+        auto* vma = static_cast<Vma*>(heap::allocate(sizeof(Vma)));
+        if (!vma)
+        {
+            object->put();
+            return 0;
+        }
+
+        lock();
+
+        uintptr_t start = 0;
+        const uintptr_t top = vmm::user_limit();
+        if (flags & static_cast<uint64_t>(VmmFlags::MAP_FIXED))
+        {
+            if (!(addr & (PAGE_SIZE - 1)) && addr < top && len <= top - addr)
+            {
+                /* MAP_FIXED replaces whatever was there */
+                if (unmap_locked(addr, addr + len))
+                    start = addr;
+            }
+        }
+        else
+        {
+            const uintptr_t hint = (addr >= MMAP_BASE && addr < top) ? addr & ~(PAGE_SIZE - 1) : MMAP_BASE;
+            start = find_gap(len, hint);
+            if (!start && hint != MMAP_BASE)
+                start = find_gap(len, MMAP_BASE);
+        }
+
+        if (!start)
+        {
+            unlock();
+            heap::free(vma);
+            object->put();
+            return 0;
+        }
+
+        /* PROT_NONE is fine here; it reserves the range and every access faults */
+        *vma = {
+            .start = start,
+            .end = start + len,
+            .prot = prot & (VmmFlags::PROT_READ | VmmFlags::PROT_WRITE | VmmFlags::PROT_EXEC),
+            .flags = flags & (VmmFlags::MAP_SHARED | VmmFlags::MAP_PRIVATE),
+            .object = object,
+            .offset = offset,
+            .left = nullptr,
+            .right = nullptr,
+            .height = 1
+        };
+        tree = insert(tree, vma);
+
+        unlock();
+        return start;
+    }
+
+    void AddressSpace::munmap(uintptr_t addr, size_t len) noexcept
+    {
+        len = (len + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        if ((addr & (PAGE_SIZE - 1)) || addr + len < addr)
+            return;
+
+        lock();
+        unmap_locked(addr, addr + len);
+        unlock();
+    }
+
+    bool AddressSpace::unmap_locked(uintptr_t start, uintptr_t end) noexcept
+    {
+        generation = next_generation.fetch_add(1, MemoryOrder::RELAXED);
+
+        while (Vma* vma = first_ending_after(tree, start))
+        {
+            if (vma->start >= end)
+                break;
+
+            const uintptr_t from = max(vma->start, start);
+            const uintptr_t to = min(vma->end, end);
+
+            /* a hole in the middle needs a second VMA; allocate it before anything is torn down */
+            Vma* tail = nullptr;
+            if (from != vma->start && to != vma->end)
+            {
+                tail = static_cast<Vma*>(heap::allocate(sizeof(Vma)));
+                if (!tail)
+                    return false; /* out of memory; the rest of the range stays mapped */
+            }
+
+            const size_t dropped = vmm::unmap_user(root, from, to - from);
+            size_t& resident = (vma->flags & static_cast<uint64_t>(VmmFlags::MAP_SHARED)) ? resident_shared
+                                                                                         : resident_private;
+            resident -= min(dropped, resident);
+
+            if (from == vma->start && to == vma->end)
+            {
+                tree = remove(tree, vma->start);
+                vma->object->put();
+                heap::free(vma);
+            }
+            else if (from == vma->start)
+            {
+                /* moving `start` up keeps the tree ordered since VMAs never overlap */
+                vma->offset += to - vma->start;
+                vma->start = to;
+            }
+            else if (to == vma->end)
+            {
+                vma->end = from;
+            }
+            else
+            {
+                *tail = *vma;
+                tail->start = to;
+                tail->offset += to - vma->start;
+                tail->left = tail->right = nullptr;
+                tail->height = 1;
+                tail->object->get();
+
+                vma->end = from;
+                tree = insert(tree, tail);
+            }
+        }
+
+        return true;
+    }
+
+    uintptr_t AddressSpace::find_gap(size_t len, uintptr_t hint) noexcept
+    {
+        const uintptr_t top = vmm::user_limit();
+
+        uintptr_t candidate = hint;
+        while (candidate < top && len <= top - candidate)
+        {
+            const Vma* next = first_ending_after(tree, candidate);
+            if (!next || next->start >= candidate + len)
+                return candidate;
+
+            candidate = next->end;
+        }
+
+        return 0;
+    }
+
+    Vma* AddressSpace::find_vma(uintptr_t addr) noexcept
+    {
+        /* faults come in runs over the same VMA */
+        VmaHint* hint = this_cpu_read(current_hint);
+        if (hint && hint->generation == generation && hint->vma->start <= addr && addr < hint->vma->end)
+            return hint->vma;
+
+        Vma* node = tree;
+        while (node)
+        {
+            if (addr < node->start)
+            {
+                node = node->left;
+            }
+            else if (addr >= node->end)
+            {
+                node = node->right;
+            }
+            else
+            {
+                if (hint)
+                    *hint = { node, generation };
+                return node;
+            }
+        }
+
+        return nullptr;
+    }
+
+    void AddressSpace::set_hint(VmaHint* hint) noexcept
+    {
+        this_cpu_write(current_hint, hint);
+    }
+
+    bool AddressSpace::fault(uintptr_t addr, bool write) noexcept
+    {
+        lock();
+
+        Vma* vma = find_vma(addr);
+        const uint64_t access = static_cast<uint64_t>(write ? VmmFlags::PROT_WRITE : VmmFlags::PROT_READ);
+        if (!vma || !(vma->prot & access))
+        {
+            unlock();
+            return false;
+        }
+
+        const uintptr_t page = addr & ~(PAGE_SIZE - 1);
+        const bool shared = vma->flags & static_cast<uint64_t>(VmmFlags::MAP_SHARED);
+
+        bool mapped = false;
+        if (const uintptr_t phys = vma->object->page(vma->offset + (page - vma->start)))
+        {
+            if (write && !shared)
+            {
+                /* private write; copy right away instead of mapping COW and faulting a second time */
+                if (const uintptr_t copy = pmm::pmalloc(1))
+                {
+                    simd::copy_pages(pmm::phys_to_virt(copy), pmm::phys_to_virt(phys), 1);
+                    mapped = vmm::map_user(root, page, copy, vma->prot);
+                    if (!mapped)
+                        pmm::pput(copy);
+                }
+            }
+            else
+            {
+                pmm::pget(phys);
+                mapped = vmm::map_user(root, page, phys, vma->prot | vma->flags);
+                if (!mapped)
+                    pmm::pput(phys);
+            }
+        }
+
+        if (mapped)
+            (shared ? resident_shared : resident_private)++;
+
+        unlock();
+        return mapped;
+    }
+
+    void AddressSpace::lock() noexcept
+    {
+        /* interrupts off, so a holder is never preempted while a #PF on its CPU spins on it */
+        const uint64_t state = interrupt::save();
+        while (!lock_word.try_lock())
+        {
+            vmm::flush_pending();
+            cpu_relax();
+        }
+        irq_state = state;
+    }
+
+    void AddressSpace::unlock() noexcept
+    {
+        const uint64_t state = irq_state;
+        lock_word.unlock();
+        interrupt::restore(state);
+    }
+
+    size_t AddressSpace::rss_private() const noexcept
+    {
+        return resident_private;
+    }
+
+    size_t AddressSpace::rss_shared() const noexcept
+    {
+        return resident_shared;
+    }
+
+    uintptr_t AddressSpace::ptb() const noexcept
+    {
+        return root;
+    }
+}
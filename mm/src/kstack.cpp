@@ -0,0 +1,127 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic.hpp>
+#include <kafka/kstack.hpp>
+#include <kafka/percpu.hpp>
+#include <kafka/pmem.hpp>
+#include <kafka/hal/interrupt.hpp>
+#include <kafka/hal/vmem.hpp>
+
+namespace kfk
+{
+    static constexpr size_t PAGE_SIZE = 4096;
+    static constexpr size_t GUARD_PAGES = 1;
+    static constexpr size_t SLOT_SIZE = (GUARD_PAGES + KernelStack::PAGES) * PAGE_SIZE;
+
+    static constexpr size_t CACHE_SIZE = 8; /* mapped stacks kept per CPU */
+    static constexpr size_t FREE_SLOTS = 256; /* unmapped slots remembered for reuse */
+
+    struct StackCache
+    {
+        uintptr_t stacks[CACHE_SIZE]; /* slot bases */
+        size_t count;
+    };
+
+    PER_CPU static StackCache cache = {};
+
+    /* vmalloc slots; handed out bottom up, unmapped ones are recycled */
+    static uintptr_t next_slot = 0;
+    static uintptr_t area_end = 0;
+    static uintptr_t free_slots[FREE_SLOTS] = {};
+    static size_t free_slot_count = 0;
+    static IrqSpinlock slot_lock; /* guards the slot globals above */
+
+    static StackCache& local_cache()
+    {
+        return *this_cpu_ptr(cache);
+    }
+
+    static uintptr_t take_slot()
+    {
+        LockGuard<IrqSpinlock> guard(slot_lock);
+        if (free_slot_count)
+            return free_slots[--free_slot_count];
+
+        if (!next_slot)
+        {
+            const MemoryRegion area = vmm::area(KernelArea::VMALLOC);
+            next_slot = area.start;
+            area_end = area.end;
+        }
+
+        if (area_end - next_slot < SLOT_SIZE)
+            return 0;
+
+        const uintptr_t slot = next_slot;
+        next_slot += SLOT_SIZE;
+        return slot;
+    }
+
+    static void put_slot(uintptr_t slot)
+    {
+        vmm::unmap_kernel(slot + GUARD_PAGES * PAGE_SIZE, KernelStack::SIZE);
+
+        /* past this the VA is simply not reused; the area is large enough to not care */
+        LockGuard<IrqSpinlock> guard(slot_lock);
+        if (free_slot_count < FREE_SLOTS)
+            free_slots[free_slot_count++] = slot;
+    }
+
+    uintptr_t KernelStack::allocate() noexcept
+    {
+        /* interrupts off so the thread stays on the CPU whose cache it uses */
+        const uint64_t state = interrupt::save();
+        StackCache& cache = local_cache();
+        if (cache.count)
+        {
+            const uintptr_t slot = cache.stacks[--cache.count];
+            interrupt::restore(state);
+            return slot + SLOT_SIZE;
+        }
+        interrupt::restore(state);
+
+        const uintptr_t slot = take_slot();
+        if (!slot)
+            return 0;
+
+        /* the guard page at the bottom of the slot is never mapped */
+        const uintptr_t base = slot + GUARD_PAGES * PAGE_SIZE;
+        for (size_t i = 0; i < PAGES; i++)
+        {
+            const uintptr_t phys = pmm::pmalloc(1);
+            if (!phys || !vmm::map_page(base + i * PAGE_SIZE, phys, KERNEL_RW))
+            {
+                if (phys)
+                    pmm::pfree(phys);
+
+                /* unmaps and frees the pages mapped so far */
+                put_slot(slot);
+                return 0;
+            }
+        }
+
+        return slot + SLOT_SIZE;
+    }
+
+    void KernelStack::free(uintptr_t top) noexcept
+    {
+        if (!top)
+            return;
+
+        const uintptr_t slot = top - SLOT_SIZE;
+
+        const uint64_t state = interrupt::save();
+        StackCache& cache = local_cache();
+        if (cache.count < CACHE_SIZE)
+        {
+            cache.stacks[cache.count++] = slot;
+            interrupt::restore(state);
+            return;
+        }
+        interrupt::restore(state);
+
+        put_slot(slot);
+    }
+}
@@ -0,0 +1,61 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.hpp>
+#include <kafka/percpu.hpp>
+#include <kafka/pmem.hpp>
+#include <kafka/hal/vmem.hpp>
+
+namespace kfk
+{
+    static constexpr size_t PAGE_SIZE = 4096;
+
+    PER_CPU uintptr_t this_cpu_off = 0;
+
+    static uintptr_t offsets[MAX_CPUS] = {};
+
+    uintptr_t PerCpu::setup(uint32_t id) noexcept
+    {
+        if (id >= MAX_CPUS)
+            return 0;
+
+        if (offsets[id])
+            return offsets[id];
+
+        const size_t size = __percpu_end - __percpu_start;
+        const size_t span = size ? (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1) : PAGE_SIZE;
+
+        /* copies sit back to back in their own area; page-sized slots keep neighbours off each other's lines */
+        const MemoryRegion area = vmm::area(KernelArea::PERCPU);
+        const uintptr_t base = area.start + id * span;
+        if (base + span > area.end)
+            return 0;
+
+        for (size_t done = 0; done < span; done += PAGE_SIZE)
+        {
+            const uintptr_t phys = pmm::pmalloc(1);
+            if (!phys || !vmm::map_page(base + done, phys, KERNEL_RW))
+            {
+                if (phys)
+                    pmm::pfree(phys);
+                vmm::unmap_kernel(base, done);
+                return 0;
+            }
+        }
+
+        auto* copy = reinterpret_cast<char*>(base);
+        memcpy(copy, __percpu_start, size);
+
+        const uintptr_t offset = reinterpret_cast<uintptr_t>(copy) - reinterpret_cast<uintptr_t>(__percpu_start);
+        *reinterpret_cast<uintptr_t*>(offset + reinterpret_cast<uintptr_t>(&this_cpu_off)) = offset;
+
+        offsets[id] = offset;
+        return offset;
+    }
+
+    uintptr_t PerCpu::offset(uint32_t id) noexcept
+    {
+        return id < MAX_CPUS ? offsets[id] : 0;
+    }
+}
@@ -3,17 +3,58 @@
 #include <limine.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <algorithm.hpp>
+#include <atomic.hpp>
 #include <iostream.hpp>
 #include <string.hpp>
 #include <kafka/pmem.hpp>
 #include <kafka/region.hpp>
 #include <kafka/slub.hpp>
+#include <kafka/hal/simd.hpp>
 
 namespace kfk
 {
     static constexpr size_t PAGE_SIZE = 4096;
     static uint64_t hhdm_offset = 0;
 
+    /* frame metadata table covering every usable frame */
+    static PageFrame* frames = nullptr;
+    static size_t frame_count = 0;
+
+    /* guards the region manager and the frame refcounts; init runs on the BSP alone */
+    static IrqSpinlock pmm_lock;
+    static constexpr size_t REGION_SLACK = 2; /* regions an allocation or release can add before it merges */
+
+    /* `pmm_lock` held; on failure the range stays allocated */
+    static void release_locked(uintptr_t base, size_t len) noexcept
+    {
+        if (RegionManager::reserve(REGION_SLACK, pmm_lock))
+            RegionManager::release(base, len);
+    }
+
+    static bool init_frames(const limine_memmap_response* response) noexcept
+    {
+        uintptr_t top = 0;
+        for (size_t i = 0; i < response->entry_count; i++)
+        {
+            const auto entry = response->entries[i];
+            if (entry->type == LIMINE_MEMMAP_USABLE && entry->base + entry->length > top)
+                top = entry->base + entry->length;
+        }
+
+        const size_t count = top / PAGE_SIZE;
+        const size_t pages = (count * sizeof(PageFrame) + PAGE_SIZE - 1) / PAGE_SIZE;
+
+        /* pmalloc hands out zeroed memory so every frame starts exclusively owned */
+        const uintptr_t table = PhysicalPageManager::pmalloc(pages);
+        if (!table)
+            return false;
+
+        frames = reinterpret_cast<PageFrame*>(table + hhdm_offset);
+        frame_count = count;
+        return true;
+    }
+
     bool PhysicalPageManager::init(volatile limine_memmap_request *mmap, uint64_t offset) noexcept
     {
         const limine_memmap_response* response = mmap->response;
@@ -41,7 +82,7 @@ namespace kfk
         RegionManager::sort();
         RegionManager::merge_adjacent();
         //RegionManager::dump();
-        return true;
+        return init_frames(response);
     }
 
     uintptr_t PhysicalPageManager::pmalloc(const uint64_t n) noexcept
@@ -50,9 +91,15 @@ namespace kfk
             return 0;
             
         const size_t size = n * PAGE_SIZE;
-        Region* region = RegionManager::find_best_fit(size);
+        pmm_lock.lock();
+        Region* region = nullptr;
+        if (RegionManager::reserve(REGION_SLACK, pmm_lock)) /* may drop the lock, so search after */
+            region = RegionManager::find_best_fit(size);
         if (!region)
+        {
+            pmm_lock.unlock();
             return 0;
+        }
             
         const uintptr_t alloc_base = region->base;
         
@@ -63,19 +110,16 @@ namespace kfk
         else
         {
             if (!RegionManager::split(region, size))
+            {
+                pmm_lock.unlock();
                 return 0;
+            }
                 
             region->set_free(false);
         }
+        pmm_lock.unlock();
         
-        constexpr size_t CACHE_LINE = 64;
-        auto* ptr = reinterpret_cast<volatile uint8_t*>(alloc_base + hhdm_offset);
-        
-        for (size_t offset = 0; offset < size; offset += CACHE_LINE)
-        {
-            for (size_t i = 0; i < CACHE_LINE && offset + i < size; i++)
-                ptr[offset + i] = 0;
-        }
+        simd::clear_pages(reinterpret_cast<void*>(alloc_base + hhdm_offset), n);
         
         return alloc_base;
     }
@@ -84,29 +128,53 @@ namespace kfk
     {
         if (base == 0 || n == 0)
             return;
-            
-        const size_t size = n * PAGE_SIZE;
-        Region* region = RegionManager::find(base);
-        if (!region || region->is_free())
+
+        /* any page range of an allocation can go back, not only a whole one */
+        pmm_lock.lock();
+        release_locked(base, n * PAGE_SIZE);
+        pmm_lock.unlock();
+    }
+
+    void PhysicalPageManager::pfree_batch(uintptr_t* frames, size_t count) noexcept
+    {
+        if (count == 0)
             return;
-            
-        if (region->len == size)
-        {
-            region->set_free(true);
-        }
-        else if (size < region->len)
+
+        isort(frames, count);
+
+        /* hand contiguous runs back in one go */
+        pmm_lock.lock();
+        size_t run = 0;
+        for (size_t i = 1; i <= count; i++)
         {
-            if (!RegionManager::split(region, size))
-                return;
-                
-            region->set_free(true);
+            if (i < count && frames[i] == frames[i - 1] + PAGE_SIZE)
+                continue;
+
+            release_locked(frames[run], (i - run) * PAGE_SIZE);
+            run = i;
         }
-        else
+        pmm_lock.unlock();
+    }
+
+    void PhysicalPageManager::pput_batch(uintptr_t* frames, size_t count) noexcept
+    {
+        /* frames still shared only lose a reference; the rest are freed together */
+        size_t last = 0;
+        pmm_lock.lock();
+        for (size_t i = 0; i < count; i++)
         {
-            return;
+            PageFrame* f = frame(frames[i]);
+            if (!f)
+                continue; /* device or firmware memory; never ours to free */
+
+            if (f->refs > 0)
+                f->refs--;
+            else
+                frames[last++] = frames[i] & ~(PAGE_SIZE - 1);
         }
-        
-        RegionManager::merge_adjacent();
+        pmm_lock.unlock();
+
+        pfree_batch(frames, last);
     }
 
     void* PhysicalPageManager::phys_to_virt(uintptr_t phys) noexcept
@@ -114,6 +182,41 @@ namespace kfk
         return reinterpret_cast<void*>(phys + hhdm_offset);
     }
     
+    PageFrame* PhysicalPageManager::frame(uintptr_t phys) noexcept
+    {
+        const size_t pfn = phys / PAGE_SIZE;
+        return pfn < frame_count ? &frames[pfn] : nullptr;
+    }
+
+    void PhysicalPageManager::pget(uintptr_t phys) noexcept
+    {
+        if (PageFrame* f = frame(phys))
+        {
+            pmm_lock.lock();
+            f->refs++;
+            pmm_lock.unlock();
+        }
+    }
+
+    bool PhysicalPageManager::pput(uintptr_t phys) noexcept
+    {
+        PageFrame* f = frame(phys);
+        if (!f)
+            return false; /* device or firmware memory; never ours to free */
+
+        pmm_lock.lock();
+        if (f->refs > 0)
+        {
+            f->refs--; /* still mapped somewhere else */
+            pmm_lock.unlock();
+            return false;
+        }
+
+        release_locked(phys & ~(PAGE_SIZE - 1), PAGE_SIZE);
+        pmm_lock.unlock();
+        return true;
+    }
+
     void PhysicalPageManager::dynamic_mode() noexcept
     {
         Slub::init(); /* note: no side effect if it's already initialized*/
@@ -0,0 +1,193 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic.hpp>
+#include <kafka/percpu.hpp>
+#include <kafka/rcu.hpp>
+#include <kafka/hal/cpu.hpp>
+#include <kafka/hal/interrupt.hpp>
+
+namespace kfk
+{
+    /*
+     * per-CPU state. callbacks move through two lists: `next` collects new
+     * ones, and on a quiescent state the whole list becomes `waiting` behind a
+     * freshly started grace period, so one grace period covers a whole batch
+     */
+    struct RcuCpu
+    {
+        Atomic<uint64_t> passed; /* latest grace period this CPU has been quiescent in */
+        Atomic<bool> idle;
+        unsigned int read_depth;
+        unsigned int idle_irqs; /* nesting of interrupts taken while idle; `idle` is clear until it drops to 0 */
+
+        RcuHead* next;
+        RcuHead** next_tail;
+        RcuHead* waiting;
+        uint64_t waiting_gp; /* grace period `waiting` is queued behind */
+    };
+
+    PER_CPU static RcuCpu rcu_cpu = {};
+
+    static Atomic<uint64_t> gp_seq(0); /* last grace period started */
+
+    static RcuCpu& local_cpu()
+    {
+        return *this_cpu_ptr(rcu_cpu);
+    }
+
+    /* start a grace period; every CPU has to pass a quiescent state after this */
+    static uint64_t start_gp()
+    {
+        return gp_seq.fetch_add(1, MemoryOrder::ACQ_REL) + 1;
+    }
+
+    static bool gp_done(uint64_t gp)
+    {
+        /* ids are handed out densely, so CPUs past `count` have never run a reader */
+        const uint32_t count = cpu::count();
+        for (uint32_t i = 0; i < count; i++)
+        {
+            RcuCpu* cpu = per_cpu_ptr(rcu_cpu, i);
+
+            /* seq_cst pairs with `idle_exit`: either we see it awake or it sees the new version */
+            if (cpu->idle.load(MemoryOrder::SEQCST))
+                continue;
+
+            if (cpu->passed.load(MemoryOrder::ACQUIRE) < gp)
+                return false;
+        }
+        return true;
+    }
+
+    /* this CPU is outside any read-side section; say so for every grace period started so far */
+    static void report(RcuCpu& cpu)
+    {
+        /* release orders this CPU's earlier reads before the report */
+        cpu.passed.store(gp_seq.load(MemoryOrder::ACQUIRE), MemoryOrder::RELEASE);
+    }
+
+    void Rcu::read_lock() noexcept
+    {
+        this_cpu_add(rcu_cpu.read_depth, 1u);
+        asm volatile("" : : : "memory"); /* keep the section's loads inside it */
+    }
+
+    void Rcu::read_unlock() noexcept
+    {
+        asm volatile("" : : : "memory");
+        this_cpu_sub(rcu_cpu.read_depth, 1u);
+    }
+
+    bool Rcu::in_read() noexcept
+    {
+        return this_cpu_read(rcu_cpu.read_depth) != 0;
+    }
+
+    void Rcu::synchronize() noexcept
+    {
+        const uint64_t gp = start_gp();
+        report(local_cpu()); /* the caller is not in a read-side section */
+
+        while (!gp_done(gp))
+            cpu_relax();
+    }
+
+    void Rcu::call(RcuHead* head, void (*func)(RcuHead*)) noexcept
+    {
+        head->next = nullptr;
+        head->func = func;
+
+        /* interrupts off keeps the list consistent against handlers queueing on the same CPU */
+        const uint64_t state = interrupt::save();
+
+        RcuCpu& cpu = local_cpu();
+        if (!cpu.next_tail)
+            cpu.next_tail = &cpu.next;
+
+        *cpu.next_tail = head;
+        cpu.next_tail = &head->next;
+
+        interrupt::restore(state);
+    }
+
+    void Rcu::idle_enter() noexcept
+    {
+        RcuCpu& cpu = local_cpu();
+        report(cpu);
+        cpu.idle.store(true, MemoryOrder::RELEASE);
+    }
+
+    void Rcu::idle_exit() noexcept
+    {
+        local_cpu().idle.store(false, MemoryOrder::SEQCST);
+    }
+
+    void Rcu::irq_enter() noexcept
+    {
+        RcuCpu& cpu = local_cpu();
+        if (cpu.idle_irqs)
+        {
+            cpu.idle_irqs++;
+        }
+        else if (cpu.idle.load(MemoryOrder::RELAXED))
+        {
+            /* same ordering as `idle_exit`: a grace period either sees us awake or we see the new version */
+            cpu.idle.store(false, MemoryOrder::SEQCST);
+            cpu.idle_irqs = 1;
+        }
+    }
+
+    void Rcu::irq_exit() noexcept
+    {
+        RcuCpu& cpu = local_cpu();
+        if (cpu.idle_irqs && --cpu.idle_irqs == 0)
+        {
+            report(cpu); /* the handler's reads are done */
+            cpu.idle.store(true, MemoryOrder::RELEASE);
+        }
+    }
+
+    void Rcu::quiescent() noexcept
+    {
+        RcuCpu& cpu = local_cpu();
+        if (cpu.read_depth)
+            return; /* not quiescent; the next call will do */
+
+        report(cpu);
+
+        RcuHead* ready = nullptr;
+        const uint64_t state = interrupt::save();
+
+        if (cpu.waiting && gp_done(cpu.waiting_gp))
+        {
+            ready = cpu.waiting;
+            cpu.waiting = nullptr;
+        }
+
+        if (!cpu.waiting && cpu.next)
+        {
+            cpu.waiting = cpu.next;
+            cpu.waiting_gp = start_gp();
+            cpu.next = nullptr;
+            cpu.next_tail = &cpu.next;
+        }
+
+        interrupt::restore(state);
+
+        /* callbacks may free or queue more; run them with interrupts back on */
+        while (ready)
+        {
+            RcuHead* head = ready;
+            ready = ready->next;
+            head->func(head);
+        }
+    }
+
+    bool Rcu::pending() noexcept
+    {
+        const RcuCpu& cpu = local_cpu();
+        return cpu.next || cpu.waiting;
+    }
+}
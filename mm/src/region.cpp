@@ -176,6 +176,95 @@ namespace kfk
         return true;
     }
 
+    bool RegionManager::release(uintptr_t base, size_t len) noexcept
+    {
+        if (len == 0)
+            return false;
+
+        /* every pmalloc is its own used region, so a coalesced batch can cross several; check them all first */
+        for (uintptr_t addr = base; addr < base + len; )
+        {
+            const size_t index = locate(addr);
+            if (index == count || regions[index].is_free())
+                return false;
+            addr = regions[index].base + regions[index].len;
+        }
+
+        /* one region at a time; merging may move the array, so locate each afresh */
+        while (len > 0)
+        {
+            const size_t index = locate(base);
+            const size_t left = regions[index].base + regions[index].len - base;
+            const size_t chunk = left < len ? left : len;
+            if (!release_in(index, base, chunk))
+                return false;
+
+            base += chunk;
+            len -= chunk;
+        }
+
+        return true;
+    }
+
+    bool RegionManager::release_in(size_t index, uintptr_t base, size_t len) noexcept
+    {
+        /* carve [base, base + len) out of the used region; `split` may move the array */
+        if (base > regions[index].base)
+        {
+            if (!split(&regions[index], base - regions[index].base))
+                return false;
+            index++;
+        }
+
+        if (regions[index].len > len && !split(&regions[index], len))
+            return false;
+
+        regions[index].set_free(true);
+
+        /* the array stays sorted, so only the direct neighbours can merge */
+        if (index + 1 < count && regions[index + 1].is_free() &&
+            regions[index].base + regions[index].len == regions[index + 1].base)
+        {
+            regions[index].len += regions[index + 1].len;
+            remove(index + 1);
+        }
+
+        if (index > 0 && regions[index - 1].is_free() &&
+            regions[index - 1].base + regions[index - 1].len == regions[index].base)
+        {
+            regions[index - 1].len += regions[index].len;
+            remove(index);
+        }
+
+        return true;
+    }
+
+    size_t RegionManager::locate(uintptr_t addr) noexcept
+    {
+        /* last region starting at or below `addr` */
+        size_t left = 0;
+        size_t right = count;
+        while (left < right)
+        {
+            const size_t mid = left + (right - left) / 2;
+            if (regions[mid].base <= addr)
+                left = mid + 1;
+            else
+                right = mid;
+        }
+
+        if (left == 0 || addr >= regions[left - 1].base + regions[left - 1].len)
+            return count;
+
+        return left - 1;
+    }
+
+    void RegionManager::remove(size_t index) noexcept
+    {
+        memmove(&regions[index], &regions[index + 1], (count - index - 1) * sizeof(Region));
+        count--;
+    }
+
     bool RegionManager::grow(size_t new_capacity) noexcept
     {
         Region* new_regions = static_cast<Region*>(
@@ -184,16 +273,21 @@ namespace kfk
         if (!new_regions)
             return false;
             
-        memcpy(new_regions, regions, count * sizeof(Region));
-        memset(&new_regions[count], 0, (new_capacity - count) * sizeof(Region));
-        
-        region_alloc.free(regions);
-        
-        regions = new_regions;
-        capacity = new_capacity;
+        region_alloc.free(adopt(new_regions, new_capacity));
         return true;
     }
 
+    Region* RegionManager::adopt(Region* fresh, size_t new_capacity) noexcept
+    {
+        memcpy(fresh, regions, count * sizeof(Region));
+        memset(&fresh[count], 0, (new_capacity - count) * sizeof(Region));
+
+        Region* old = regions;
+        regions = fresh;
+        capacity = new_capacity;
+        return old;
+    }
+
     void RegionManager::dump() noexcept
     {
         kfk::println("memory regions:");
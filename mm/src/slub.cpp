@@ -1,6 +1,7 @@
 /* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
 
 #include <allocator.hpp>
+#include <atomic.hpp>
 #include <iostream.hpp>
 #include <string.hpp>
 #include <kafka/slub.hpp>
@@ -36,6 +37,13 @@ namespace kfk
     SlubCache *large_caches[LARGE_SIZES_COUNT] = { nullptr };
     bool initialized = false;
 
+    /*
+     * guards every cache's slab list. never held across a call into the vmm or
+     * pmm: those grow through the heap themselves, so new slabs are built
+     * unlocked and linked in afterwards
+     */
+    static IrqSpinlock slub_lock;
+
     static void *alloc_from_buffer(size_t size)
     {
         /* align to 8 bytes */
@@ -238,33 +246,30 @@ namespace kfk
             /* too big for this cache */
             return Slub::allocate(total_size);
 
+        slub_lock.lock();
         SlubSlab *slab = slabs;
-        SlubSlab *prev = nullptr;
-
         while (slab && slab->free_objects == 0)
-        {
-            prev = slab;
             slab = slab->next;
-        }
 
         /* create a new one if no slab with free objects found */
         if (!slab)
         {
+            slub_lock.unlock();
             slab = create_slab();
             if (!slab)
                 return nullptr;
 
-            /* add to slab list */
-            if (prev)
-                prev->next = slab;
-            else
-                slabs = slab;
+            /* add to slab list; at the head, as the list may have changed meanwhile */
+            slub_lock.lock();
+            slab->next = slabs;
+            slabs = slab;
         }
 
         /* get object from free list */
         SlubObject *obj = slab->free_list;
         slab->free_list = obj->next_free;
         slab->free_objects--;
+        slub_lock.unlock();
 
         /* zero-out; security reasons */
         memset(obj, 0, obj_size);
@@ -274,6 +279,7 @@ namespace kfk
     bool SlubCache::free(void *ptr)
     {
         /* check if this object belongs to any of our slabs */
+        LockGuard<IrqSpinlock> guard(slub_lock);
         for (SlubSlab *slab = slabs; slab; slab = slab->next)
         {
             uintptr_t slab_start = reinterpret_cast<uintptr_t>(slab->memory);
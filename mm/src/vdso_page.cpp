@@ -0,0 +1,82 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <kafka/aspace.hpp>
+#include <kafka/pmem.hpp>
+#include <kafka/vdso_page.hpp>
+#include <kafka/vmobject.hpp>
+#include <kafka/hal/vmem.hpp>
+
+namespace kfk
+{
+    static constexpr size_t PAGE_SIZE = 4096;
+
+    static_assert(sizeof(VdsoData) <= PAGE_SIZE);
+
+    static VmObject* object = nullptr; /* one reference of ours; every mapping holds another */
+    static VdsoData* page = nullptr; /* the kernel's view of it */
+
+    /* readers retry while `seq` is odd or changed; the fence keeps the field stores after the odd one */
+    static void write_begin()
+    {
+        __atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+
+    static void write_end()
+    {
+        __atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELEASE);
+    }
+
+    bool VdsoPage::init() noexcept
+    {
+        object = VmObject::create(PAGE_SIZE);
+        if (!object)
+            return false;
+
+        const uintptr_t phys = object->page(0);
+        if (!phys)
+        {
+            object->put();
+            object = nullptr;
+            return false;
+        }
+
+        page = static_cast<VdsoData*>(pmm::phys_to_virt(phys));
+        return true;
+    }
+
+    bool VdsoPage::map(AddressSpace* space) noexcept
+    {
+        if (!object)
+            return false;
+
+        const VmmFlags flags = VmmFlags::MAP_SHARED | VmmFlags::MAP_FIXED;
+        return space->mmap(VDSO_DATA_ADDRESS, PAGE_SIZE, VmmFlags::PROT_READ, flags, object, 0) ==
+               VDSO_DATA_ADDRESS;
+    }
+
+    void VdsoPage::add_flags(uint32_t flags) noexcept
+    {
+        if (!page)
+            return;
+
+        write_begin();
+        __atomic_store_n(&page->flags, page->flags | flags, __ATOMIC_RELAXED);
+        write_end();
+    }
+
+    void VdsoPage::update_clock(uint64_t base_tsc, uint64_t base_ns, uint64_t mult, uint32_t shift) noexcept
+    {
+        if (!page)
+            return;
+
+        write_begin();
+        __atomic_store_n(&page->base_tsc, base_tsc, __ATOMIC_RELAXED);
+        __atomic_store_n(&page->base_ns, base_ns, __ATOMIC_RELAXED);
+        __atomic_store_n(&page->mult, mult, __ATOMIC_RELAXED);
+        __atomic_store_n(&page->shift, shift, __ATOMIC_RELAXED);
+        write_end();
+    }
+}
@@ -0,0 +1,75 @@
+/* this file is a part of Kafka kernel which is under MIT license; see LICENSE for more info */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <kafka/heap.hpp>
+#include <kafka/pmem.hpp>
+#include <kafka/vmobject.hpp>
+
+namespace kfk
+{
+    static constexpr size_t PAGE_SIZE = 4096;
+
+    VmObject* VmObject::create(size_t size) noexcept
+    {
+        const size_t count = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+        if (count == 0)
+            return nullptr;
+
+        auto* object = static_cast<VmObject*>(heap::allocate(sizeof(VmObject)));
+        if (!object)
+            return nullptr;
+
+        object->pages = static_cast<uintptr_t*>(heap::allocate(sizeof(uintptr_t), count));
+        if (!object->pages)
+        {
+            heap::free(object);
+            return nullptr;
+        }
+
+        for (size_t i = 0; i < count; i++)
+            object->pages[i] = 0;
+
+        object->page_count = count;
+        object->refs.store(1, MemoryOrder::RELAXED);
+        return object;
+    }
+
+    void VmObject::get() noexcept
+    {
+        refs.fetch_add(1, MemoryOrder::RELAXED);
+    }
+
+    void VmObject::put() noexcept
+    {
+        if (refs.fetch_sub(1, MemoryOrder::ACQ_REL) != 1)
+            return;
+
+        /* mappings hold their own frame references; this only drops the object's */
+        for (size_t i = 0; i < page_count; i++)
+        {
+            if (pages[i])
+                pmm::pput(pages[i]);
+        }
+
+        heap::free(pages);
+        heap::free(this);
+    }
+
+    uintptr_t VmObject::page(size_t offset) noexcept
+    {
+        const size_t index = offset / PAGE_SIZE;
+        if (index >= page_count)
+            return 0;
+
+        if (!pages[index])
+            pages[index] = pmm::pmalloc(1); /* comes back zeroed */
+
+        return pages[index];
+    }
+
+    size_t VmObject::size() const noexcept
+    {
+        return page_count * PAGE_SIZE;
+    }
+}